@@ -0,0 +1,122 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  perf_counters.h
+ *
+ *    Description:  Hardware counters of the benchmark phases, read with
+ *                  perf_event_open.
+ *
+ * ============================================================================
+ */
+
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Counters of the calling process in user mode, threads started while they
+// run included. Each event is opened on its own, so a counter the kernel or
+// the CPU does not offer (in containers and VMs perf_event_open often fails
+// with EACCES or ENOENT) is left out and reads as unavailable while the
+// others still count. Multiplexed counts are scaled to the time enabled.
+enum {
+   PERF_CYCLES,
+   PERF_INSTRUCTIONS,
+   PERF_LLC_MISSES,
+   PERF_DTLB_MISSES,
+   PERF_BRANCH_MISSES,
+   PERF_NCOUNTERS
+};
+
+typedef struct perf_counters {
+   int fds[PERF_NCOUNTERS];
+   double values[PERF_NCOUNTERS];	// of the last phase, or -1 if unavailable
+} perf_counters;
+
+static const char *perf_counter_names[PERF_NCOUNTERS] = {"cycles",
+   "instructions", "LLC-misses", "dTLB-misses", "branch-misses"};
+
+// Returns the number of counters opened.
+static inline int perf_counters_open(perf_counters *pc) {
+   const struct {
+      uint32_t type;
+      uint64_t config;
+   } events[PERF_NCOUNTERS] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+   };
+   int nopen = 0;
+   for (int i = 0; i < PERF_NCOUNTERS; i++) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+         PERF_FORMAT_TOTAL_TIME_RUNNING;
+      pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      pc->values[i] = -1;
+      nopen += pc->fds[i] >= 0;
+   }
+   return nopen;
+}
+
+static inline void perf_counters_close(perf_counters *pc) {
+   for (int i = 0; i < PERF_NCOUNTERS; i++) {
+      if (pc->fds[i] >= 0)
+         close(pc->fds[i]);
+      pc->fds[i] = -1;
+   }
+}
+
+static inline void perf_counters_start(perf_counters *pc) {
+   for (int i = 0; i < PERF_NCOUNTERS; i++) {
+      if (pc->fds[i] >= 0) {
+         ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+         ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+   }
+}
+
+static inline void perf_counters_stop(perf_counters *pc) {
+   for (int i = 0; i < PERF_NCOUNTERS; i++) {
+      uint64_t data[3];	// value, time enabled, time running
+      pc->values[i] = -1;
+      if (pc->fds[i] < 0)
+         continue;
+      ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(pc->fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+         continue;
+      pc->values[i] = (double)data[0] * data[1] / data[2];
+   }
+}
+
+// Prints the counts of the last phase per operation, on one line.
+static inline void perf_counters_print(const perf_counters *pc, uint64_t
+      nops) {
+   printf("  ");
+   for (int i = 0; i < PERF_NCOUNTERS; i++) {
+      if (pc->values[i] < 0)
+         printf(" %s/op n/a", perf_counter_names[i]);
+      else
+         printf(" %s/op %.3f", perf_counter_names[i], pc->values[i] / nops);
+   }
+   printf("\n");
+}
+
+#endif	// _PERF_COUNTERS_H_
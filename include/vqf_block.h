@@ -0,0 +1,845 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_block.h
+ *
+ *    Description:  Block layouts of the 8, 12 and 16-bit tag sizes and the
+ *                  kernels that work on them.
+ *
+ * ============================================================================
+ */
+
+#ifndef _VQF_BLOCK_H_
+#define _VQF_BLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>  // portable to all x86 compilers
+#include <tmmintrin.h>
+
+#include "vqf_filter.h"
+#include "vqf_precompute.h"
+
+// Block kernels. vqf_block_traits<TAG_BITS> holds the layout constants and
+// the metadata and tag operations of one tag size. The filter code is written
+// once against it and instantiated for every tag size.
+//
+// The kernels are compiled once per instruction set (see the Makefile) and
+// every build goes in its own namespace, picked from the target flags.
+//
+// PDEP and PEXT are microcoded on AMD Zen1 and Zen2. Builds with VQF_NO_PDEP
+// use a broadword select and plain shifts on the metadata instead.
+#if defined(__AVX512BW__) && defined(__AVX512VBMI__) && defined(__BMI2__)
+#define VQF_HAVE_AVX512
+#define VQF_HAVE_AVX2
+#define VQF_HAVE_BMI2
+#define VQF_HAVE_PDEP
+#define VQF_VARIANT vqf_avx512
+#define VQF_VARIANT_ID VQF_VARIANT_AVX512
+#elif defined(__AVX2__) && defined(__BMI2__) && defined(VQF_NO_PDEP)
+#define VQF_HAVE_AVX2
+#define VQF_HAVE_BMI2
+#define VQF_VARIANT vqf_avx2_nopdep
+#define VQF_VARIANT_ID VQF_VARIANT_AVX2_NOPDEP
+#elif defined(__AVX2__) && defined(__BMI2__)
+#define VQF_HAVE_AVX2
+#define VQF_HAVE_BMI2
+#define VQF_HAVE_PDEP
+#define VQF_VARIANT vqf_avx2
+#define VQF_VARIANT_ID VQF_VARIANT_AVX2
+#else
+#define VQF_VARIANT vqf_generic
+#define VQF_VARIANT_ID VQF_VARIANT_GENERIC
+#endif
+
+#ifdef VQF_HAVE_AVX512
+extern __m512i SHUFFLE [];
+extern __m512i SHUFFLE_REMOVE [];
+extern __m512i SHUFFLE16 [];
+extern __m512i SHUFFLE_REMOVE16 [];
+extern __m512i EXPAND12 [];
+extern __m512i COMPACT12 [];
+#endif
+
+namespace VQF_VARIANT {
+
+static inline int word_rank(uint64_t val) {
+   return __builtin_popcountll(val);
+}
+
+// Returns 64 for 0, like tzcnt.
+static inline uint64_t word_tzcnt(uint64_t val) {
+#ifdef VQF_HAVE_BMI2
+   return _tzcnt_u64(val);
+#else
+   return val != 0 ? __builtin_ctzll(val) : 64;
+#endif
+}
+
+#ifndef VQF_HAVE_PDEP
+#define VQF_L8 0x0101010101010101ULL
+#define VQF_H8 0x8080808080808080ULL
+
+// 0x01 in every byte of x that is <= the same byte of y. Bytes must be < 128.
+static inline uint64_t bytes_le(uint64_t x, uint64_t y) {
+   return (((y | VQF_H8) - x) & VQF_H8) >> 7;
+}
+
+// Broadword select: the position of the rank'th 1 of val, for rank <
+// popcount(val). Byte-wise prefix popcounts find the byte holding it and a
+// table finds the bit in that byte. Other ranks return a position <= 64.
+static inline uint64_t broadword_select(uint64_t val, uint64_t rank) {
+   uint64_t sums = val - ((val >> 1) & 0x5555555555555555ULL);
+   sums = (sums & 0x3333333333333333ULL) + ((sums >> 2) & 0x3333333333333333ULL);
+   sums = ((sums + (sums >> 4)) & 0x0f0f0f0f0f0f0f0fULL) * VQF_L8;
+   uint64_t byte = ((bytes_le(sums, rank * VQF_L8) * VQF_L8 >> 56) & 7) * 8;
+   rank -= ((sums << 8) >> byte) & 0xff;
+   return byte + select_in_byte_table[256 * (rank & 7) + ((val >> byte) & 0xff)];
+}
+#endif
+
+// Returns the rank'th 1 of val as a mask (rank = 0 returns the 1st 1), i.e.
+// pdep(one[rank], val). Returns 0 if there are fewer than rank+1 1s or rank
+// is negative.
+static inline uint64_t rank_bit(uint64_t val, int64_t rank) {
+#ifdef VQF_HAVE_PDEP
+   return _pdep_u64(one[rank], val);
+#else
+   uint64_t found = (uint64_t)rank < (uint64_t)word_rank(val);
+   return found << (broadword_select(val, rank & 63) & 63);
+#endif
+}
+
+#ifdef VQF_HAVE_PDEP
+// Returns the position of the rank'th 1.  (rank = 0 returns the 1st 1)
+// Returns 64 if there are fewer than rank+1 1s.
+static inline uint64_t word_select(uint64_t val, int rank) {
+   val = _pdep_u64(one[rank], val);
+   return _tzcnt_u64(val);
+}
+
+// select(vec, 0) -> -1
+// select(vec, i) -> 128, if i > popcnt(vec)
+static inline int64_t select_128_old(__uint128_t vector, uint64_t rank) {
+   uint64_t lower_word = vector & 0xffffffffffffffff;
+   uint64_t lower_pdep = _pdep_u64(one[rank], lower_word);
+   //uint64_t lower_select = word_select(lower_word, rank);
+   if (lower_pdep != 0) {
+      //assert(rank < word_rank(lower_word));
+      return _tzcnt_u64(lower_pdep);
+   }
+   rank = rank - word_rank(lower_word);
+   uint64_t higher_word = vector >> 64;
+   return word_select(higher_word, rank) + 64;
+}
+#endif
+
+static inline uint64_t lookup_64(uint64_t vector, uint64_t rank) {
+   uint64_t lower_return = rank_bit(vector, rank) >> rank << (sizeof(uint64_t)/2);
+   return lower_return;
+}
+
+template <uint64_t BUCKETS>
+static inline uint64_t lookup_128(uint64_t lower_word, uint64_t higher_word,
+      uint64_t rank) {
+   uint64_t lower_rank = word_rank(lower_word);
+   uint64_t lower_return = rank_bit(lower_word, rank) >> rank << sizeof(__uint128_t);
+   int64_t higher_rank = (int64_t)rank - lower_rank;
+   uint64_t higher_return = rank_bit(higher_word, higher_rank);
+   // 12-bit blocks have 96 buckets, so rank can go past 64 + 16.
+   if (BUCKETS > 64 + sizeof(__uint128_t) && rank > 64 + sizeof(__uint128_t))
+      return lower_return + (higher_return >> (rank - 64 - sizeof(__uint128_t)));
+   higher_return <<= (64 + sizeof(__uint128_t) - rank);
+   return lower_return + higher_return;
+}
+
+// The top bit of the metadata is the block lock, so a block holds one slot
+// less than its metadata has room for and the helpers below leave that bit
+// alone.
+#define VQF_MD_LOCK_BIT (1ULL << 63)
+#define VQF_MD_TOP_BIT (1ULL << 62)
+
+// update_md inserts a 0 at bit index of the metadata and shifts the higher
+// bits up. remove_md deletes bit index and shifts a 1 in at the top.
+#ifdef VQF_HAVE_PDEP
+static inline void update_md_128(uint64_t *md, uint8_t index) {
+   uint64_t lock = md[1] & VQF_MD_LOCK_BIT;
+   uint64_t carry = (md[0] >> 63) & carry_pdep_table[index];
+   md[1] = (_pdep_u64(md[1],         high_order_pdep_table[index]) | carry) &
+      ~VQF_MD_LOCK_BIT;
+   md[1] |= lock;
+   md[0] = _pdep_u64(md[0],         low_order_pdep_table[index]);
+}
+
+static inline void remove_md_128(uint64_t *md, uint8_t index) {
+   uint64_t lock = md[1] & VQF_MD_LOCK_BIT;
+   uint64_t carry = (md[1] & carry_pdep_table[index]) << 63;
+   md[1] = _pext_u64(md[1],  high_order_pdep_table[index]) | VQF_MD_TOP_BIT |
+      lock;
+   md[0] = _pext_u64(md[0],  low_order_pdep_table[index]) | carry;
+}
+
+static inline void update_md_64(uint64_t *md, uint8_t index) {
+   uint64_t lock = *md & VQF_MD_LOCK_BIT;
+   *md = (_pdep_u64(*md, low_order_pdep_table[index]) & ~VQF_MD_LOCK_BIT) |
+      lock;
+}
+
+static inline void remove_md_64(uint64_t *md, uint8_t index) {
+   uint64_t lock = *md & VQF_MD_LOCK_BIT;
+   *md = _pext_u64(*md, low_order_pdep_table[index]) | VQF_MD_TOP_BIT | lock;
+}
+#else
+static inline void update_md_128(uint64_t *md, uint8_t index) {
+   uint64_t lock = md[1] & VQF_MD_LOCK_BIT;
+   __uint128_t vector = (__uint128_t)md[1] << 64 | md[0];
+   __uint128_t low = ((__uint128_t)1 << index) - 1;
+   vector = (vector & low) | ((vector & ~low) << 1);
+   md[0] = vector;
+   md[1] = ((vector >> 64) & ~VQF_MD_LOCK_BIT) | lock;
+}
+
+static inline void remove_md_128(uint64_t *md, uint8_t index) {
+   uint64_t lock = md[1] & VQF_MD_LOCK_BIT;
+   __uint128_t vector = (__uint128_t)md[1] << 64 | md[0];
+   __uint128_t low = ((__uint128_t)1 << index) - 1;
+   vector = (vector & low) | ((vector >> 1) & ~low);
+   md[0] = vector;
+   md[1] = (vector >> 64) | VQF_MD_TOP_BIT | lock;
+}
+
+static inline void update_md_64(uint64_t *md, uint8_t index) {
+   uint64_t lock = *md & VQF_MD_LOCK_BIT;
+   uint64_t low = (1ULL << index) - 1;
+   *md = (((*md & low) | ((*md & ~low) << 1)) & ~VQF_MD_LOCK_BIT) | lock;
+}
+
+static inline void remove_md_64(uint64_t *md, uint8_t index) {
+   uint64_t lock = *md & VQF_MD_LOCK_BIT;
+   uint64_t low = (1ULL << index) - 1;
+   *md = (*md & low) | ((*md >> 1) & ~low) | VQF_MD_TOP_BIT | lock;
+}
+#endif
+
+#if defined(VQF_HAVE_AVX2) && !defined(VQF_HAVE_AVX512)
+// One bit per 16-bit lane of the two compare results, lo first. Packing the
+// lanes to bytes replaces a PEXT of every other movemask bit.
+static inline int packs_movemask(__m256i lo, __m256i hi) {
+   __m256i packed = _mm256_packs_epi16(lo, hi);
+   return _mm256_movemask_epi8(_mm256_permute4x64_epi64(packed, 0xd8));
+}
+#endif
+
+#ifdef VQF_HAVE_AVX512
+// The unmasked forms of some intrinsics pass an undefined vector as the
+// merge source, which GCC 12 reports as uninitialized. The zero-masked forms
+// with all lanes set compile to the same instructions.
+
+// The packed 12-bit tags are unpacked into 16-bit lanes, shifted with the
+// 16-bit shuffles and packed back.
+static inline __m512i unpack_tags_12(__m512i vector) {
+   vector = _mm512_maskz_permutexvar_epi32(0xffff, EXPAND12[0], vector);
+   vector = _mm512_shuffle_epi8(vector, EXPAND12[1]);
+   vector = _mm512_srlv_epi16(vector, EXPAND12[2]);
+   return _mm512_and_si512(vector, _mm512_set1_epi16(0xfff));
+}
+
+static inline __m512i pack_tags_12(__m512i vector) {
+   vector = _mm512_or_si512(_mm512_and_si512(vector, _mm512_set1_epi32(0xfff)),
+         _mm512_and_si512(_mm512_maskz_srli_epi32(0xffff, vector, 4), _mm512_set1_epi32(0xfff000)));
+   vector = _mm512_shuffle_epi8(vector, COMPACT12[0]);
+   return _mm512_maskz_permutexvar_epi32(0xffff, COMPACT12[1], vector);
+}
+#else
+// The packed 12-bit tags are shifted as one 384-bit integer held in 6 words.
+static inline uint64_t low_bits_mask(uint64_t word, uint64_t nbits) {
+   if (nbits >= 64 * (word + 1))
+      return UINT64_MAX;
+   if (nbits <= 64 * word)
+      return 0;
+   return (1ULL << (nbits - 64 * word)) - 1;
+}
+#endif
+
+template <int TAG_BITS> struct vqf_block_traits;
+
+// Slot indexes passed to the tag operations and returned by lookup count the
+// metadata in front of the tags, i.e. slot i is at TAG_OFFSET + i. The
+// bits of match_tags use the same numbering. get_tag and set_tag take i.
+//
+// The value of a maplet slot is in the same lane of the values as the slot
+// is in the block (see vqf_values), so update_values and remove_values are
+// update_tags and remove_tags on the values.
+//
+// merge_tags fills slot k of out with the tag at slot src[k] of a, or of b
+// if bit 7 of src[k] is set, for k < n. It is one two-source permute with
+// AVX512.
+template <> struct vqf_block_traits<8> {
+   typedef vqf_block8 block;
+
+   static const uint64_t TAG_MASK = 0xff;
+   static const uint64_t SLOTS_PER_BLOCK = 48;
+   static const uint64_t BUCKETS_PER_BLOCK = 80;
+   // ALT block check is set of 75% of the number of slots
+   static const uint64_t CHECK_ALT = 92;
+   static const uint64_t TAG_OFFSET = 16;
+   static const uint64_t MAX_VALUE_BITS = 8;
+
+   static inline void init(block *b) {
+      b->md[0] = UINT64_MAX;
+      // reset the most significant bit of metadata for locking.
+      b->md[1] = UINT64_MAX & ~(1ULL << 63);
+   }
+
+   static inline uint64_t *lock_word(block *b) {
+      return b->md + 1;
+   }
+
+   static inline __uint128_t metadata(const block *b) {
+      return (__uint128_t)b->md[1] << 64 | b->md[0];
+   }
+
+   static inline void set_metadata(block *b, __uint128_t md) {
+      b->md[0] = md;
+      b->md[1] = md >> 64;
+   }
+
+   // number of 0s in the metadata is the number of tags.
+   static inline uint64_t free_space(const block *b) {
+      return word_rank(b->md[0]) + word_rank(b->md[1] & ~VQF_MD_LOCK_BIT);
+   }
+
+   static inline uint64_t lookup(const block *b, uint64_t rank) {
+      return lookup_128<BUCKETS_PER_BLOCK>(b->md[0], b->md[1], rank);
+   }
+
+   // The blocks are packed, so the metadata is updated in a local copy.
+   static inline void update_md(block *b, uint8_t index) {
+      uint64_t md[2] = {b->md[0], b->md[1]};
+      update_md_128(md, index);
+      b->md[0] = md[0];
+      b->md[1] = md[1];
+   }
+
+   static inline void remove_md(block *b, uint8_t index) {
+      uint64_t md[2] = {b->md[0], b->md[1]};
+      remove_md_128(md, index);
+      b->md[0] = md[0];
+      b->md[1] = md[1];
+   }
+
+   static inline uint64_t get_tag(const block *b, uint64_t slot) {
+      return b->tags[slot];
+   }
+
+   static inline void set_tag(block *b, uint64_t slot, uint64_t tag) {
+      b->tags[slot] = tag;
+   }
+
+   static inline uint64_t get_value(const vqf_values *v, uint64_t index) {
+      return v->v8[index];
+   }
+
+#ifdef VQF_HAVE_AVX512
+   static inline void update_tags(block * restrict b, uint8_t index, uint64_t tag) {
+      b->tags[47] = tag;	// add tag at the end
+
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(b));
+      vector = _mm512_maskz_permutexvar_epi8(~0ULL, SHUFFLE[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(b), vector);
+   }
+
+   static inline void remove_tags(block * restrict b, uint8_t index) {
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(b));
+      vector = _mm512_maskz_permutexvar_epi8(~0ULL, SHUFFLE_REMOVE[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(b), vector);
+   }
+
+   static inline void update_values(vqf_values * restrict v, uint8_t index, uint64_t value) {
+      v->v8[63] = value;
+
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(v));
+      vector = _mm512_maskz_permutexvar_epi8(~0ULL, SHUFFLE[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(v), vector);
+   }
+
+   static inline void remove_values(vqf_values * restrict v, uint8_t index) {
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(v));
+      vector = _mm512_maskz_permutexvar_epi8(~0ULL, SHUFFLE_REMOVE[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(v), vector);
+   }
+
+   static inline void merge_tags(block * restrict out, const block *a, const
+         block *b, const uint8_t *src, uint64_t n) {
+      uint8_t index[64] = {0};
+      for (uint64_t k = 0; k < n; k++)
+         index[TAG_OFFSET + k] = (src[k] & 0x3f) | (src[k] >> 7 << 6);
+      __m512i vector = _mm512_permutex2var_epi8(
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(a)),
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(index)),
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b)));
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(out), vector);
+   }
+
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m512i bcast = _mm512_set1_epi8(tag);
+      __m512i vector =
+         _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b));
+      return _mm512_cmp_epi8_mask(bcast, vector, _MM_CMPINT_EQ);
+   }
+#else
+   static inline void update_tags(block * restrict b, uint8_t index, uint64_t tag) {
+      index -= 16;
+      memmove(&b->tags[index + 1], &b->tags[index], sizeof(b->tags) / sizeof(b->tags[0]) - index - 1);
+      b->tags[index] = tag;
+   }
+
+   static inline void remove_tags(block * restrict b, uint8_t index) {
+      index -= 16;
+      memmove(&b->tags[index], &b->tags[index+1], sizeof(b->tags) / sizeof(b->tags[0]) - index);
+   }
+
+   static inline void update_values(vqf_values * restrict v, uint8_t index, uint64_t value) {
+      memmove(&v->v8[index + 1], &v->v8[index], 63 - index);
+      v->v8[index] = value;
+   }
+
+   static inline void remove_values(vqf_values * restrict v, uint8_t index) {
+      memmove(&v->v8[index], &v->v8[index + 1], 63 - index);
+   }
+
+   static inline void merge_tags(block * restrict out, const block *a, const
+         block *b, const uint8_t *src, uint64_t n) {
+      for (uint64_t k = 0; k < n; k++)
+         out->tags[k] = (src[k] >> 7 ? b : a)->tags[(src[k] & 0x7f) - TAG_OFFSET];
+   }
+
+#ifdef VQF_HAVE_AVX2
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m256i bcast = _mm256_set1_epi8(tag);
+      __m256i vector = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+      __m256i result1t = _mm256_cmpeq_epi8(bcast, vector);
+      __mmask32 result1 = _mm256_movemask_epi8(result1t);
+      vector = _mm256_loadu_si256(reinterpret_cast<const __m256i*>((const uint8_t*)b+32));
+      __m256i result2t = _mm256_cmpeq_epi8(bcast, vector);
+      __mmask32 result2 = _mm256_movemask_epi8(result2t);
+      return (uint64_t)result2 << 32 | (uint64_t)result1;
+   }
+#else
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m128i bcast = _mm_set1_epi8(tag);
+      uint64_t result = 0;
+      for (int i = 0; i < 4; i++) {
+         __m128i vector = _mm_loadu_si128(reinterpret_cast<const __m128i*>((const uint8_t*)b + 16 * i));
+         uint64_t mask = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bcast, vector));
+         result |= mask << (16 * i);
+      }
+      return result;
+   }
+#endif
+#endif
+};
+
+template <> struct vqf_block_traits<12> {
+   typedef vqf_block12 block;
+
+   static const uint64_t TAG_MASK = 0xfff;
+   static const uint64_t SLOTS_PER_BLOCK = 32;
+   static const uint64_t BUCKETS_PER_BLOCK = 96;
+   static const uint64_t CHECK_ALT = 104;
+   static const uint64_t TAG_OFFSET = 16;
+   static const uint64_t MAX_VALUE_BITS = 16;
+
+   static inline void init(block *b) {
+      b->md[0] = UINT64_MAX;
+      b->md[1] = UINT64_MAX & ~(1ULL << 63);
+   }
+
+   static inline uint64_t *lock_word(block *b) {
+      return b->md + 1;
+   }
+
+   static inline __uint128_t metadata(const block *b) {
+      return (__uint128_t)b->md[1] << 64 | b->md[0];
+   }
+
+   static inline void set_metadata(block *b, __uint128_t md) {
+      b->md[0] = md;
+      b->md[1] = md >> 64;
+   }
+
+   static inline uint64_t free_space(const block *b) {
+      return word_rank(b->md[0]) + word_rank(b->md[1] & ~VQF_MD_LOCK_BIT);
+   }
+
+   static inline uint64_t lookup(const block *b, uint64_t rank) {
+      return lookup_128<BUCKETS_PER_BLOCK>(b->md[0], b->md[1], rank);
+   }
+
+   // The blocks are packed, so the metadata is updated in a local copy.
+   static inline void update_md(block *b, uint8_t index) {
+      uint64_t md[2] = {b->md[0], b->md[1]};
+      update_md_128(md, index);
+      b->md[0] = md[0];
+      b->md[1] = md[1];
+   }
+
+   static inline void remove_md(block *b, uint8_t index) {
+      uint64_t md[2] = {b->md[0], b->md[1]};
+      remove_md_128(md, index);
+      b->md[0] = md[0];
+      b->md[1] = md[1];
+   }
+
+   // Tag i starts at bit 12 * i of the packed tags.
+   static inline uint64_t get_tag(const block *b, uint64_t slot) {
+      uint16_t pair;
+      memcpy(&pair, &b->tags[3 * slot / 2], sizeof(pair));
+      return (pair >> (slot % 2 * 4)) & TAG_MASK;
+   }
+
+   static inline void set_tag(block *b, uint64_t slot, uint64_t tag) {
+      uint16_t pair;
+      memcpy(&pair, &b->tags[3 * slot / 2], sizeof(pair));
+      pair = (pair & ~(TAG_MASK << (slot % 2 * 4))) | (tag << (slot % 2 * 4));
+      memcpy(&b->tags[3 * slot / 2], &pair, sizeof(pair));
+   }
+
+   // The values are not packed, value i is in 16-bit lane i.
+   static inline uint64_t get_value(const vqf_values *v, uint64_t index) {
+      return v->v16[index - 16];
+   }
+
+#ifdef VQF_HAVE_AVX512
+   static inline void update_tags(block * restrict b, uint8_t index, uint64_t tag) {
+      __m512i vector = unpack_tags_12(_mm512_loadu_si512(reinterpret_cast<__m512i*>(b)));
+      vector = _mm512_mask_set1_epi16(vector, 1U << 31, tag);	// add tag at the end
+      vector = _mm512_permutexvar_epi16(SHUFFLE16[index - 16], vector);
+      _mm512_mask_storeu_epi32(reinterpret_cast<__m512i*>(b), 0xfff0, pack_tags_12(vector));
+   }
+
+   static inline void remove_tags(block * restrict b, uint8_t index) {
+      __m512i vector = unpack_tags_12(_mm512_loadu_si512(reinterpret_cast<__m512i*>(b)));
+      vector = _mm512_permutexvar_epi16(SHUFFLE_REMOVE16[index - 16], vector);
+      _mm512_mask_storeu_epi32(reinterpret_cast<__m512i*>(b), 0xfff0, pack_tags_12(vector));
+   }
+
+   static inline void update_values(vqf_values * restrict v, uint8_t index, uint64_t value) {
+      v->v16[31] = value;
+
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(v));
+      vector = _mm512_permutexvar_epi16(SHUFFLE16[index - 16], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(v), vector);
+   }
+
+   static inline void remove_values(vqf_values * restrict v, uint8_t index) {
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(v));
+      vector = _mm512_permutexvar_epi16(SHUFFLE_REMOVE16[index - 16], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(v), vector);
+   }
+
+   static inline void merge_tags(block * restrict out, const block *a, const
+         block *b, const uint8_t *src, uint64_t n) {
+      uint16_t index[32] = {0};
+      for (uint64_t k = 0; k < n; k++)
+         index[k] = ((src[k] & 0x3f) - TAG_OFFSET) | (src[k] >> 7 << 5);
+      __m512i vector = _mm512_permutex2var_epi16(
+            unpack_tags_12(_mm512_loadu_si512(reinterpret_cast<const __m512i*>(a))),
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(index)),
+            unpack_tags_12(_mm512_loadu_si512(reinterpret_cast<const __m512i*>(b))));
+      _mm512_mask_storeu_epi32(reinterpret_cast<__m512i*>(out), 0xfff0, pack_tags_12(vector));
+   }
+
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m512i bcast = _mm512_set1_epi16(tag);
+      __m512i tags =
+         unpack_tags_12(_mm512_loadu_si512(reinterpret_cast<const __m512i*>(b)));
+      uint64_t result = _mm512_cmp_epi16_mask(bcast, tags, _MM_CMPINT_EQ);
+      return result << sizeof(__uint128_t);
+   }
+#else
+   static inline void update_tags(block * restrict b, uint8_t index, uint64_t tag) {
+      uint64_t words[6], shifted[6];
+      uint64_t bit = 12 * (index - 16);
+
+      memcpy(words, b->tags, sizeof(words));
+      for (int i = 0; i < 6; i++)
+         shifted[i] = (words[i] << 12) | (i > 0 ? words[i - 1] >> 52 : 0);
+      for (int i = 0; i < 6; i++)
+         words[i] = (words[i] & low_bits_mask(i, bit)) |
+            (shifted[i] & ~low_bits_mask(i, bit + 12));
+      words[bit / 64] |= (uint64_t)tag << (bit % 64);
+      if (bit % 64 > 52)
+         words[bit / 64 + 1] |= (uint64_t)tag >> (64 - bit % 64);
+      memcpy(b->tags, words, sizeof(words));
+   }
+
+   static inline void remove_tags(block * restrict b, uint8_t index) {
+      uint64_t words[6], shifted[6];
+      uint64_t bit = 12 * (index - 16);
+
+      memcpy(words, b->tags, sizeof(words));
+      for (int i = 0; i < 6; i++)
+         shifted[i] = (words[i] >> 12) | (i < 5 ? words[i + 1] << 52 : 0);
+      for (int i = 0; i < 6; i++)
+         words[i] = (words[i] & low_bits_mask(i, bit)) |
+            (shifted[i] & ~low_bits_mask(i, bit));
+      memcpy(b->tags, words, sizeof(words));
+   }
+
+   static inline void update_values(vqf_values * restrict v, uint8_t index, uint64_t value) {
+      index -= 16;
+      memmove(&v->v16[index + 1], &v->v16[index], (31 - index) * 2);
+      v->v16[index] = value;
+   }
+
+   static inline void remove_values(vqf_values * restrict v, uint8_t index) {
+      index -= 16;
+      memmove(&v->v16[index], &v->v16[index + 1], (31 - index) * 2);
+   }
+
+   static inline void merge_tags(block * restrict out, const block *a, const
+         block *b, const uint8_t *src, uint64_t n) {
+      for (uint64_t k = 0; k < n; k++)
+         set_tag(out, k, get_tag(src[k] >> 7 ? b : a, (src[k] & 0x7f) - TAG_OFFSET));
+   }
+
+#ifdef VQF_HAVE_AVX2
+   // Each half unpacks 16 tags. The 24 bytes holding them are split into two
+   // 128-bit lanes of 12 bytes and spread into 16-bit lanes.
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      const __m256i spread = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8,
+            9, 10, 10, 11, 0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+      const __m256i tag_mask = _mm256_set1_epi16(TAG_MASK);
+      __m256i bcast = _mm256_set1_epi16(tag);
+
+      __m256i tags = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b->tags));
+      tags = _mm256_permutevar8x32_epi32(tags, _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5));
+      tags = _mm256_shuffle_epi8(tags, spread);
+      tags = _mm256_blend_epi16(_mm256_and_si256(tags, tag_mask),
+            _mm256_srli_epi16(tags, 4), 0xAA);
+      __m256i result1t = _mm256_cmpeq_epi16(bcast, tags);
+
+      tags = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b->tags + 16));
+      tags = _mm256_permutevar8x32_epi32(tags, _mm256_setr_epi32(2, 3, 4, 4, 5, 6, 7, 7));
+      tags = _mm256_shuffle_epi8(tags, spread);
+      tags = _mm256_blend_epi16(_mm256_and_si256(tags, tag_mask),
+            _mm256_srli_epi16(tags, 4), 0xAA);
+      __m256i result2t = _mm256_cmpeq_epi16(bcast, tags);
+      uint64_t result = (uint32_t)packs_movemask(result1t, result2t);
+      return result << sizeof(__uint128_t);
+   }
+#else
+   // Every quarter spreads the 12 bytes of 8 tags into 16-bit lanes. The last
+   // quarter is loaded 4 bytes early to stay inside the block.
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      const __m128i spread = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8,
+            9, 10, 10, 11);
+      const __m128i spread_last = _mm_setr_epi8(4, 5, 5, 6, 7, 8, 8, 9, 10, 11,
+            11, 12, 13, 14, 14, 15);
+      const __m128i tag_mask = _mm_set1_epi16(TAG_MASK);
+      __m128i bcast = _mm_set1_epi16(tag);
+      __m128i matches[4];
+
+      for (int i = 0; i < 4; i++) {
+         __m128i tags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b->tags
+                  + (i < 3 ? 12 * i : 32)));
+         tags = _mm_shuffle_epi8(tags, i < 3 ? spread : spread_last);
+         tags = _mm_blend_epi16(_mm_and_si128(tags, tag_mask),
+               _mm_srli_epi16(tags, 4), 0xAA);
+         matches[i] = _mm_cmpeq_epi16(bcast, tags);
+      }
+      uint64_t result1 = (uint16_t)_mm_movemask_epi8(_mm_packs_epi16(matches[0],
+               matches[1]));
+      uint64_t result2 = (uint16_t)_mm_movemask_epi8(_mm_packs_epi16(matches[2],
+               matches[3]));
+      uint64_t result = result2 << 16 | result1;
+      return result << sizeof(__uint128_t);
+   }
+#endif
+#endif
+};
+
+template <> struct vqf_block_traits<16> {
+   typedef vqf_block16 block;
+
+   static const uint64_t TAG_MASK = 0xffff;
+   static const uint64_t SLOTS_PER_BLOCK = 28;
+   static const uint64_t BUCKETS_PER_BLOCK = 36;
+   static const uint64_t CHECK_ALT = 43;
+   static const uint64_t TAG_OFFSET = sizeof(uint64_t)/2;
+   static const uint64_t MAX_VALUE_BITS = 16;
+
+   static inline void init(block *b) {
+      b->md = UINT64_MAX & ~(1ULL << 63);
+   }
+
+   // md is the first word of the block, and blocks start on a cache line.
+   static inline uint64_t *lock_word(block *b) {
+      return static_cast<uint64_t *>(__builtin_assume_aligned(b, 64));
+   }
+
+   static inline __uint128_t metadata(const block *b) {
+      return b->md;
+   }
+
+   static inline void set_metadata(block *b, __uint128_t md) {
+      b->md = md;
+   }
+
+   static inline uint64_t free_space(const block *b) {
+      return word_rank(b->md & ~VQF_MD_LOCK_BIT);
+   }
+
+   static inline uint64_t lookup(const block *b, uint64_t rank) {
+      return lookup_64(b->md, rank);
+   }
+
+   static inline void update_md(block *b, uint8_t index) {
+      uint64_t md = b->md;
+      update_md_64(&md, index);
+      b->md = md;
+   }
+
+   static inline void remove_md(block *b, uint8_t index) {
+      uint64_t md = b->md;
+      remove_md_64(&md, index);
+      b->md = md;
+   }
+
+   static inline uint64_t get_tag(const block *b, uint64_t slot) {
+      return b->tags[slot];
+   }
+
+   static inline void set_tag(block *b, uint64_t slot, uint64_t tag) {
+      b->tags[slot] = tag;
+   }
+
+   static inline uint64_t get_value(const vqf_values *v, uint64_t index) {
+      return v->v16[index];
+   }
+
+#ifdef VQF_HAVE_AVX512
+   static inline void update_tags(block * restrict b, uint8_t index, uint64_t tag) {
+      b->tags[27] = tag;	// add tag at the end
+
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(b));
+      vector = _mm512_permutexvar_epi16(SHUFFLE16[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(b), vector);
+   }
+
+   static inline void remove_tags(block * restrict b, uint8_t index) {
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(b));
+      vector = _mm512_permutexvar_epi16(SHUFFLE_REMOVE16[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(b), vector);
+   }
+
+   static inline void update_values(vqf_values * restrict v, uint8_t index, uint64_t value) {
+      v->v16[31] = value;
+
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(v));
+      vector = _mm512_permutexvar_epi16(SHUFFLE16[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(v), vector);
+   }
+
+   static inline void remove_values(vqf_values * restrict v, uint8_t index) {
+      __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(v));
+      vector = _mm512_permutexvar_epi16(SHUFFLE_REMOVE16[index], vector);
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(v), vector);
+   }
+
+   static inline void merge_tags(block * restrict out, const block *a, const
+         block *b, const uint8_t *src, uint64_t n) {
+      uint16_t index[32] = {0};
+      for (uint64_t k = 0; k < n; k++)
+         index[TAG_OFFSET + k] = (src[k] & 0x3f) | (src[k] >> 7 << 5);
+      __m512i vector = _mm512_permutex2var_epi16(
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(a)),
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(index)),
+            _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b)));
+      _mm512_storeu_si512(reinterpret_cast<__m512i*>(out), vector);
+   }
+
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m512i bcast = _mm512_set1_epi16(tag);
+      __m512i vector =
+         _mm512_loadu_si512(reinterpret_cast<const __m512i*>(b));
+      return _mm512_cmp_epi16_mask(bcast, vector, _MM_CMPINT_EQ);
+   }
+#else
+   static inline void update_tags(block * restrict b, uint8_t index, uint64_t tag) {
+      index -= 4;
+      memmove(&b->tags[index + 1], &b->tags[index], (sizeof(b->tags) / sizeof(b->tags[0]) - index - 1) * 2);
+      b->tags[index] = tag;
+   }
+
+   static inline void remove_tags(block * restrict b, uint8_t index) {
+      index -= 4;
+      memmove(&b->tags[index], &b->tags[index+1], (sizeof(b->tags) / sizeof(b->tags[0]) - index) * 2);
+   }
+
+   static inline void update_values(vqf_values * restrict v, uint8_t index, uint64_t value) {
+      memmove(&v->v16[index + 1], &v->v16[index], (31 - index) * 2);
+      v->v16[index] = value;
+   }
+
+   static inline void remove_values(vqf_values * restrict v, uint8_t index) {
+      memmove(&v->v16[index], &v->v16[index + 1], (31 - index) * 2);
+   }
+
+   static inline void merge_tags(block * restrict out, const block *a, const
+         block *b, const uint8_t *src, uint64_t n) {
+      for (uint64_t k = 0; k < n; k++)
+         out->tags[k] = (src[k] >> 7 ? b : a)->tags[(src[k] & 0x7f) - TAG_OFFSET];
+   }
+
+#ifdef VQF_HAVE_AVX2
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m256i bcast = _mm256_set1_epi16(tag);
+      __m256i vector = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+      __m256i result1t = _mm256_cmpeq_epi16(bcast, vector);
+      vector = _mm256_loadu_si256(reinterpret_cast<const __m256i*>((const uint8_t*)b+32));
+      __m256i result2t = _mm256_cmpeq_epi16(bcast, vector);
+      return (uint32_t)packs_movemask(result1t, result2t);
+   }
+#else
+   static inline uint64_t match_tags(const block *b, uint64_t tag) {
+      __m128i bcast = _mm_set1_epi16(tag);
+      const uint8_t *bytes = (const uint8_t*)b;
+      __m128i result1t = _mm_packs_epi16(
+            _mm_cmpeq_epi16(bcast, _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes))),
+            _mm_cmpeq_epi16(bcast, _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 16))));
+      __m128i result2t = _mm_packs_epi16(
+            _mm_cmpeq_epi16(bcast, _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 32))),
+            _mm_cmpeq_epi16(bcast, _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 48))));
+      uint64_t result1 = (uint16_t)_mm_movemask_epi8(result1t);
+      uint64_t result2 = (uint16_t)_mm_movemask_epi8(result2t);
+      return result2 << 16 | result1;
+   }
+#endif
+#endif
+};
+
+// Returns the slot (counting the metadata, see above) right after the end of
+// the run of bucket offset.
+template <int TAG_BITS>
+static inline uint64_t select_slot(const typename vqf_block_traits<TAG_BITS>::block *b,
+      uint64_t offset) {
+   return word_tzcnt(vqf_block_traits<TAG_BITS>::lookup(b, offset));
+}
+
+// Returns a mask with a bit set for every slot of the run of bucket offset.
+template <int TAG_BITS>
+static inline uint64_t run_mask(const typename vqf_block_traits<TAG_BITS>::block *b,
+      uint64_t offset) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+
+   uint64_t start = offset != 0 ? traits::lookup(b, offset - 1) : one[0] <<
+      traits::TAG_OFFSET;
+   uint64_t end = traits::lookup(b, offset);
+   return end - start;
+}
+
+}	// namespace VQF_VARIANT
+
+#endif	// _VQF_BLOCK_H_
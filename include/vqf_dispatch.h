@@ -0,0 +1,117 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_dispatch.h
+ *
+ *    Description:  Operations table of a filter and the internals shared by the
+ *                  library files.
+ *
+ * ============================================================================
+ */
+
+#ifndef _VQF_DISPATCH_H_
+#define _VQF_DISPATCH_H_
+
+#include "vqf_filter.h"
+
+// The operations of a filter are instantiated for its tag size and its
+// instruction set, and picked once in vqf_init. The public functions call
+// through this table.
+struct vqf_ops {
+   vqf_variant variant;
+   // Geometry of a block of the tag size.
+   uint64_t buckets_per_block;
+   uint64_t slots_per_block;
+   // log2 of the bytes from one block to the next.
+   uint64_t block_shift;
+   bool (*insert)(vqf_filter * restrict filter, uint64_t hash);
+   bool (*remove)(vqf_filter * restrict filter, uint64_t hash);
+   bool (*is_present)(vqf_filter * restrict filter, uint64_t hash);
+   uint64_t (*insert_batch)(vqf_filter * restrict filter, const uint64_t *
+         restrict hashes, uint64_t nhashes, bool * restrict results);
+   uint64_t (*remove_batch)(vqf_filter * restrict filter, const uint64_t *
+         restrict hashes, uint64_t nhashes, bool * restrict results);
+   uint64_t (*is_present_batch)(vqf_filter * restrict filter, const uint64_t *
+         restrict hashes, uint64_t nhashes, bool * restrict results);
+   uint64_t (*count)(vqf_filter * restrict filter, uint64_t hash);
+   bool (*insert_kv)(vqf_filter * restrict filter, uint64_t hash, uint64_t value);
+   bool (*get)(vqf_filter * restrict filter, uint64_t hash, uint64_t *value);
+   // Filters that can't be merged into have no merge operations.
+   uint64_t (*merge_blocks)(vqf_filter *dst, const vqf_filter *a, const
+         vqf_filter *b, uint64_t begin, uint64_t end, bool intersect, struct
+         vqf_spills *spills);
+   uint64_t (*place_spills)(vqf_filter *dst, const struct vqf_spills *spills);
+   // Writes the tags of block index to entries and returns how many.
+   uint64_t (*decode_block)(const vqf_filter *filter, uint64_t index,
+         vqf_entry *entries);
+   vqf_placement (*placement)(vqf_filter * restrict filter, uint64_t hash);
+   // Adds the occupancy of blocks [begin, end) to stats and sets its
+   // block_slots.
+   void (*block_stats)(const vqf_filter *filter, uint64_t begin, uint64_t end,
+         vqf_stats *stats);
+};
+
+// Tags of a union that did not fit in their block, as bucket << 16 | tag.
+// nlost counts those that did not fit in the list either.
+struct vqf_spills {
+   uint64_t *entries;
+   uint64_t n;
+   uint64_t size;
+   uint64_t nlost;
+};
+
+#ifdef ENABLE_THREADS
+// Readers never take block locks. They check the block and then validate it
+// against a version, and retry if a writer held the block meanwhile. Blocks
+// have no spare bits, so the versions live in a table of each filter, with
+// one stripe per line up to VQF_SEQLOCK_MAX_STRIPES. The low 16 bits of a
+// version count the writers holding a block of the stripe and the high bits
+// count the completed writes, so the version changes on every write.
+#define VQF_SEQLOCK_MIN_STRIPES (1ULL << 6)
+#define VQF_SEQLOCK_MAX_STRIPES (1ULL << 14)
+#define VQF_SEQLOCK_WRITERS 0xffffULL
+#endif
+
+#ifdef VQF_LOCK_STATS
+// Lock counters are striped by block address, like the seqlocks, so that
+// counting does not make every lock write one shared cache line.
+#define VQF_LOCK_STAT_STRIPES 256
+
+struct __attribute__ ((aligned (64))) vqf_lock_counters {
+   uint64_t acquisitions;
+   uint64_t spins;
+   uint64_t max_wait;
+};
+#endif
+
+// Allocates a filter with room for total_size_in_bytes of blocks, as set up
+// by vqf_set_pages and vqf_set_allocator. Returns NULL on failure.
+vqf_filter * vqf_alloc_filter(uint64_t total_size_in_bytes);
+
+// Sets the item count of filter to nelts.
+void vqf_set_size(vqf_filter *filter, uint64_t nelts);
+
+// Adds n to the item count of filter.
+void vqf_add_size(vqf_filter *filter, int64_t n);
+
+// Calls fn on each of the ntasks tasks of task_size bytes at tasks, one
+// thread per task, and returns once all of them are done.
+void vqf_run_tasks(void * (*fn)(void *), void *tasks, size_t task_size,
+      uint64_t ntasks);
+
+// One build of vqf_filter.c per instruction set. get_ops returns NULL for
+// tag sizes other than 8, 12 and 16.
+#define VQF_DECLARE_VARIANT(name) \
+namespace name { \
+   vqf_filter * init(uint64_t nslots, uint64_t tag_bits, vqf_addressing \
+         addressing, bool counting, uint64_t value_bits); \
+   const vqf_ops * get_ops(uint64_t tag_bits, bool counting, bool maplet, \
+         bool read_only); \
+}
+
+VQF_DECLARE_VARIANT(vqf_avx512)
+VQF_DECLARE_VARIANT(vqf_avx2)
+VQF_DECLARE_VARIANT(vqf_avx2_nopdep)
+VQF_DECLARE_VARIANT(vqf_generic)
+
+#endif	// _VQF_DISPATCH_H_
@@ -14,68 +14,379 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 #define restrict __restrict__
 extern "C" {
 #endif
 
-   // NOTE: Currently the code only works for TAG_BITS 8 and 16.
-#define TAG_BITS 8
-
 	// metadata: 1 --> end of the run
 	// Each 1 is preceded by k 0s, where k is the number of remainders in that
 	// run.
 
-#if TAG_BITS == 8
-	// We are using 8-bit tags.
+	// The tag size is picked per filter in vqf_init and can be 8, 12 or 16
+	// bits. All blocks are 64 bytes.
+
+	// 8-bit tags.
 	// One block consists of 48 8-bit slots covering 80 buckets, and 80+48 = 128
 	// bits of metadata.
-	typedef struct __attribute__ ((__packed__)) vqf_block {
+	typedef struct __attribute__ ((__packed__)) vqf_block8 {
 		uint64_t md[2];
 		uint8_t tags[48];
-	} vqf_block;
-#elif TAG_BITS == 12
-	// We are using 12-bit tags.
+	} vqf_block8;
+
+	// 12-bit tags.
 	// One block consists of 32 12-bit slots covering 96 buckets, and 96+32 = 128
-	// bits of metadata.
-        // NOTE: not supported yet.
-	typedef struct __attribute__ ((__packed__)) vqf_block {
+	// bits of metadata. Tag i is stored in bits 12i..12i+11 of tags.
+	typedef struct __attribute__ ((__packed__)) vqf_block12 {
 		uint64_t md[2];
-		uint8_t tags[32]; // 32 12-bit tags
-	} vqf_block;
-#elif TAG_BITS == 16 
-	// We are using 16-bit tags.
+		uint8_t tags[48]; // 32 12-bit tags
+	} vqf_block12;
+
+	// 16-bit tags.
 	// One block consists of 28 16-bit slots covering 36 buckets, and 36+28 = 64
 	// bits of metadata.
-	typedef struct __attribute__ ((__packed__)) vqf_block {
+	typedef struct __attribute__ ((__packed__)) vqf_block16 {
 		uint64_t md;
 		uint16_t tags[28];
+	} vqf_block16;
+
+	typedef union __attribute__ ((__packed__)) vqf_block {
+		vqf_block8 b8;
+		vqf_block12 b12;
+		vqf_block16 b16;
 	} vqf_block;
-#endif
+
+	// Values of a maplet, one line right after each block. Values sit in the
+	// lane of their slot in the block, 8-bit lanes for 8-bit tags and 16-bit
+	// lanes otherwise, so that the shuffles that move the tags move the values
+	// too.
+	typedef union __attribute__ ((__packed__)) vqf_values {
+		uint8_t v8[64];
+		uint16_t v16[32];
+	} vqf_values;
+
+	// How a hash is mapped to its primary and alternate buckets.
+	typedef enum vqf_addressing {
+		VQF_ADDRESSING_MODULO = 0,	// hash % range (default)
+		VQF_ADDRESSING_FASTRANGE = 1	// multiply-shift, no division
+	} vqf_addressing;
 
 	typedef struct vqf_metadata {
 		uint64_t total_size_in_bytes;
-		uint64_t key_remainder_bits;
+		uint64_t key_remainder_bits;	// tag size: 8, 12 or 16
 		uint64_t range;
 		uint64_t nblocks;
 		uint64_t nelts;
 		uint64_t nslots;
+		uint64_t addressing;
+		uint64_t counting;	// see vqf_init_counting
+		uint64_t value_bits;	// see vqf_init_maplet
 	} vqf_metadata;
 
-	typedef struct vqf_filter {
+	// Kernels a filter runs on. The library is built once per instruction set
+	// and vqf_init picks the best one the CPU supports.
+	typedef enum vqf_variant {
+		VQF_VARIANT_AUTO = 0,	// best supported (default)
+		VQF_VARIANT_GENERIC = 1,	// SSE4.2 and POPCNT
+		VQF_VARIANT_AVX2 = 2,	// AVX2, BMI and BMI2
+		VQF_VARIANT_AVX512 = 3,	// AVX512BW, AVX512VBMI and BMI2
+		VQF_VARIANT_AVX2_NOPDEP = 4	// AVX2 without PDEP/PEXT (AMD Zen1/2)
+	} vqf_variant;
+
+	// Where the tag of a hash is stored, see vqf_get_placement.
+	typedef enum vqf_placement {
+		VQF_PLACEMENT_NONE = 0,	// in neither run
+		VQF_PLACEMENT_PRIMARY = 1,	// in the run of its primary bucket
+		VQF_PLACEMENT_ALTERNATE = 2	// only in the run of its alternate bucket
+	} vqf_placement;
+
+	// Operations specialized for the tag size and the kernels of a filter.
+	struct vqf_ops;
+
+	// Backing memory of a filter.
+	typedef enum vqf_pages {
+		VQF_PAGES_DEFAULT = 0,	// malloc (default)
+		VQF_PAGES_HUGE_2M = 1,	// 2 MB hugetlb pages
+		VQF_PAGES_HUGE_1G = 2,	// 1 GB hugetlb pages
+		VQF_PAGES_TRANSPARENT = 3,	// mmap with madvise(MADV_HUGEPAGE)
+		VQF_PAGES_ALLOCATOR = 4,	// user allocator, see vqf_set_allocator
+		VQF_PAGES_MAPPED = 5	// mapped from a file, see vqf_open_mmap
+	} vqf_pages;
+
+	// A user allocator. alloc must return 64-byte aligned memory.
+	typedef struct vqf_allocator {
+		void *(*alloc)(size_t size, void *arg);
+		void (*dealloc)(void *ptr, size_t size, void *arg);
+		void *arg;
+	} vqf_allocator;
+
+	// Block lock contention of a filter, summed over all threads. Only
+	// counted by a library built with LOCK_STATS=1.
+	typedef struct vqf_lock_stats {
+		uint64_t acquisitions;	// block locks taken
+		uint64_t spins;	// backoff rounds spent waiting for held locks
+		uint64_t max_wait;	// longest wait for one lock, in TSC ticks
+	} vqf_lock_stats;
+
+	// Occupancy of a filter, see vqf_get_stats. Blocks hold at most 47 tags.
+#define VQF_STATS_FILL_SIZE 48
+	typedef struct vqf_stats {
+		uint64_t nblocks;
+		uint64_t block_slots;	// tags a block holds when full
+		uint64_t nelts;	// tags in all blocks
+		uint64_t nfull_blocks;	// blocks with no free slot
+		uint64_t longest_run;	// most tags in one bucket
+		uint64_t fill[VQF_STATS_FILL_SIZE];	// fill[i]: blocks holding i tags
+	} vqf_stats;
+
+	// Outcome of vqf_union and vqf_intersect.
+	typedef struct vqf_merge_report {
+		uint64_t nentries;	// tags in the result
+		uint64_t nmoved;	// tags placed after overflowing their block
+		uint64_t ndropped;	// tags that fit in neither block
+	} vqf_merge_report;
+
+	// A tag of a filter and the bucket it is stored in. value is the value of
+	// a maplet, else 0.
+	typedef struct vqf_entry {
+		uint64_t bucket;
+		uint32_t tag;
+		uint32_t value;
+	} vqf_entry;
+
+	// A block holds fewer tags than this.
+#define VQF_CURSOR_BLOCK_ENTRIES 64
+
+	// Walks the tags of a range of blocks in order. Set up by vqf_cursor_init.
+	typedef struct vqf_cursor {
+		const struct vqf_filter *filter;
+		uint64_t block;	// next block to decode
+		uint64_t end;
+		uint64_t pos;	// next entry of entries
+		uint64_t n;
+		vqf_entry entries[VQF_CURSOR_BLOCK_ENTRIES];	// of the last block decoded
+	} vqf_cursor;
+
+	struct vqf_lock_counters;
+	struct vqf_count_shard;
+
+	// The header is padded so that the blocks, which follow it unless the
+	// filter is mapped from a file, start on a cache line.
+	typedef struct __attribute__ ((aligned (64))) vqf_filter {
 		vqf_metadata metadata;
-		vqf_block blocks[];
+		const struct vqf_ops *ops;
+		uint64_t pages;	// vqf_pages the filter was allocated with
+		uint64_t alloc_size;
+		vqf_allocator allocator;
+		void *map;	// file mapping of a VQF_PAGES_MAPPED filter
+		uint64_t map_size;
+		vqf_block *blocks;
+		struct vqf_lock_counters *lock_counters;	// NULL unless counted
+		struct vqf_count_shard *count_shards;	// item counts, with threads
+		uint64_t *seqlocks;	// block versions, with threads
+		uint64_t seqlock_shift;	// 64 - log2 of the number of seqlocks
 	} vqf_filter;
 
-	vqf_filter * vqf_init(uint64_t nslots);
+	// On-disk format: a VQF_FILE_HEADER_SIZE byte header followed by the
+	// blocks, each followed by its values in a maplet, as they are in memory.
+	// Files are in native (little-endian) byte order.
+#define VQF_FILE_MAGIC 0x454c494646515600ULL	// "\0VQFFILE"
+#define VQF_FILE_VERSION 4	// 2 added metadata.counting, 3 value_bits,
+				// 4 interleaved the values of maplets
+#define VQF_FILE_HEADER_SIZE 4096
+
+	typedef struct vqf_file_header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t header_size;	// offset of the blocks
+		vqf_metadata metadata;	// tag size and addressing included
+	} vqf_file_header;
+
+	// An expandable filter is a chain of filters, each twice the size of the
+	// previous one. Inserts go to the newest filter, and a new one is added
+	// when it passes the load threshold. Lookups and removes probe the
+	// filters newest first, two cache lines each.
+#define VQF_EXPANDABLE_MAX_LEVELS 40
+
+	typedef struct vqf_expandable {
+		vqf_filter *levels[VQF_EXPANDABLE_MAX_LEVELS];
+		uint64_t nlevels;
+		uint64_t nslots;	// of the first level
+		uint64_t tag_bits;
+		uint64_t addressing;
+		double max_load;
+		uint64_t growing;	// set while a thread adds a level
+	} vqf_expandable;
+
+	// tag_bits is 8, 12 or 16. Returns NULL for other tag sizes.
+	vqf_filter * vqf_init(uint64_t nslots, uint64_t tag_bits, vqf_addressing
+			addressing);
+
+	// A counting filter also stores how many times each hash was inserted.
+	// A hash inserted more than twice takes a counter of a few slots next to
+	// its tag instead of a slot per insert, and removes decrement it. An
+	// insert fails if its counter needs another slot in a full block.
+	vqf_filter * vqf_init_counting(uint64_t nslots, uint64_t tag_bits,
+			vqf_addressing addressing);
+
+	// A maplet stores a value_bits-bit value with every item. value_bits is at
+	// most 8 with 8-bit tags and 16 otherwise. The values of a block take the
+	// cache line after it, which doubles the size of the filter.
+	vqf_filter * vqf_init_maplet(uint64_t nslots, uint64_t tag_bits, uint64_t
+			value_bits, vqf_addressing addressing);
+
+	// Release a filter created by vqf_init.
+	void vqf_free(vqf_filter *filter);
+
+	// Write filter to path. Returns false on I/O errors. The filter must not
+	// be updated while it is saved.
+	bool vqf_save(const vqf_filter *filter, const char *path);
+
+	// Map a filter saved by vqf_save. Lookups are served from the mapping
+	// without copying it. A read-only filter shares the page cache with other
+	// processes and rejects updates. A writable one is a private copy-on-write
+	// mapping; its updates are not written back to the file. Returns NULL if
+	// the file is not a valid filter. vqf_free unmaps it.
+	vqf_filter * vqf_open_mmap(const char *path, bool writable);
+
+	// Back the filters created by later calls to vqf_init with huge pages.
+	// VQF_PAGES_HUGE_2M and VQF_PAGES_HUGE_1G fall back to transparent huge
+	// pages if the hugetlb pool is empty; filter->pages tells which was used.
+	void vqf_set_pages(vqf_pages pages);
+
+	// Allocate the filters created by later calls to vqf_init with allocator
+	// instead. NULL restores the default.
+	void vqf_set_allocator(const vqf_allocator *allocator);
+
+	// Force the kernels used by later calls to vqf_init. Returns false if the
+	// CPU does not support them. VQF_VARIANT_AUTO restores the default.
+	bool vqf_set_variant(vqf_variant variant);
+
+	vqf_variant vqf_get_variant(const vqf_filter *filter);
+
+	const char * vqf_variant_name(vqf_variant variant);
+
+	// Number of items in filter, or of the slots used by a counting filter.
+	// Under threads, the count is exact once the concurrent updates are done.
+	uint64_t vqf_size(const vqf_filter *filter);
+
+	// vqf_size over the number of slots of filter.
+	double vqf_load_factor(const vqf_filter *filter);
+
+	// nslots is the size of the first level. A level is full at max_load, or
+	// 0 for the default of 0.9. Levels are allocated like vqf_init filters.
+	vqf_expandable * vqf_expandable_init(uint64_t nslots, uint64_t tag_bits,
+			vqf_addressing addressing, double max_load);
+
+	void vqf_expandable_free(vqf_expandable *filter);
+
+	// Returns false only if a level can't be allocated.
+	bool vqf_expandable_insert(vqf_expandable *filter, uint64_t hash);
+
+	bool vqf_expandable_remove(vqf_expandable *filter, uint64_t hash);
+
+	bool vqf_expandable_is_present(vqf_expandable *filter, uint64_t hash);
+
+	uint64_t vqf_expandable_size(const vqf_expandable *filter);
+
+	// Bytes allocated for all the levels.
+	uint64_t vqf_expandable_memory(const vqf_expandable *filter);
+
+	// Merge two filters without the keys. a, b and dst must have the same
+	// number of slots, tag size and addressing and be neither counting filters
+	// nor maplets; dst may be a or b, and a and b may be mapped read-only.
+	// Blocks are merged bucket by bucket on nthreads threads. vqf_union keeps
+	// the tags of both, so a key is present in dst if it is in a or b as long
+	// as report->ndropped is 0. A tag that overflows its block goes to its
+	// alternate block, or to either after moving another tag of the block to
+	// its own alternate; ndropped counts those that still do not fit.
+	// vqf_intersect keeps the tags of a that are in b in either block. No
+	// other operation may run on the filters meanwhile. Returns false if the
+	// filters can't be merged.
+	bool vqf_union(vqf_filter *dst, const vqf_filter *a, const vqf_filter *b,
+			uint64_t nthreads, vqf_merge_report *report);
+
+	bool vqf_intersect(vqf_filter *dst, const vqf_filter *a, const vqf_filter
+			*b, uint64_t nthreads, vqf_merge_report *report);
+
+	// Stream the tags of filter. A cursor yields the tags of blocks [begin,
+	// end) in bucket order, so threads can scan disjoint ranges in parallel;
+	// end is clamped to filter->metadata.nblocks. Each block is decoded at
+	// once from its metadata and read consistently with concurrent updates,
+	// but updates to blocks not yet reached may or may not be seen. Tags are
+	// yielded as stored: the counter of a counting filter shows as a 0 tag
+	// and a digit after each 0.
+	void vqf_cursor_init(vqf_cursor *cursor, const vqf_filter *filter, uint64_t
+			begin, uint64_t end);
+
+	// Returns false once the range is done.
+	bool vqf_cursor_next(vqf_cursor *cursor, vqf_entry *entry);
+
+	// Copy up to n entries to entries and return how many. Returns less than n
+	// only once the range is done. Blocks are decoded straight into entries
+	// while it has room for a whole block.
+	uint64_t vqf_cursor_read(vqf_cursor *cursor, vqf_entry *entries, uint64_t
+			n);
+
+	// Fill stats with the occupancy of filter, read from the popcounts of the
+	// block metadata on nthreads threads. Blocks are read consistently with
+	// concurrent updates, but the totals are not a snapshot of one moment.
+	// Tags in their alternate block are not told apart from the others, see
+	// vqf_get_placement. The counters of a counting filter count as tags.
+	void vqf_get_stats(const vqf_filter *filter, uint64_t nthreads, vqf_stats
+			*stats);
+
+	// Fill stats with the lock counters of filter. Returns false if the
+	// library does not count them.
+	bool vqf_get_lock_stats(const vqf_filter *filter, vqf_lock_stats *stats);
+
+	void vqf_reset_lock_stats(vqf_filter *filter);
 
 	bool vqf_insert(vqf_filter * restrict filter, uint64_t hash);
 	
 	bool vqf_remove(vqf_filter * restrict filter, uint64_t hash);
 
+	// Insert (remove) nhashes hashes at once. The hashes are grouped by block
+	// and each block is updated in a single pass. results[i] is set to whether
+	// the operation on hashes[i] succeeded. Returns the number of failures.
+	uint64_t vqf_insert_batch(vqf_filter * restrict filter, const uint64_t *
+			restrict hashes, uint64_t nhashes, bool * restrict results);
+
+	uint64_t vqf_remove_batch(vqf_filter * restrict filter, const uint64_t *
+			restrict hashes, uint64_t nhashes, bool * restrict results);
+
 	bool vqf_is_present(vqf_filter * restrict filter, uint64_t hash);
 
+	// Number of times hash was inserted and not removed, or more if other
+	// hashes collide with it. Filters that are not counting store every
+	// insert of a hash as a tag and count those.
+	uint64_t vqf_count(vqf_filter * restrict filter, uint64_t hash);
+
+	// Insert hash with value, truncated to the value_bits of a maplet. vqf_insert
+	// on a maplet inserts value 0. Returns false on filters that are not
+	// maplets.
+	bool vqf_insert_kv(vqf_filter * restrict filter, uint64_t hash, uint64_t
+			value);
+
+	// Set value to the value of hash and return true if hash is present. A
+	// hash inserted more than once, or colliding with another, has several
+	// values and gets the one vqf_remove would remove. Filters that are not
+	// maplets return 0 values.
+	bool vqf_get(vqf_filter * restrict filter, uint64_t hash, uint64_t *value);
+
+	// Look up nhashes hashes at once. results[i] is set to the answer for
+	// hashes[i]. Returns the number of positive answers.
+	uint64_t vqf_is_present_batch(vqf_filter * restrict filter, const uint64_t *
+			restrict hashes, uint64_t nhashes, bool * restrict results);
+
+	// Which of its two runs holds the tag of hash, like vqf_is_present does
+	// but telling the primary run from the alternate one. A hash whose tag
+	// collides with another in its primary run counts as primary.
+	vqf_placement vqf_get_placement(vqf_filter * restrict filter, uint64_t
+			hash);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,30 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_kernel_bench.h
+ *
+ *    Description:  Microbenchmarks of the block kernels, built once per
+ *                  instruction set like vqf_filter.c.
+ *
+ * ============================================================================
+ */
+
+#ifndef _VQF_KERNEL_BENCH_H_
+#define _VQF_KERNEL_BENCH_H_
+
+#include <stdint.h>
+
+// Times the kernels of vqf_block.h for one tag size on L1-resident blocks
+// and prints a table of TSC ticks per call by fill level. Returns false for
+// tag sizes other than 8, 12 and 16.
+#define VQF_DECLARE_KERNEL_BENCH(name) \
+namespace name { \
+   bool bench_kernels(uint64_t tag_bits, uint64_t rounds); \
+}
+
+VQF_DECLARE_KERNEL_BENCH(vqf_avx512)
+VQF_DECLARE_KERNEL_BENCH(vqf_avx2)
+VQF_DECLARE_KERNEL_BENCH(vqf_avx2_nopdep)
+VQF_DECLARE_KERNEL_BENCH(vqf_generic)
+
+#endif	// _VQF_KERNEL_BENCH_H_
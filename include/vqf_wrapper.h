@@ -15,12 +15,16 @@
 #include "vqf_filter.h"
 
 vqf_filter *q_filter;
+vqf_addressing q_addressing = VQF_ADDRESSING_MODULO;
+uint64_t q_tag_bits = 8;
 
 
 inline int q_init(uint64_t nbits)
 {
 	uint64_t nslots = (1ULL << nbits);
-	q_filter = vqf_init(nslots);
+	q_filter = vqf_init(nslots, q_tag_bits, q_addressing);
+	if (q_filter == NULL)
+		return -1;
 	return 0;
 }
 
@@ -53,7 +57,95 @@ inline __uint128_t q_range()
 
 inline int q_destroy()
 {
+	vqf_free(q_filter);
+	q_filter = NULL;
 	return 0;
 }
 
+inline uint64_t q_memory()
+{
+	return q_filter->alloc_size;
+}
+
+inline uint64_t q_size()
+{
+	return vqf_size(q_filter);
+}
+
+inline const char * q_kernels()
+{
+	return vqf_variant_name(vqf_get_variant(q_filter));
+}
+
+inline void q_geometry(uint64_t *nbuckets, uint64_t *nblocks)
+{
+	*nbuckets = q_filter->metadata.range;
+	*nblocks = q_filter->metadata.nblocks;
+}
+
+// Expandable filter, which starts at 1/2^qx_shrink_bits of the capacity
+// and grows as it fills.
+vqf_expandable *qx_filter;
+uint64_t qx_shrink_bits = 6;
+
+inline int qx_init(uint64_t nbits)
+{
+	uint64_t nslots = (1ULL << (nbits > qx_shrink_bits + 10 ? nbits -
+				qx_shrink_bits : 10));
+	qx_filter = vqf_expandable_init(nslots, q_tag_bits, q_addressing, 0);
+	if (qx_filter == NULL)
+		return -1;
+	return 0;
+}
+
+inline int qx_insert(__uint128_t val)
+{
+	if (!vqf_expandable_insert(qx_filter, val))
+		return 0;
+	return 1;
+}
+
+inline int qx_lookup(__uint128_t val)
+{
+	if (!vqf_expandable_is_present(qx_filter, val))
+		return 0;
+	return 1;
+}
+
+inline int qx_remove(__uint128_t val)
+{
+	if (!vqf_expandable_remove(qx_filter, val))
+		return 0;
+	return 1;
+}
+
+inline int qx_destroy()
+{
+	vqf_expandable_free(qx_filter);
+	qx_filter = NULL;
+	return 0;
+}
+
+inline uint64_t qx_memory()
+{
+	return vqf_expandable_memory(qx_filter);
+}
+
+inline uint64_t qx_size()
+{
+	return vqf_expandable_size(qx_filter);
+}
+
+inline const char * qx_kernels()
+{
+	return vqf_variant_name(vqf_get_variant(qx_filter->levels[0]));
+}
+
+// The first level, which takes the inserts until it fills.
+inline void qx_geometry(uint64_t *nbuckets, uint64_t *nblocks)
+{
+	*nbuckets = qx_filter->levels[0]->metadata.range;
+	*nblocks = qx_filter->levels[0]->metadata.nblocks;
+}
+
 #endif
@@ -17,7 +17,8 @@
  */
 
 #include <assert.h>
-#include <openssl/rand.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -27,6 +28,7 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "perf_counters.h"
 #include "vqf_wrapper.h"
 
 typedef void *(*rand_init)(uint64_t maxoutputs, __uint128_t maxvalue,
@@ -40,6 +42,10 @@ typedef int (*lookup_op)(__uint128_t val);
 typedef int (*remove_op)(__uint128_t val);
 typedef __uint128_t (*get_range_op)();
 typedef int (*destroy_op)();
+typedef uint64_t (*memory_op)();
+typedef uint64_t (*size_op)();
+typedef const char *(*kernels_op)();
+typedef void (*geometry_op)(uint64_t *nbuckets, uint64_t *nblocks);
 
 typedef struct rand_generator {
   rand_init init;
@@ -54,8 +60,31 @@ typedef struct filter {
 	remove_op remove;
   get_range_op range;
   destroy_op destroy;
+  memory_op memory;
+  size_op size;
+  kernels_op kernels;
+  geometry_op geometry;
 } filter;
 
+// Generators take a rand_params as params. The seed makes a run repeatable;
+// streams that must differ get different seeds. The other fields configure
+// the skewed and adversarial distributions.
+typedef struct rand_params {
+  uint64_t seed;
+  double zipf_skew;      // zipfian exponent
+  uint64_t ncopies;      // copies of every key of duplicates_pregen
+  uint64_t nhot_blocks;  // blocks the keys of adversarial_pregen map to
+  uint64_t nbuckets;     // of the filter, for adversarial_pregen
+  uint64_t nblocks;
+} rand_params;
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
 typedef struct uniform_pregen_state {
   uint64_t maxoutputs;
   uint64_t nextoutput;
@@ -71,9 +100,7 @@ typedef struct uniform_online_state {
   struct random_data *rand_state;
 } uniform_online_state;
 
-void *uniform_pregen_init(uint64_t maxoutputs, __uint128_t maxvalue,
-                          void *params) {
-  uint32_t i;
+static uniform_pregen_state *pregen_alloc(uint64_t maxoutputs) {
   uniform_pregen_state *state =
       (uniform_pregen_state *)malloc(sizeof(uniform_pregen_state));
   assert(state != NULL);
@@ -84,16 +111,18 @@ void *uniform_pregen_init(uint64_t maxoutputs, __uint128_t maxvalue,
   state->outputs =
       (__uint128_t *)malloc(state->maxoutputs * sizeof(state->outputs[0]));
   assert(state->outputs != NULL);
-  uint64_t nbytes = sizeof(*state->outputs) * state->maxoutputs;
-  uint8_t *ptr = (unsigned char *)state->outputs;
-	while (nbytes > (1ULL << 30)) {
-		RAND_bytes(ptr, 1ULL << 30);
-		ptr += (1ULL << 30);
-		nbytes -= (1ULL << 30);
-	}
-	RAND_bytes(ptr, nbytes);
-  for (i = 0; i < state->maxoutputs; i++)
-    state->outputs[i] = (1 * state->outputs[i]) % maxvalue;
+  return state;
+}
+
+void *uniform_pregen_init(uint64_t maxoutputs, __uint128_t maxvalue,
+                          void *params) {
+  uint64_t i;
+  uint64_t seed = ((rand_params *)params)->seed;
+  uniform_pregen_state *state = pregen_alloc(maxoutputs);
+  for (i = 0; i < state->maxoutputs; i++) {
+    __uint128_t hi = splitmix64(&seed);
+    state->outputs[i] = (hi << 64 | splitmix64(&seed)) % maxvalue;
+  }
 
   return (void *)state;
 }
@@ -124,7 +153,7 @@ void *uniform_online_init(uint64_t maxoutputs, __uint128_t maxvalue,
 
   state->maxoutputs = maxoutputs;
   state->maxvalue = maxvalue;
-  state->seed = time(NULL);
+  state->seed = ((rand_params *)params)->seed;
   state->STATELEN = 256;
   state->buf = (char *)calloc(256, sizeof(char));
   state->rand_state =
@@ -133,7 +162,6 @@ void *uniform_online_init(uint64_t maxoutputs, __uint128_t maxvalue,
   initstate_r(state->seed, state->buf, state->STATELEN, state->rand_state);
   return (void *)state;
 }
-
 int uniform_online_gen_rand(void *_state, uint64_t noutputs,
                             __uint128_t *outputs) {
   uint32_t i, j;
@@ -177,7 +205,178 @@ rand_generator uniform_pregen = {uniform_pregen_init, uniform_pregen_gen_rand,
 rand_generator uniform_online = {uniform_online_init, uniform_online_gen_rand,
                                  uniform_online_duplicate};
 
-filter cf = {q_init, q_insert, q_lookup, q_remove, q_range, q_destroy};
+// The key of rank i of the skewed distributions.
+static __uint128_t ranked_key(uint64_t seed, uint64_t i,
+                              __uint128_t maxvalue) {
+  uint64_t state = seed ^ (i * 0xd6e8feb86659fd93ULL);
+  __uint128_t hi = splitmix64(&state);
+  return (hi << 64 | splitmix64(&state)) % maxvalue;
+}
+
+// Zipfian ranks over [1, n] by rejection-inversion (Hormann and Derflinger,
+// 1996), which takes O(1) per sample for any exponent.
+typedef struct zipf_sampler {
+  double exponent;
+  double h_integral_x1;
+  double h_integral_n;
+  double s;
+} zipf_sampler;
+
+// log1p(x) / x and expm1(x) / x, which tend to 1 at 0.
+static double zipf_helper1(double x) {
+  return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x / 2;
+}
+
+static double zipf_helper2(double x) {
+  return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2;
+}
+
+static double zipf_h(const zipf_sampler *z, double x) {
+  return exp(-z->exponent * log(x));
+}
+
+static double zipf_h_integral(const zipf_sampler *z, double x) {
+  double log_x = log(x);
+  return zipf_helper2((1 - z->exponent) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const zipf_sampler *z, double x) {
+  double t = x * (1 - z->exponent);
+  if (t < -1)
+    t = -1;
+  return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(zipf_sampler *z, uint64_t n, double exponent) {
+  z->exponent = exponent;
+  z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1;
+  z->h_integral_n = zipf_h_integral(z, n + 0.5);
+  z->s = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) -
+                                            zipf_h(z, 2));
+}
+
+static uint64_t zipf_sample(const zipf_sampler *z, uint64_t n,
+                            uint64_t *state) {
+  while (true) {
+    double u = z->h_integral_n + (splitmix64(state) >> 11) * (1.0 / (1ULL << 53)) *
+                                     (z->h_integral_x1 - z->h_integral_n);
+    double x = zipf_h_integral_inverse(z, u);
+    uint64_t k = x + 0.5;
+    if (k < 1)
+      k = 1;
+    else if (k > n)
+      k = n;
+    if (k - x <= z->s || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+      return k;
+  }
+}
+
+// Keys of rank k in [1, maxoutputs] with probability proportional to
+// 1 / k^zipf_skew. Hot keys are inserted many times.
+void *zipfian_pregen_init(uint64_t maxoutputs, __uint128_t maxvalue,
+                          void *params) {
+  rand_params *p = (rand_params *)params;
+  uint64_t seed = p->seed, n = maxoutputs > 0 ? maxoutputs : 1;
+  uniform_pregen_state *state = pregen_alloc(maxoutputs);
+  zipf_sampler z;
+  zipf_init(&z, n, p->zipf_skew);
+  for (uint64_t i = 0; i < state->maxoutputs; i++)
+    state->outputs[i] = ranked_key(p->seed, zipf_sample(&z, n, &seed), maxvalue);
+  return (void *)state;
+}
+
+// Every key ncopies times, shuffled.
+void *duplicates_pregen_init(uint64_t maxoutputs, __uint128_t maxvalue,
+                             void *params) {
+  rand_params *p = (rand_params *)params;
+  uint64_t seed = p->seed;
+  uniform_pregen_state *state = pregen_alloc(maxoutputs);
+  for (uint64_t i = 0; i < state->maxoutputs; i++)
+    state->outputs[i] = ranked_key(p->seed, i / p->ncopies, maxvalue);
+  for (uint64_t i = state->maxoutputs; i > 1; i--) {
+    uint64_t j = splitmix64(&seed) % i;
+    __uint128_t t = state->outputs[i - 1];
+    state->outputs[i - 1] = state->outputs[j];
+    state->outputs[j] = t;
+  }
+  return (void *)state;
+}
+
+// Number of tags of adversarial_pregen keys. Few tags also make the
+// alternate buckets of the keys few.
+#define ADVERSARIAL_TAGS 8
+
+// A hash whose bucket, through hash % nbuckets or its fastrange
+// counterpart, is bucket, and whose bits 32..47, of which the tag is taken,
+// are tag. Filters with 2^31 buckets or more get random tags with modulo
+// addressing, and may get the next bucket with fastrange past 2^46.
+static uint64_t adversarial_hash(const rand_params *p, uint64_t bucket,
+                                 uint64_t tag, uint64_t *state) {
+  uint64_t r = splitmix64(state);
+  if (q_addressing == VQF_ADDRESSING_FASTRANGE) {
+    // The bucket is bits * nbuckets >> 64, where bits are the hash without
+    // bits 32..47 and shifted up by 16, so their low 16 bits are 0.
+    uint64_t lo = (((__uint128_t)bucket << 64) + p->nbuckets - 1) / p->nbuckets;
+    uint64_t width = ((((__uint128_t)(bucket + 1)) << 64) - 1) / p->nbuckets - lo;
+    uint64_t bits = width > (1ULL << 17)
+                        ? (lo + 0xffff + r % (width - 0xffff)) & ~0xffffULL
+                        : lo;
+    return (bits & 0xffff000000000000ULL) | tag << 32 |
+           ((bits >> 16) & 0xffffffffULL);
+  }
+  uint64_t hash = r >> 1;
+  if (p->nbuckets < (1ULL << 31)) {
+    // Bits 0..31 stay in [nbuckets, 2^32 - nbuckets), so moving the hash to
+    // bucket neither borrows from nor carries into the tag.
+    uint64_t low = p->nbuckets + (r & 0xffffffffULL) %
+                                     ((1ULL << 32) - 2 * p->nbuckets);
+    hash = (r & 0xffff000000000000ULL) | tag << 32 | low;
+  }
+  return hash - hash % p->nbuckets + bucket;
+}
+
+// Keys that all map to nhot_blocks blocks, with ADVERSARIAL_TAGS tags.
+void *adversarial_pregen_init(uint64_t maxoutputs, __uint128_t maxvalue,
+                              void *params) {
+  rand_params *p = (rand_params *)params;
+  uint64_t seed = p->seed;
+  uint64_t buckets_per_block = p->nbuckets / p->nblocks;
+  uniform_pregen_state *state = pregen_alloc(maxoutputs);
+  uint64_t *hot = (uint64_t *)malloc(p->nhot_blocks * sizeof(hot[0]));
+  assert(hot != NULL);
+  // The hot blocks and tags depend on the seed of the distribution only,
+  // so that negative lookups hit the same blocks.
+  uint64_t layout_seed = 0;
+  for (uint64_t i = 0; i < p->nhot_blocks; i++)
+    hot[i] = splitmix64(&layout_seed) % p->nblocks;
+  for (uint64_t i = 0; i < state->maxoutputs; i++) {
+    uint64_t block = hot[splitmix64(&seed) % p->nhot_blocks];
+    uint64_t bucket = block * buckets_per_block +
+                      splitmix64(&seed) % buckets_per_block;
+    uint64_t tag = 1 + splitmix64(&seed) % ADVERSARIAL_TAGS;
+    state->outputs[i] = adversarial_hash(p, bucket, tag, &seed) % maxvalue;
+  }
+  free(hot);
+  return (void *)state;
+}
+
+rand_generator zipfian_pregen = {zipfian_pregen_init, uniform_pregen_gen_rand,
+                                 uniform_pregen_duplicate};
+
+rand_generator duplicates_pregen = {duplicates_pregen_init,
+                                    uniform_pregen_gen_rand,
+                                    uniform_pregen_duplicate};
+
+rand_generator adversarial_pregen = {adversarial_pregen_init,
+                                     uniform_pregen_gen_rand,
+                                     uniform_pregen_duplicate};
+
+
+filter cf = {q_init, q_insert, q_lookup, q_remove, q_range, q_destroy,
+             q_memory, q_size, q_kernels, q_geometry};
+
+filter cfx = {qx_init, qx_insert, qx_lookup, qx_remove, q_range, qx_destroy,
+              qx_memory, qx_size, qx_kernels, qx_geometry};
 
 uint64_t tv2usec(struct timeval tv) {
   return 1000000 * tv.tv_sec + tv.tv_usec;
@@ -192,6 +391,185 @@ int cmp_uint64_t(const void *a, const void *b) {
   return *ua < *ub ? -1 : *ua == *ub ? 0 : 1;
 }
 
+// A phase runs one operation over a buffer of keys, or the operations of a
+// mix, split into contiguous ranges over the threads.
+enum phase_kind { PHASE_INSERT, PHASE_LOOKUP, PHASE_REMOVE, PHASE_MIXED };
+
+enum mix_op { MIX_LOOKUP, MIX_INSERT, MIX_REMOVE };
+
+typedef struct phase_task {
+  filter *ds;
+  enum phase_kind kind;
+  const __uint128_t *keys;
+  const uint8_t *ops;
+  uint64_t begin;
+  uint64_t end;
+  int cpu;
+  uint64_t npositive;
+  uint64_t nfailed;
+  uint64_t fail_items;
+} phase_task;
+
+typedef struct phase_result {
+  uint64_t usecs;
+  uint64_t npositive;   // lookups that found their key
+  uint64_t nfailed;     // inserts and removes that failed
+  uint64_t fail_items;  // items at the first failed insert, or UINT64_MAX
+  double counts[PERF_NCOUNTERS];  // hardware counts, or -1 if not counted
+} phase_result;
+
+static void pin_thread(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    fprintf(stderr, "Can't pin a thread to CPU %d.\n", cpu);
+}
+
+static void *run_task(void *arg) {
+  phase_task *task = (phase_task *)arg;
+  filter *ds = task->ds;
+  uint64_t npositive = 0, nfailed = 0;
+  task->fail_items = UINT64_MAX;
+  for (uint64_t i = task->begin; i < task->end; i++) {
+    int op = task->kind == PHASE_MIXED ? task->ops[i]
+             : task->kind == PHASE_INSERT ? MIX_INSERT
+             : task->kind == PHASE_REMOVE ? MIX_REMOVE
+                                          : MIX_LOOKUP;
+    if (op == MIX_LOOKUP)
+      npositive += ds->lookup(task->keys[i]);
+    else if (op == MIX_INSERT && !ds->insert(task->keys[i])) {
+      if (nfailed++ == 0)
+        task->fail_items = ds->size();
+    } else if (op == MIX_REMOVE)
+      nfailed += !ds->remove(task->keys[i]);
+  }
+  task->npositive = npositive;
+  task->nfailed = nfailed;
+  return NULL;
+}
+
+static void *run_pinned_task(void *arg) {
+  pin_thread(((phase_task *)arg)->cpu);
+  return run_task(arg);
+}
+
+// The calling thread runs the first range. Threads are pinned to CPUs 0, 1,
+// ... in turn if pin is set; the calling thread is pinned once in main.
+// counters, if not NULL, count the phase with the threads it starts.
+static phase_result run_phase(filter *ds, enum phase_kind kind,
+                              const __uint128_t *keys, const uint8_t *ops,
+                              uint64_t n, uint64_t nthreads, bool pin,
+                              perf_counters *counters) {
+  phase_task *tasks = (phase_task *)calloc(nthreads, sizeof(tasks[0]));
+  pthread_t *threads = (pthread_t *)calloc(nthreads, sizeof(threads[0]));
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct timeval start, end;
+  phase_result result = {0, 0, 0, UINT64_MAX};
+  assert(tasks != NULL && threads != NULL);
+
+  for (uint64_t t = 0; t < nthreads; t++) {
+    tasks[t].ds = ds;
+    tasks[t].kind = kind;
+    tasks[t].keys = keys;
+    tasks[t].ops = ops;
+    tasks[t].begin = n * t / nthreads;
+    tasks[t].end = n * (t + 1) / nthreads;
+    tasks[t].cpu = t % (ncpus > 0 ? ncpus : 1);
+  }
+  gettimeofday(&start, NULL);
+  if (counters != NULL)
+    perf_counters_start(counters);
+  for (uint64_t t = 1; t < nthreads; t++) {
+    if (pthread_create(&threads[t], NULL, pin ? run_pinned_task : run_task,
+                       &tasks[t]) != 0) {
+      fprintf(stderr, "Can't start a thread.\n");
+      exit(1);
+    }
+  }
+  run_task(&tasks[0]);
+  for (uint64_t t = 1; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  if (counters != NULL)
+    perf_counters_stop(counters);
+  gettimeofday(&end, NULL);
+
+  result.usecs = tv2usec(end) - tv2usec(start);
+  if (result.usecs == 0)
+    result.usecs = 1;
+  for (int c = 0; c < PERF_NCOUNTERS; c++)
+    result.counts[c] = counters != NULL ? counters->values[c] : -1;
+  for (uint64_t t = 0; t < nthreads; t++) {
+    result.npositive += tasks[t].npositive;
+    result.nfailed += tasks[t].nfailed;
+    if (tasks[t].fail_items < result.fail_items)
+      result.fail_items = tasks[t].fail_items;
+  }
+  free(tasks);
+  free(threads);
+  return result;
+}
+
+static void print_phase_counts(const perf_counters *counters,
+                               const char *phase, uint64_t nops) {
+  if (counters == NULL)
+    return;
+  printf("  %s", phase);
+  perf_counters_print(counters, nops);
+}
+
+// Rows of the CSV output. Every row carries the configuration of the run,
+// so rows from different builds and machines can be concatenated.
+typedef struct bm_config {
+  uint32_t nbits;
+  uint64_t nthreads;
+  bool pin;
+  uint64_t seed;
+  const char *randmode;
+  const char *datastruct;
+  const char *mix;
+} bm_config;
+
+static void write_csv_header(FILE *fp) {
+  fprintf(fp,
+          "log_slots,tag_bits,kernels,enable_threads,addressing,datastruct,"
+          "distribution,seed,nthreads,pinned,mix,run,round,phase,ops,usecs,"
+          "mops,positives,failures,failure_load_factor,items,load_factor,"
+          "bytes_per_item,cycles_per_op,instructions_per_op,"
+          "llc_misses_per_op,dtlb_misses_per_op,branch_misses_per_op\n");
+}
+
+static void write_csv_row(FILE *fp, const bm_config *cfg, filter *ds,
+                          uint32_t run, uint32_t round, const char *phase,
+                          uint64_t nops, const phase_result *result) {
+#ifdef ENABLE_THREADS
+  const int enable_threads = 1;
+#else
+  const int enable_threads = 0;
+#endif
+  uint64_t items = ds->size();
+  char failure_load[32] = "";
+  if (result->fail_items != UINT64_MAX)
+    snprintf(failure_load, sizeof(failure_load), "%f",
+             1.0 * result->fail_items / (1ULL << cfg->nbits));
+  fprintf(fp, "%u,%lu,%s,%d,%s,%s,%s,%lu,%lu,%d,%s,%u,%u,%s,%lu,%lu,%f,%lu,"
+          "%lu,%s,%lu,%f,%f", cfg->nbits, q_tag_bits, ds->kernels(),
+          enable_threads, q_addressing == VQF_ADDRESSING_FASTRANGE ?
+          "fastrange" : "modulo", cfg->datastruct, cfg->randmode, cfg->seed,
+          cfg->nthreads, cfg->pin, cfg->mix, run, round, phase, nops,
+          result->usecs, 1.0 * nops / result->usecs, result->npositive,
+          result->nfailed, failure_load, items, 1.0 * items /
+          (1ULL << cfg->nbits), items != 0 ? 1.0 * ds->memory() / items : 0.0);
+  // Counters that were not counted are left empty.
+  for (int c = 0; c < PERF_NCOUNTERS; c++) {
+    if (result->counts[c] < 0)
+      fprintf(fp, ",");
+    else
+      fprintf(fp, ",%f", result->counts[c] / nops);
+  }
+  fprintf(fp, "\n");
+}
+
 void usage(char *name) {
   printf(
       "%s [OPTIONS]\n"
@@ -202,58 +580,100 @@ void usage(char *name) {
       "  -m randmode   [ Data distribution, one of \n"
       "                    uniform_pregen\n"
       "                    uniform_online\n"
-      "                    zipfian_pregen\n"
+      "                    zipfian_pregen      keys of rank k with probability\n"
+      "                                        proportional to 1/k^skew\n"
+      "                    duplicates_pregen   every key inserted -D times\n"
+      "                    adversarial_pregen  keys that map to -H blocks\n"
+      "                                        with 8 tags\n"
       "                  Default uniform_pregen ]\n"
-      "  -d datastruct  [ Default qf. ]\n"
+      "  -z skew       [ Exponent of zipfian_pregen.  Default 0.99 ]\n"
+      "  -D ncopies    [ Copies of each key of duplicates_pregen.  Default 8 ]\n"
+      "  -H nblocks    [ Hot blocks of adversarial_pregen.  Default 4 ]\n"
+      "  -d datastruct  [ cf, or cfx for a filter that starts at 1/64 of\n"
+      "                   the capacity and grows.  Default cf. ]\n"
+      "  -a addressing  [ Bucket addressing, one of \n"
+      "                    modulo\n"
+      "                    fastrange\n"
+      "                  Default modulo ]\n"
+      "  -t tagbits     [ Tag size: 8, 12 or 16.  Default 8 ]\n"
+      "  -v kernels     [ Kernels, one of \n"
+      "                    generic\n"
+      "                    avx2\n"
+      "                    avx2-nopdep\n"
+      "                    avx512\n"
+      "                  Default: best supported ]\n"
+      "  -T nthreads    [ Threads per phase; more than 1 needs a THREAD=1\n"
+      "                   build.  Default 1 ]\n"
+      "  -P             [ Pin thread i to CPU i modulo the CPU count ]\n"
+      "  -s seed        [ Seed of the keys and of the mix.  Default 1 ]\n"
+      "  -w R:I:D       [ After the lookups of each round, also run a mix of\n"
+      "                   lookups of inserted keys, inserts of new keys and\n"
+      "                   removes of keys inserted by earlier mixes, in\n"
+      "                   these proportions (1:1:1 is the main_id mix) ]\n"
+      "  -c csvfile     [ Also write every phase as a CSV row that includes\n"
+      "                   the build configuration ]\n"
+      "  -e             [ Count cycles, instructions, LLC, dTLB and branch\n"
+      "                   misses per operation of every phase with\n"
+      "                   perf_event_open, where the kernel allows it ]\n"
       "  -f outputfile  [ Default qf. ]\n",
       name);
 }
 
 int main(int argc, char **argv) {
-  uint32_t nbits = 0, nruns = 0;
-  unsigned int npoints = 0;
+  uint32_t nbits = 24, nruns = 1;
+  unsigned int npoints = 20;
   uint64_t nslots = 0, nvals = 0;
+  uint64_t nthreads = 1;
+  bool pin = false;
+  uint64_t seed = 1;
+  double zipf_skew = 0.99;
+  uint64_t ncopies = 8, nhot_blocks = 4;
+  unsigned int mix[3] = {0, 0, 0};
+  const char *mix_arg = "";
+  char *csvfile = NULL;
+  bool count_events = false;
+  perf_counters counters;
   char *randmode = "uniform_pregen";
-  char *datastruct = "qf";
+  char *datastruct = "cf";
   char *outputfile = "qf";
 
   filter filter_ds;
   rand_generator *vals_gen;
   void *vals_gen_state;
-  void *old_vals_gen_state;
   void *remove_vals_gen_state;
   rand_generator *othervals_gen;
   void *othervals_gen_state;
+  void *mixvals_gen_state = NULL;
 
-  //	__uint128_t *vals;
-  //	__uint128_t *othervals;
-
-  unsigned int i, j, exp, run;
-  struct timeval tv_insert[100][1];
-  struct timeval tv_exit_lookup[100][1];
-  struct timeval tv_false_lookup[100][1];
-  struct timeval tv_remove[100][1];
+  unsigned int exp, run;
   uint64_t fps = 0;
 
   FILE *fp_insert;
   FILE *fp_exit_lookup;
   FILE *fp_false_lookup;
   FILE *fp_remove;
+  FILE *fp_memory;
+  FILE *fp_mixed = NULL;
+  FILE *fp_csv = NULL;
   const char *dir = "./";
   const char *insert_op = "-insert.txt\0";
   const char *exit_lookup_op = "-exists-lookup.txt\0";
   const char *false_lookup_op = "-false-lookup.txt\0";
   const char *remove_op = "-remove.txt\0";
+  const char *memory_op = "-memory.txt\0";
+  const char *mixed_op = "-mixed.txt\0";
   char filename_insert[256];
   char filename_exit_lookup[256];
   char filename_false_lookup[256];
   char filename_remove[256];
+  char filename_memory[256];
+  char filename_mixed[256];
 
   /* Argument parsing */
   int opt;
   char *term;
 
-  while ((opt = getopt(argc, argv, "n:r:p:m:d:f:")) != -1) {
+  while ((opt = getopt(argc, argv, "n:r:p:m:d:f:a:t:v:T:Ps:w:c:ez:D:H:")) != -1) {
     switch (opt) {
       case 'n':
         nbits = strtol(optarg, &term, 10);
@@ -262,8 +682,6 @@ int main(int argc, char **argv) {
           usage(argv[0]);
           exit(1);
         }
-        nslots = (1ULL << nbits);
-        nvals = 950 * nslots / 1000;
         break;
       case 'r':
         nruns = strtol(optarg, &term, 10);
@@ -290,6 +708,105 @@ int main(int argc, char **argv) {
       case 'f':
         outputfile = optarg;
         break;
+      case 'a':
+        if (strcmp(optarg, "modulo") == 0) {
+          q_addressing = VQF_ADDRESSING_MODULO;
+        } else if (strcmp(optarg, "fastrange") == 0) {
+          q_addressing = VQF_ADDRESSING_FASTRANGE;
+        } else {
+          fprintf(stderr, "Unknown addressing mode.\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 't':
+        q_tag_bits = strtol(optarg, &term, 10);
+        if (*term) {
+          fprintf(stderr, "Argument to -t must be an integer\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'v':
+        {
+          vqf_variant variant;
+          if (strcmp(optarg, "generic") == 0) {
+            variant = VQF_VARIANT_GENERIC;
+          } else if (strcmp(optarg, "avx2") == 0) {
+            variant = VQF_VARIANT_AVX2;
+          } else if (strcmp(optarg, "avx2-nopdep") == 0) {
+            variant = VQF_VARIANT_AVX2_NOPDEP;
+          } else if (strcmp(optarg, "avx512") == 0) {
+            variant = VQF_VARIANT_AVX512;
+          } else {
+            fprintf(stderr, "Unknown kernels.\n");
+            usage(argv[0]);
+            exit(1);
+          }
+          if (!vqf_set_variant(variant)) {
+            fprintf(stderr, "This CPU does not support %s.\n", optarg);
+            exit(1);
+          }
+        }
+        break;
+      case 'T':
+        nthreads = strtol(optarg, &term, 10);
+        if (*term || nthreads == 0) {
+          fprintf(stderr, "Argument to -T must be a positive integer\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'P':
+        pin = true;
+        break;
+      case 's':
+        seed = strtoull(optarg, &term, 10);
+        if (*term) {
+          fprintf(stderr, "Argument to -s must be an integer\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'w':
+        if (sscanf(optarg, "%u:%u:%u", &mix[0], &mix[1], &mix[2]) != 3 ||
+            mix[0] + mix[1] + mix[2] == 0) {
+          fprintf(stderr, "Argument to -w must be R:I:D\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        mix_arg = optarg;
+        break;
+      case 'c':
+        csvfile = optarg;
+        break;
+      case 'e':
+        count_events = true;
+        break;
+      case 'z':
+        zipf_skew = strtod(optarg, &term);
+        if (*term || zipf_skew <= 0) {
+          fprintf(stderr, "Argument to -z must be a positive number\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'D':
+        ncopies = strtol(optarg, &term, 10);
+        if (*term || ncopies == 0) {
+          fprintf(stderr, "Argument to -D must be a positive integer\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 'H':
+        nhot_blocks = strtol(optarg, &term, 10);
+        if (*term || nhot_blocks == 0) {
+          fprintf(stderr, "Argument to -H must be a positive integer\n");
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
       default:
         fprintf(stderr, "Unknown option\n");
         usage(argv[0]);
@@ -297,6 +814,15 @@ int main(int argc, char **argv) {
         break;
     }
   }
+  nslots = (1ULL << nbits);
+  nvals = 950 * nslots / 1000;
+#ifndef ENABLE_THREADS
+  if (nthreads > 1) {
+    fprintf(stderr, "Build with THREAD=1 to run more than one thread.\n");
+    exit(1);
+  }
+#endif
+  bool mixed = mix[0] + mix[1] + mix[2] != 0;
 
   if (strcmp(randmode, "uniform_pregen") == 0) {
     vals_gen = &uniform_pregen;
@@ -304,6 +830,15 @@ int main(int argc, char **argv) {
   } else if (strcmp(randmode, "uniform_online") == 0) {
     vals_gen = &uniform_online;
     othervals_gen = &uniform_online;
+  } else if (strcmp(randmode, "zipfian_pregen") == 0) {
+    vals_gen = &zipfian_pregen;
+    othervals_gen = &zipfian_pregen;
+  } else if (strcmp(randmode, "duplicates_pregen") == 0) {
+    vals_gen = &duplicates_pregen;
+    othervals_gen = &duplicates_pregen;
+  } else if (strcmp(randmode, "adversarial_pregen") == 0) {
+    vals_gen = &adversarial_pregen;
+    othervals_gen = &adversarial_pregen;
   } else {
     fprintf(stderr, "Unknown randmode.\n");
     usage(argv[0]);
@@ -312,6 +847,8 @@ int main(int argc, char **argv) {
 
   if (strcmp(datastruct, "cf") == 0) {
     filter_ds = cf;
+  } else if (strcmp(datastruct, "cfx") == 0) {
+    filter_ds = cfx;
     //	} else if (strcmp(datastruct, "gqf") == 0) {
     //		filter_ds = gqf;
     //	} else if (strcmp(datastruct, "qf") == 0) {
@@ -323,6 +860,19 @@ int main(int argc, char **argv) {
     usage(argv[0]);
     exit(1);
   }
+  // The distribution with its parameter, as the CSV rows name it.
+  char distribution[64];
+  if (vals_gen == &zipfian_pregen)
+    snprintf(distribution, sizeof(distribution), "%s:%g", randmode, zipf_skew);
+  else if (vals_gen == &duplicates_pregen)
+    snprintf(distribution, sizeof(distribution), "%s:%lu", randmode, ncopies);
+  else if (vals_gen == &adversarial_pregen)
+    snprintf(distribution, sizeof(distribution), "%s:%lu", randmode,
+             nhot_blocks);
+  else
+    snprintf(distribution, sizeof(distribution), "%s", randmode);
+  bm_config cfg = {nbits,        nthreads,   pin,    seed,
+                   distribution, datastruct, mix_arg};
 
   snprintf(filename_insert,
            strlen(dir) + strlen(outputfile) + strlen(insert_op) + 1, "%s%s%s",
@@ -337,14 +887,26 @@ int main(int argc, char **argv) {
   snprintf(filename_remove,
            strlen(dir) + strlen(outputfile) + strlen(remove_op) + 1, "%s%s%s",
            dir, outputfile, remove_op);
+  snprintf(filename_memory,
+           strlen(dir) + strlen(outputfile) + strlen(memory_op) + 1, "%s%s%s",
+           dir, outputfile, memory_op);
+  snprintf(filename_mixed,
+           strlen(dir) + strlen(outputfile) + strlen(mixed_op) + 1, "%s%s%s",
+           dir, outputfile, mixed_op);
 
   fp_insert = fopen(filename_insert, "w");
   fp_exit_lookup = fopen(filename_exit_lookup, "w");
   fp_false_lookup = fopen(filename_false_lookup, "w");
   fp_remove = fopen(filename_remove, "w");
+  fp_memory = fopen(filename_memory, "w");
+  if (mixed)
+    fp_mixed = fopen(filename_mixed, "w");
+  if (csvfile != NULL)
+    fp_csv = fopen(csvfile, "w");
 
 	if (fp_insert == NULL || fp_exit_lookup == NULL || fp_false_lookup == NULL
-			|| fp_remove == NULL) {
+			|| fp_remove == NULL || fp_memory == NULL || (mixed && fp_mixed == NULL)
+			|| (csvfile != NULL && fp_csv == NULL)) {
     printf("Can't open the data file");
     exit(1);
   }
@@ -373,128 +935,227 @@ int main(int argc, char **argv) {
   }
   fprintf(fp_remove, "\n");
 
+  fprintf(fp_memory, "x_0");
+  for (run = 0; run < nruns; run++) {
+    fprintf(fp_memory, "    y_%d", run);
+  }
+  fprintf(fp_memory, "\n");
+
   fclose(fp_insert);
   fclose(fp_exit_lookup);
   fclose(fp_false_lookup);
   fclose(fp_remove);
+  fclose(fp_memory);
+
+  if (mixed) {
+    fprintf(fp_mixed, "x_0");
+    for (run = 0; run < nruns; run++) {
+      fprintf(fp_mixed, "    y_%d", run);
+    }
+    fprintf(fp_mixed, "\n");
+    fclose(fp_mixed);
+  }
+  if (fp_csv != NULL)
+    write_csv_header(fp_csv);
+
+  if (pin)
+    pin_thread(0);
+
+  perf_counters *phase_counters = NULL;
+  if (count_events) {
+    if (perf_counters_open(&counters) == 0)
+      printf("No hardware counters available, perf_event_open failed.\n");
+    phase_counters = &counters;
+  }
+
+  // Keys are generated into these buffers before each phase, so that the
+  // threads only time the filter. The mix keeps all the keys it may look up
+  // or remove.
+  uint64_t nround = npoints != 0 ? nvals / npoints : 0;
+  __uint128_t *keys =
+      (__uint128_t *)malloc((nround + 1) * sizeof(keys[0]));
+  __uint128_t *mix_keys = NULL, *inserted = NULL, *mix_inserted = NULL;
+  uint8_t *mix_ops = NULL;
+  assert(keys != NULL);
+  if (mixed) {
+    mix_keys = (__uint128_t *)malloc((nround + 1) * sizeof(mix_keys[0]));
+    mix_ops = (uint8_t *)malloc(nround + 1);
+    inserted = (__uint128_t *)malloc((nvals + 1) * sizeof(inserted[0]));
+    mix_inserted = (__uint128_t *)malloc((nvals + 1) * sizeof(inserted[0]));
+    assert(mix_keys != NULL && mix_ops != NULL && inserted != NULL &&
+           mix_inserted != NULL);
+  }
 
   for (run = 0; run < nruns; run++) {
+    // Every run repeats the keys of the first one: the keys, the negative
+    // keys and the keys inserted by the mix are streams of their own.
+    rand_params stream_params[3];
+    uint64_t seed_state = seed;
+    for (int s = 0; s < 3; s++) {
+      stream_params[s].seed = splitmix64(&seed_state);
+      stream_params[s].zipf_skew = zipf_skew;
+      stream_params[s].ncopies = ncopies;
+      stream_params[s].nhot_blocks = nhot_blocks;
+    }
+    uint64_t mix_state = splitmix64(&seed_state);
+    uint64_t nmix_inserted = 0, nmix_removed = 0;
+    uint64_t fail_items = UINT64_MAX;
+
     fps = 0;
-    filter_ds.init(nbits);
+    if (filter_ds.init(nbits) != 0) {
+      fprintf(stderr, "Can't allocate the filter.\n");
+      exit(1);
+    }
+    for (int s = 0; s < 3; s++)
+      filter_ds.geometry(&stream_params[s].nbuckets, &stream_params[s].nblocks);
 
-    vals_gen_state = vals_gen->init(nvals, filter_ds.range(), NULL);
-    old_vals_gen_state = vals_gen->dup(vals_gen_state);
+    vals_gen_state = vals_gen->init(nvals, filter_ds.range(), &stream_params[0]);
     remove_vals_gen_state = vals_gen->dup(vals_gen_state);
-    sleep(5);
-    othervals_gen_state = othervals_gen->init(nvals, filter_ds.range(), NULL);
+    othervals_gen_state =
+        othervals_gen->init(nvals, filter_ds.range(), &stream_params[1]);
+    if (mixed)
+      mixvals_gen_state =
+          vals_gen->init(nvals, filter_ds.range(), &stream_params[2]);
 
     for (exp = 0; exp < 2 * npoints; exp += 2) {
+      phase_result result;
       fp_insert = fopen(filename_insert, "a");
       fp_exit_lookup = fopen(filename_exit_lookup, "a");
       fp_false_lookup = fopen(filename_false_lookup, "a");
+      fp_memory = fopen(filename_memory, "a");
 
-      i = (exp / 2) * (nvals / npoints);
-      j = ((exp / 2) + 1) * (nvals / npoints);
+      uint64_t j = ((exp / 2) + 1) * nround;
       printf("Round: %d\n", exp / 2);
 
-      gettimeofday(&tv_insert[exp][run], NULL);
-      for (; i < j; i += 1 << 16) {
-        int nitems = j - i < 1 << 16 ? j - i : 1 << 16;
-        __uint128_t vals[1 << 16];
-        int m;
-        assert(vals_gen->gen(vals_gen_state, nitems, vals) == nitems);
-
-        for (m = 0; m < nitems; m++) {
-          filter_ds.insert(vals[m]);
-        }
-      }
-      gettimeofday(&tv_insert[exp + 1][run], NULL);
+      assert(vals_gen->gen(vals_gen_state, nround, keys) == (int)nround);
+      if (mixed)
+        memcpy(inserted + j - nround, keys, nround * sizeof(keys[0]));
+      result = run_phase(&filter_ds, PHASE_INSERT, keys, NULL, nround,
+                         nthreads, pin, phase_counters);
+      print_phase_counts(phase_counters, "insert", nround);
+      if (result.fail_items < fail_items)
+        fail_items = result.fail_items;
       fprintf(fp_insert, "%d", ((exp / 2) * (100 / npoints)));
-      fprintf(fp_insert, " %f\n",
-               1.0 * (nvals / npoints) /
-                  (tv2usec(tv_insert[exp + 1][run]) -
-                   tv2usec(tv_insert[exp][run])));
-
-      i = (exp / 2) * (nvals / 20);
-      gettimeofday(&tv_exit_lookup[exp][run], NULL);
-      for (; i < j; i += 1 << 16) {
-        int nitems = j - i < 1 << 16 ? j - i : 1 << 16;
-        __uint128_t vals[1 << 16];
-        int m;
-        assert(vals_gen->gen(old_vals_gen_state, nitems, vals) == nitems);
-        for (m = 0; m < nitems; m++) {
-          if (!filter_ds.lookup(vals[m])) {
-            // fprintf(stderr, "Failed lookup for 0x%lx%016lx\n",
-            //(uint64_t)(vals[m] >> 64),
-            //(uint64_t)(vals[m] & 0xffffffffffffffff));
-            // abort();
-          }
-        }
-      }
-      gettimeofday(&tv_exit_lookup[exp + 1][run], NULL);
+      fprintf(fp_insert, " %f\n", 1.0 * nround / result.usecs);
+      if (fp_csv != NULL)
+        write_csv_row(fp_csv, &cfg, &filter_ds, run, exp / 2, "insert",
+                      nround, &result);
+
+      // The keys of this round.
+      result = run_phase(&filter_ds, PHASE_LOOKUP, keys, NULL, nround,
+                         nthreads, pin, phase_counters);
+      print_phase_counts(phase_counters, "exists_lookup", nround);
       fprintf(fp_exit_lookup, "%d", ((exp / 2) * (100 / npoints)));
-      fprintf(fp_exit_lookup, " %f\n",
-              1.0 * (nvals / npoints) /
-                  (tv2usec(tv_exit_lookup[exp + 1][run]) -
-                   tv2usec(tv_exit_lookup[exp][run])));
-
-      i = (exp / 2) * (nvals / 20);
-      gettimeofday(&tv_false_lookup[exp][run], NULL);
-      for (; i < j; i += 1 << 16) {
-        int nitems = j - i < 1 << 16 ? j - i : 1 << 16;
-        __uint128_t othervals[1 << 16];
-        int m;
-        assert(othervals_gen->gen(othervals_gen_state, nitems, othervals) ==
-               nitems);
-        for (m = 0; m < nitems; m++) {
-          fps += filter_ds.lookup(othervals[m]);
-        }
-      }
-      gettimeofday(&tv_false_lookup[exp + 1][run], NULL);
+      fprintf(fp_exit_lookup, " %f\n", 1.0 * nround / result.usecs);
+      if (fp_csv != NULL)
+        write_csv_row(fp_csv, &cfg, &filter_ds, run, exp / 2, "exists_lookup",
+                      nround, &result);
+
+      assert(othervals_gen->gen(othervals_gen_state, nround, keys) ==
+             (int)nround);
+      result = run_phase(&filter_ds, PHASE_LOOKUP, keys, NULL, nround,
+                         nthreads, pin, phase_counters);
+      print_phase_counts(phase_counters, "false_lookup", nround);
+      fps += result.npositive;
       fprintf(fp_false_lookup, "%d", ((exp / 2) * (100 / npoints)));
-      fprintf(fp_false_lookup, " %f\n",
-              1.0 * (nvals / npoints) /
-                  (tv2usec(tv_false_lookup[exp + 1][run]) -
-                   tv2usec(tv_false_lookup[exp][run])));
+      fprintf(fp_false_lookup, " %f\n", 1.0 * nround / result.usecs);
+      if (fp_csv != NULL)
+        write_csv_row(fp_csv, &cfg, &filter_ds, run, exp / 2, "false_lookup",
+                      nround, &result);
+
+      // bytes per item inserted so far
+      fprintf(fp_memory, "%d", ((exp / 2) * (100 / npoints)));
+      fprintf(fp_memory, " %f\n", 1.0 * filter_ds.memory() / j);
 
       fclose(fp_insert);
       fclose(fp_exit_lookup);
       fclose(fp_false_lookup);
+      fclose(fp_memory);
+
+      if (mixed) {
+        // Removes take the oldest key inserted by a mix, if it was inserted
+        // in an earlier round or earlier by the same thread, so that they
+        // never race with the insert of their key; without one, they become
+        // lookups. Keys inserted by other threads of the round are skipped.
+        uint64_t total = mix[0] + mix[1] + mix[2];
+        uint64_t round_start = nmix_inserted, chunk_start = nmix_inserted;
+        for (uint64_t i = 0, t = 0; i < nround; i++) {
+          if (i == nround * t / nthreads) {
+            chunk_start = nmix_inserted;
+            t++;
+          }
+          if (nmix_removed >= round_start && nmix_removed < chunk_start)
+            nmix_removed = chunk_start;
+          uint64_t r = splitmix64(&mix_state) % total;
+          if (r >= mix[0] + mix[1] && nmix_removed < nmix_inserted) {
+            mix_ops[i] = MIX_REMOVE;
+            mix_keys[i] = mix_inserted[nmix_removed++];
+          } else if (r >= mix[0] && r < mix[0] + mix[1]) {
+            mix_ops[i] = MIX_INSERT;
+            assert(vals_gen->gen(mixvals_gen_state, 1,
+                                 &mix_inserted[nmix_inserted]) == 1);
+            mix_keys[i] = mix_inserted[nmix_inserted++];
+          } else {
+            mix_ops[i] = MIX_LOOKUP;
+            mix_keys[i] = inserted[splitmix64(&mix_state) % j];
+          }
+        }
+
+        fp_mixed = fopen(filename_mixed, "a");
+        result = run_phase(&filter_ds, PHASE_MIXED, mix_keys, mix_ops, nround,
+                           nthreads, pin, phase_counters);
+        print_phase_counts(phase_counters, "mixed", nround);
+        if (result.fail_items < fail_items)
+          fail_items = result.fail_items;
+        fprintf(fp_mixed, "%d", ((exp / 2) * (100 / npoints)));
+        fprintf(fp_mixed, " %f\n", 1.0 * nround / result.usecs);
+        fclose(fp_mixed);
+        if (fp_csv != NULL)
+          write_csv_row(fp_csv, &cfg, &filter_ds, run, exp / 2, "mixed",
+                        nround, &result);
+      }
     }
 
     for (exp = 0; exp < 2 * npoints; exp += 2) {
+       phase_result result;
        fp_remove = fopen(filename_remove, "a");
-       i = (exp / 2) * (nvals / npoints);
-       j = ((exp / 2) + 1) * (nvals / npoints);
        printf("Round: %d\n", exp / 2);
 
-       gettimeofday(&tv_remove[exp][run], NULL);
-       for (; i < j; i += 1 << 16) {
-          int nitems = j - i < 1 << 16 ? j - i : 1 << 16;
-          __uint128_t vals[1 << 16];
-          int m;
-          assert(vals_gen->gen(remove_vals_gen_state, nitems, vals) == nitems);
-
-          for (m = 0; m < nitems; m++) {
-             filter_ds.remove(vals[m]);
-          }
-       }
-       gettimeofday(&tv_remove[exp + 1][run], NULL);
+       assert(vals_gen->gen(remove_vals_gen_state, nround, keys) ==
+              (int)nround);
+       result = run_phase(&filter_ds, PHASE_REMOVE, keys, NULL, nround,
+                          nthreads, pin, phase_counters);
+       print_phase_counts(phase_counters, "remove", nround);
        fprintf(fp_remove, "%d", ((exp / 2) * (100 / npoints)));
-       fprintf(fp_remove, " %f\n",
-             1.0 * (nvals / npoints) /
-             (tv2usec(tv_remove[exp + 1][run]) -
-              tv2usec(tv_remove[exp][run])));
+       fprintf(fp_remove, " %f\n", 1.0 * nround / result.usecs);
+       if (fp_csv != NULL)
+         write_csv_row(fp_csv, &cfg, &filter_ds, run, exp / 2, "remove",
+                       nround, &result);
 
        fclose(fp_remove);
    }
 
+    if (fail_items != UINT64_MAX)
+      printf("Run %u: first insert failure at load factor %f\n", run,
+             1.0 * fail_items / nslots);
+    else
+      printf("Run %u: no insert failures\n", run);
+
     filter_ds.destroy();
   }
   printf("Insert Performance written to file: %s\n", filename_insert);
   printf("Exist lookup Performance written to file: %s\n", filename_exit_lookup);
   printf("False lookup Performance written to file: %s\n", filename_false_lookup);
   printf("Remove Performance written to file: %s\n", filename_remove);
+  printf("Memory use written to file: %s\n", filename_memory);
+  if (mixed)
+    printf("Mixed Performance written to file: %s\n", filename_mixed);
+  if (fp_csv != NULL) {
+    fclose(fp_csv);
+    printf("CSV rows written to file: %s\n", csvfile);
+  }
+  if (phase_counters != NULL)
+    perf_counters_close(phase_counters);
 
   printf("FP rate: %f (%lu/%lu)\n", 1.0 * fps / nvals, fps, nvals);
 
@@ -81,117 +81,116 @@ shuffle_matrix << "};\n";
 
 */
 
+// The tables are written as vector literals in memory order (element 0
+// first), so they are constant-initialized and linking them does not run any
+// AVX-512 code on machines without it.
+static void print_vector(std::ofstream& shuffle_matrix, const char *type,
+      const int *vals, int nvals) {
+   shuffle_matrix << "(__m512i)(" << type << "){";
+   for (int i = 0; i < nvals; i++) {
+      shuffle_matrix << std::to_string(vals[i]);
+      if (i < nvals - 1)
+         shuffle_matrix << ", ";
+   }
+   shuffle_matrix << "}";
+}
+
+static void print_table(std::ofstream& shuffle_matrix, const char *name,
+      const char *type, int vals[][64], int nvectors, int nvals) {
+   shuffle_matrix << "__m512i " << name << " [] = {\n";
+   for (int v = 0; v < nvectors; v++) {
+      print_vector(shuffle_matrix, type, vals[v], nvals);
+      shuffle_matrix << (v < nvectors - 1 ? ",\n" : "\n");
+   }
+   shuffle_matrix << "};\n";
+}
+
+// Insert shuffle: the new tag is written to the last element and moved to
+// index, the elements from index on move up by one. Remove shuffle: the
+// elements after index move down by one and the last element is kept.
+static void generate_shifts(int insert[][64], int remove[][64], int size) {
+   for (int index = 0; index < size; index++) {
+      for (int e = 0; e < size; e++) {
+         insert[index][e] = e < index ? e : (e == index ? size - 1 : e - 1);
+         remove[index][e] = e < index ? e : (e == size - 1 ? size - 1 : e + 1);
+      }
+   }
+}
+
 #define SHUFFLE_SIZE 64
 
 void generate_shuffle_512(void) {
    std::ofstream shuffle_matrix("src/shuffle_matrix_512.c");
+   int insert[SHUFFLE_SIZE][64], remove[SHUFFLE_SIZE][64];
 
    shuffle_matrix << "#include <immintrin.h>\n#include <tmmintrin.h>\n\n";
-   // generate right shuffle
-   for (uint64_t index = 0; index < SHUFFLE_SIZE; index++) {
-      shuffle_matrix << "const __m512i S" << std::to_string(index) << " = _mm512_set_epi8(\n";
-      for (uint8_t i = 0, j = SHUFFLE_SIZE - 2; i < SHUFFLE_SIZE; i++) {
-         if (i == SHUFFLE_SIZE - index - 1) {
-            shuffle_matrix << std::to_string(SHUFFLE_SIZE - 1);
-         } else {
-            shuffle_matrix << std::to_string(j--);
-         }
-         if (i < SHUFFLE_SIZE - 1)
-            shuffle_matrix << ", ";
-      }
-      shuffle_matrix << ");\n";
-   }
-   shuffle_matrix << '\n';
-   shuffle_matrix << "const __m512i SHUFFLE [] = {";
-   for (uint8_t i = 0; i < SHUFFLE_SIZE; i++) {
-      shuffle_matrix << "S" << std::to_string(i);
-      if (i < SHUFFLE_SIZE - 1)
-         shuffle_matrix << ", ";
-   }
-   shuffle_matrix << "};\n";
-
+   generate_shifts(insert, remove, SHUFFLE_SIZE);
+   print_table(shuffle_matrix, "SHUFFLE", "__v64qi", insert, SHUFFLE_SIZE,
+         SHUFFLE_SIZE);
    shuffle_matrix << "\n";
-   // generate left shift
-   for (uint64_t index = 0; index < SHUFFLE_SIZE; index++) {
-      shuffle_matrix << "const __m512i R" << std::to_string(index) << " = _mm512_set_epi8(\n";
-      shuffle_matrix << std::to_string(SHUFFLE_SIZE - 1) << ", "; // always overwrite the last item
-      for (uint8_t i = 0, j = SHUFFLE_SIZE - 1; i < SHUFFLE_SIZE - 1; i++) {
-         if (i == SHUFFLE_SIZE - index - 1) {
-            j--;
-            shuffle_matrix << std::to_string(j--);
-         } else {
-            shuffle_matrix << std::to_string(j--);
-         }
-         if (i < SHUFFLE_SIZE - 2)
-            shuffle_matrix << ", ";
-      }
-      shuffle_matrix << ");\n";
-   }
-   shuffle_matrix << '\n';
-   shuffle_matrix << "const __m512i SHUFFLE_REMOVE [] = {";
-   for (uint8_t i = 0; i < SHUFFLE_SIZE; i++) {
-      shuffle_matrix << "R" << std::to_string(i);
-      if (i < SHUFFLE_SIZE - 1)
-         shuffle_matrix << ", ";
-   }
-   shuffle_matrix << "};\n";
+   print_table(shuffle_matrix, "SHUFFLE_REMOVE", "__v64qi", remove,
+         SHUFFLE_SIZE, SHUFFLE_SIZE);
 }
 
+#undef SHUFFLE_SIZE
 #define SHUFFLE_SIZE 32
 void generate_shuffle_512_16(void) {
    std::ofstream shuffle_matrix("src/shuffle_matrix_512_16.c");
+   int insert[SHUFFLE_SIZE][64], remove[SHUFFLE_SIZE][64];
 
    shuffle_matrix << "#include <immintrin.h>\n#include <tmmintrin.h>\n\n";
-   // generate right shuffle
-   for (uint64_t index = 0; index < SHUFFLE_SIZE; index++) {
-      shuffle_matrix << "const __m512i S16_" << std::to_string(index) << " = _mm512_set_epi16(\n";
-      for (uint8_t i = 0, j = SHUFFLE_SIZE - 2; i < SHUFFLE_SIZE; i++) {
-         if (i == SHUFFLE_SIZE - index - 1) {
-            shuffle_matrix << std::to_string(SHUFFLE_SIZE - 1);
-         } else {
-            shuffle_matrix << std::to_string(j--);
-         }
-         if (i < SHUFFLE_SIZE - 1)
-            shuffle_matrix << ", ";
-      }
+   generate_shifts(insert, remove, SHUFFLE_SIZE);
+   print_table(shuffle_matrix, "SHUFFLE16", "__v32hi", insert, SHUFFLE_SIZE,
+         SHUFFLE_SIZE);
+   shuffle_matrix << "\n";
+   print_table(shuffle_matrix, "SHUFFLE_REMOVE16", "__v32hi", remove,
+         SHUFFLE_SIZE, SHUFFLE_SIZE);
+}
 
-      shuffle_matrix << ");\n";
-   }
-   shuffle_matrix << '\n';
-   shuffle_matrix << "__m512i SHUFFLE16 [] = {";
-   for (uint8_t i = 0; i < SHUFFLE_SIZE; i++) {
-      shuffle_matrix << "S16_" << std::to_string(i);
-      if (i < SHUFFLE_SIZE - 1)
-         shuffle_matrix << ", ";
-   }
-   shuffle_matrix << "};\n";
+// 12-bit tags are packed, 32 tags in the 48 bytes after the 128-bit
+// metadata. The kernels unpack them into 32 16-bit lanes, operate on the
+// lanes (the 16-bit SHUFFLE16/SHUFFLE_REMOVE16 permutes insert and remove a
+// lane) and pack them back. Unpacking gathers the 12 bytes of tags 8j..8j+7
+// into the j'th 128-bit lane (dword permute), spreads them into 16-bit lanes
+// (byte shuffle) and shifts the odd tags down by 4. Packing reverses it.
+void generate_shuffle_512_12(void) {
+   std::ofstream shuffle_matrix("src/shuffle_matrix_512_12.c");
+   int dwords[16], bytes[64], shifts[32];
 
-   shuffle_matrix << "\n";
-   // generate left shift
-   for (uint64_t index = 0; index < SHUFFLE_SIZE; index++) {
-      shuffle_matrix << "const __m512i R16_" << std::to_string(index) << " = _mm512_set_epi16(\n";
-      shuffle_matrix << std::to_string(SHUFFLE_SIZE - 1) << ", "; // always overwrite the last item
-      for (uint8_t i = 0, j = SHUFFLE_SIZE - 1; i < SHUFFLE_SIZE - 1; i++) {
-         if (i == SHUFFLE_SIZE - index - 1) {
-            j--;
-            shuffle_matrix << std::to_string(j--);
-         } else {
-            shuffle_matrix << std::to_string(j--);
-         }
-         if (i < SHUFFLE_SIZE - 2)
-            shuffle_matrix << ", ";
+   shuffle_matrix << "#include <immintrin.h>\n#include <tmmintrin.h>\n\n";
+
+   // unpack: the tags start at dword 4 of the block.
+   shuffle_matrix << "__m512i EXPAND12 [] = {\n";
+   for (int j = 0; j < 4; j++)
+      for (int r = 0; r < 4; r++)
+         dwords[4 * j + r] = 4 + 3 * j + (r < 3 ? r : 2);
+   print_vector(shuffle_matrix, "__v16si", dwords, 16);
+   shuffle_matrix << ",\n";
+   for (int j = 0; j < 4; j++)
+      for (int m = 0; m < 8; m++) {
+         bytes[16 * j + 2 * m] = (3 * m) / 2;
+         bytes[16 * j + 2 * m + 1] = (3 * m) / 2 + 1;
       }
+   print_vector(shuffle_matrix, "__v64qi", bytes, 64);
+   shuffle_matrix << ",\n";
+   for (int i = 0; i < 32; i++)
+      shifts[i] = (i % 2) * 4;
+   print_vector(shuffle_matrix, "__v32hi", shifts, 32);
+   shuffle_matrix << "\n};\n";
 
-      shuffle_matrix << ");\n";
-   }
-   shuffle_matrix << '\n';
-   shuffle_matrix << "__m512i SHUFFLE_REMOVE16 [] = {";
-   for (uint8_t i = 0; i < SHUFFLE_SIZE; i++) {
-      shuffle_matrix << "R16_" << std::to_string(i);
-      if (i < SHUFFLE_SIZE - 1)
-         shuffle_matrix << ", ";
-   }
-   shuffle_matrix << "};\n";
+   shuffle_matrix << "\n";
+   // pack: each dword holds two tags in its low 3 bytes once the odd tags
+   // are shifted into place.
+   shuffle_matrix << "__m512i COMPACT12 [] = {\n";
+   for (int j = 0; j < 4; j++)
+      for (int b = 0; b < 16; b++)
+         bytes[16 * j + b] = b < 12 ? (b / 3) * 4 + b % 3 : -128;
+   print_vector(shuffle_matrix, "__v64qi", bytes, 64);
+   shuffle_matrix << ",\n";
+   for (int d = 0; d < 16; d++)
+      dwords[d] = d < 4 ? d : ((d - 4) / 3) * 4 + (d - 4) % 3;
+   print_vector(shuffle_matrix, "__v16si", dwords, 16);
+   shuffle_matrix << "\n};\n";
 }
 
 /* 
@@ -203,6 +202,8 @@ void generate_shuffle_512_16(void) {
    int
 main ( int argc, char *argv[] )
 {
+   generate_shuffle_512();
    generate_shuffle_512_16();
+   generate_shuffle_512_12();
    return EXIT_SUCCESS;
 }				/* ----------  end of function main  ---------- */
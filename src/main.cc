@@ -13,15 +13,19 @@
 #include <fstream>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <immintrin.h>  // portable to all x86 compilers
 #include <tmmintrin.h>
 #include <openssl/rand.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include <set>
+#include <algorithm>
 
 #include "vqf_filter.h"
+#include "perf_counters.h"
 
 #ifdef __AVX512BW__
 extern __m512i SHUFFLE [];
@@ -46,13 +50,90 @@ void print_time_elapsed(const char* desc, struct timeval* start, struct
    printf("\n");
 }
 
+// Kernels named like vqf_variant_name.
+static bool parse_variant(const char *name, vqf_variant *variant)
+{
+   vqf_variant variants[] = {VQF_VARIANT_GENERIC, VQF_VARIANT_AVX2,
+      VQF_VARIANT_AVX2_NOPDEP, VQF_VARIANT_AVX512};
+   for (vqf_variant v : variants) {
+      if (strcmp(name, vqf_variant_name(v)) == 0) {
+         *variant = v;
+         return true;
+      }
+   }
+   return false;
+}
+
 int main(int argc, char **argv)
 {
    if (argc < 2) {
       fprintf(stderr, "Please specify the log of the number of slots in the CQF.\n");
+      fprintf(stderr, "Optionally add \"batch\" to also time the batched"
+            " operations, \"fastrange\" to use division-free addressing,"
+            " \"tag8\", \"tag12\" or \"tag16\" to pick the tag size and"
+            " \"generic\", \"avx2\", \"avx2-nopdep\" or \"avx512\" to force the"
+            " kernels, \"huge2m\", \"huge1g\" or \"thp\" to back the filter"
+            " with huge pages, \"save=<file>\" to save the filter and time"
+            " lookups on its read-only mapping, \"counting\" to compare a"
+            " counting filter with a plain one on zipfian inserts,"
+            " \"maplet\" to time a filter that maps the items to 4-bit"
+            " values, \"merge\" to time the union and intersection of two"
+            " filters against rebuilding them and \"cursor\" to time a scan of"
+            " the tags of a filter. Add \"perf\" to count cycles, instructions,"
+            " LLC, dTLB and branch misses per operation of the insert,"
+            " lookup and remove phases and \"stats\" to time vqf_get_stats on the"
+            " full filter.\n");
       exit(1);
    }
    uint64_t qbits = atoi(argv[1]);
+   bool batch_mode = false;
+   bool counting_mode = false;
+   bool maplet_mode = false;
+   bool merge_mode = false;
+   bool cursor_mode = false;
+   bool perf_mode = false;
+   bool stats_mode = false;
+   vqf_addressing addressing = VQF_ADDRESSING_MODULO;
+   uint64_t tag_bits = 8;
+   vqf_variant variant;
+   const char *save_path = NULL;
+   for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "batch") == 0) {
+         batch_mode = true;
+      } else if (strcmp(argv[i], "counting") == 0) {
+         counting_mode = true;
+      } else if (strcmp(argv[i], "maplet") == 0) {
+         maplet_mode = true;
+      } else if (strcmp(argv[i], "merge") == 0) {
+         merge_mode = true;
+      } else if (strcmp(argv[i], "cursor") == 0) {
+         cursor_mode = true;
+      } else if (strcmp(argv[i], "perf") == 0) {
+         perf_mode = true;
+      } else if (strcmp(argv[i], "stats") == 0) {
+         stats_mode = true;
+      } else if (strcmp(argv[i], "fastrange") == 0) {
+         addressing = VQF_ADDRESSING_FASTRANGE;
+      } else if (strncmp(argv[i], "tag", 3) == 0) {
+         tag_bits = atoi(argv[i] + 3);
+      } else if (strncmp(argv[i], "save=", 5) == 0) {
+         save_path = argv[i] + 5;
+      } else if (strcmp(argv[i], "huge2m") == 0) {
+         vqf_set_pages(VQF_PAGES_HUGE_2M);
+      } else if (strcmp(argv[i], "huge1g") == 0) {
+         vqf_set_pages(VQF_PAGES_HUGE_1G);
+      } else if (strcmp(argv[i], "thp") == 0) {
+         vqf_set_pages(VQF_PAGES_TRANSPARENT);
+      } else if (parse_variant(argv[i], &variant)) {
+         if (!vqf_set_variant(variant)) {
+            fprintf(stderr, "This CPU does not support %s.\n", argv[i]);
+            exit(1);
+         }
+      } else {
+         fprintf(stderr, "Unknown mode: %s\n", argv[i]);
+         exit(1);
+      }
+   }
    uint64_t nslots = (1ULL << qbits);
    uint64_t nvals = 85*nslots/100;
    uint64_t *vals;
@@ -61,10 +142,14 @@ int main(int argc, char **argv)
    vqf_filter *filter;	
 
    /* initialize vqf filter */
-   if ((filter = vqf_init(nslots)) == NULL) {
+   if ((filter = vqf_init(nslots, tag_bits, addressing)) == NULL) {
       fprintf(stderr, "Can't allocate vqf filter.");
       exit(EXIT_FAILURE);
    }
+   printf("Kernels: %s\n", vqf_variant_name(vqf_get_variant(filter)));
+   const char *pages[] = {"default", "2 MB hugetlb", "1 GB hugetlb",
+      "transparent huge", "allocator", "mapped"};
+   printf("Pages: %s\n", pages[filter->pages]);
 
    /* Generate random values */
    vals = (uint64_t*)malloc(nvals*sizeof(vals[0]));
@@ -83,7 +168,13 @@ int main(int argc, char **argv)
    struct timeval start, end;
    struct timezone tzp;
 
+   perf_counters counters;
+   if (perf_mode && perf_counters_open(&counters) == 0)
+      printf("No hardware counters available, perf_event_open failed.\n");
+
    gettimeofday(&start, &tzp);
+   if (perf_mode)
+      perf_counters_start(&counters);
    /* Insert hashes in the vqf filter */
    for (uint64_t i = 0; i < nvals; i++) {
       if (!vqf_insert(filter, vals[i])) {
@@ -91,18 +182,54 @@ int main(int argc, char **argv)
          exit(EXIT_FAILURE);
       }
    }
+   if (perf_mode)
+      perf_counters_stop(&counters);
    gettimeofday(&end, &tzp);
    print_time_elapsed("Insertion time", &start, &end, nvals, "insert");
+   if (perf_mode)
+      perf_counters_print(&counters, nvals);
+   printf("Items: %ld (load factor %f)\n", vqf_size(filter),
+         vqf_load_factor(filter));
+   if (stats_mode) {
+      long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      vqf_stats stats;
+      gettimeofday(&start, &tzp);
+      vqf_get_stats(filter, ncpus > 0 ? ncpus : 1, &stats);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Stats time", &start, &end, 0, NULL);
+      if (stats.nelts != vqf_size(filter)) {
+         fprintf(stderr, "Stats found %ld tags in a filter of %ld items.\n",
+               stats.nelts, vqf_size(filter));
+         exit(EXIT_FAILURE);
+      }
+      printf("Blocks: %ld, full: %ld (%f), longest run: %ld tags\n",
+            stats.nblocks, stats.nfull_blocks, 1.0 * stats.nfull_blocks /
+            stats.nblocks, stats.longest_run);
+      printf("Blocks by tags:");
+      for (uint64_t i = 0; i <= stats.block_slots; i++) {
+         if (stats.fill[i] != 0)
+            printf(" %ld:%ld", i, stats.fill[i]);
+      }
+      printf("\n");
+   }
    gettimeofday(&start, &tzp);
+   if (perf_mode)
+      perf_counters_start(&counters);
    for (uint64_t i = 0; i < nvals; i++) {
       if (!vqf_is_present(filter, vals[i])) {
          fprintf(stderr, "Lookup failed for %ld index: %ld\n", vals[i], i);
          exit(EXIT_FAILURE);
       }
    }
+   if (perf_mode)
+      perf_counters_stop(&counters);
    gettimeofday(&end, &tzp);
    print_time_elapsed("Lookup time", &start, &end, nvals, "successful lookup");
+   if (perf_mode)
+      perf_counters_print(&counters, nvals);
    gettimeofday(&start, &tzp);
+   if (perf_mode)
+      perf_counters_start(&counters);
    uint64_t nfps = 0;
    /* Lookup hashes in the vqf filter */
    for (uint64_t i = 0; i < nvals; i++) {
@@ -110,22 +237,419 @@ int main(int argc, char **argv)
          nfps++;
       }
    }
+   if (perf_mode)
+      perf_counters_stop(&counters);
    gettimeofday(&end, &tzp);
    print_time_elapsed("Random lookup:", &start, &end, nvals, "random lookup");
+   if (perf_mode)
+      perf_counters_print(&counters, nvals);
    printf("%lu/%lu positives\n"
          "FP rate: 1/%f\n",
          nfps, nvals,
          1.0 * nvals / nfps);
 
+   if (batch_mode) {
+      bool *results = (bool*)malloc(nvals*sizeof(results[0]));
+
+      gettimeofday(&start, &tzp);
+      if (vqf_is_present_batch(filter, vals, nvals, results) != nvals) {
+         for (uint64_t i = 0; i < nvals; i++) {
+            if (!results[i]) {
+               fprintf(stderr, "Batch lookup failed for %ld index: %ld\n", vals[i], i);
+               exit(EXIT_FAILURE);
+            }
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Batch lookup time", &start, &end, nvals, "successful lookup");
+
+      gettimeofday(&start, &tzp);
+      uint64_t batch_nfps = vqf_is_present_batch(filter, other_vals, nvals, results);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Batch random lookup:", &start, &end, nvals, "random lookup");
+      if (batch_nfps != nfps) {
+         fprintf(stderr, "Batch lookup found %lu positives, scalar found %lu\n",
+               batch_nfps, nfps);
+         exit(EXIT_FAILURE);
+      }
+      free(results);
+   }
+
+   if (save_path != NULL) {
+      gettimeofday(&start, &tzp);
+      if (!vqf_save(filter, save_path))
+         exit(EXIT_FAILURE);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Save time", &start, &end, 0, NULL);
+
+      gettimeofday(&start, &tzp);
+      vqf_filter *mapped = vqf_open_mmap(save_path, false);
+      gettimeofday(&end, &tzp);
+      if (mapped == NULL)
+         exit(EXIT_FAILURE);
+      print_time_elapsed("Open time", &start, &end, 0, NULL);
+
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nvals; i++) {
+         if (!vqf_is_present(mapped, vals[i])) {
+            fprintf(stderr, "Mapped lookup failed for %ld index: %ld\n", vals[i], i);
+            exit(EXIT_FAILURE);
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Mapped lookup time", &start, &end, nvals, "successful lookup");
+      uint64_t mapped_nfps = 0;
+      for (uint64_t i = 0; i < nvals; i++)
+         mapped_nfps += vqf_is_present(mapped, other_vals[i]);
+      if (mapped_nfps != nfps || vqf_insert(mapped, other_vals[0])) {
+         fprintf(stderr, "Mapped filter differs from the saved one.\n");
+         exit(EXIT_FAILURE);
+      }
+      vqf_free(mapped);
+   }
+
    gettimeofday(&start, &tzp);
+   if (perf_mode)
+      perf_counters_start(&counters);
    for (uint64_t i = 0; i < nvals; i++) {
       if (!vqf_remove(filter, vals[i])) {
          fprintf(stderr, "Remove failed for %ld and index %ld\n", vals[i], i);
          exit(EXIT_FAILURE);
       }
    }
+   if (perf_mode)
+      perf_counters_stop(&counters);
    gettimeofday(&end, &tzp);
    print_time_elapsed("Remove time", &start, &end, nvals, "remove");
+   if (perf_mode)
+      perf_counters_print(&counters, nvals);
+   if (vqf_size(filter) != 0) {
+      fprintf(stderr, "%ld items left after removing all.\n", vqf_size(filter));
+      exit(EXIT_FAILURE);
+   }
+
+   if (batch_mode) {
+      bool *results = (bool*)malloc(nvals*sizeof(results[0]));
+      vqf_filter *batch_filter;
+
+      if ((batch_filter = vqf_init(nslots, tag_bits, addressing)) == NULL) {
+         fprintf(stderr, "Can't allocate vqf filter.");
+         exit(EXIT_FAILURE);
+      }
+
+      gettimeofday(&start, &tzp);
+      if (vqf_insert_batch(batch_filter, vals, nvals, results) != 0) {
+         fprintf(stderr, "Batch insertion failed.\n");
+         exit(EXIT_FAILURE);
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Batch insertion time", &start, &end, nvals, "insert");
+      if (vqf_size(batch_filter) != nvals) {
+         fprintf(stderr, "Batch insertion counted %ld items.\n",
+               vqf_size(batch_filter));
+         exit(EXIT_FAILURE);
+      }
+
+      for (uint64_t i = 0; i < nvals; i++) {
+         if (!vqf_is_present(batch_filter, vals[i])) {
+            fprintf(stderr, "Lookup failed for %ld index: %ld\n", vals[i], i);
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      gettimeofday(&start, &tzp);
+      if (vqf_remove_batch(batch_filter, vals, nvals, results) != 0) {
+         fprintf(stderr, "Batch remove failed.\n");
+         exit(EXIT_FAILURE);
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Batch remove time", &start, &end, nvals, "remove");
+      free(results);
+      vqf_free(batch_filter);
+   }
+
+   if (counting_mode) {
+      // Zipfian (s = 1) stream of 2 * nslots inserts over nvals / 8 keys, so
+      // that the keys fit and the inserts do not.
+      uint64_t nkeys = nvals / 8;
+      uint64_t nstream = 2 * nslots;
+      double *cdf = (double*)malloc(nkeys*sizeof(cdf[0]));
+      double sum = 0;
+      for (uint64_t i = 0; i < nkeys; i++)
+         cdf[i] = sum += 1.0 / (i + 1);
+      uint64_t *stream = (uint64_t*)malloc(nstream*sizeof(stream[0]));
+      uint64_t *counts = (uint64_t*)calloc(nkeys, sizeof(counts[0]));
+      srand48(qbits);
+      for (uint64_t i = 0; i < nstream; i++) {
+         uint64_t rank = std::lower_bound(cdf, cdf + nkeys, drand48() * sum) - cdf;
+         rank = std::min(rank, nkeys - 1);
+         stream[i] = vals[rank];
+         counts[rank]++;
+      }
+
+      vqf_filter *counting_filter, *plain_filter;
+      if ((counting_filter = vqf_init_counting(nslots, tag_bits, addressing)) == NULL ||
+            (plain_filter = vqf_init(nslots, tag_bits, addressing)) == NULL) {
+         fprintf(stderr, "Can't allocate vqf filter.");
+         exit(EXIT_FAILURE);
+      }
+
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nstream; i++) {
+         if (!vqf_insert(counting_filter, stream[i])) {
+            fprintf(stderr, "Counting insertion failed at %ld of %ld.\n", i, nstream);
+            exit(EXIT_FAILURE);
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Counting insertion time", &start, &end, nstream, "insert");
+      // the size of a counting filter is the slots it uses
+      vqf_stats stats;
+      vqf_get_stats(counting_filter, 1, &stats);
+      printf("Slots used: %ld (load factor %f)\n", vqf_size(counting_filter),
+            vqf_load_factor(counting_filter));
+      if (stats.nelts != vqf_size(counting_filter)) {
+         fprintf(stderr, "The blocks hold %ld tags\n", stats.nelts);
+         exit(EXIT_FAILURE);
+      }
+
+      uint64_t nplain = 0;
+      while (nplain < nstream && vqf_insert(plain_filter, stream[nplain]))
+         nplain++;
+      printf("\nPlain filter full after %ld of %ld inserts\n", nplain, nstream);
+
+      uint64_t overcounted = 0;
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nkeys; i++) {
+         uint64_t count = vqf_count(counting_filter, vals[i]);
+         if (count < counts[i]) {
+            fprintf(stderr, "Count %ld for %ld inserts of %ld\n", count,
+                  counts[i], vals[i]);
+            exit(EXIT_FAILURE);
+         }
+         overcounted += count > counts[i];
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Count time", &start, &end, nkeys, "count");
+      printf("Overcounted keys: %ld of %ld\n", overcounted, nkeys);
+
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nstream; i++) {
+         if (!vqf_remove(counting_filter, stream[i])) {
+            fprintf(stderr, "Counting remove failed for %ld\n", stream[i]);
+            exit(EXIT_FAILURE);
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Counting remove time", &start, &end, nstream, "remove");
+      if (vqf_size(counting_filter) != 0) {
+         fprintf(stderr, "%ld slots used after removing all\n",
+               vqf_size(counting_filter));
+         exit(EXIT_FAILURE);
+      }
+      for (uint64_t i = 0; i < nkeys; i++) {
+         if (vqf_is_present(counting_filter, vals[i])) {
+            fprintf(stderr, "%ld is present after removing all\n", vals[i]);
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      free(cdf);
+      free(stream);
+      free(counts);
+      vqf_free(counting_filter);
+      vqf_free(plain_filter);
+   }
+
+   if (maplet_mode) {
+      // Map every item to a 4-bit shard taken from its top bits.
+      const uint64_t value_bits = 4;
+      vqf_filter *maplet;
+      if ((maplet = vqf_init_maplet(nslots, tag_bits, value_bits, addressing)) == NULL) {
+         fprintf(stderr, "Can't allocate vqf filter.");
+         exit(EXIT_FAILURE);
+      }
+
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nvals; i++) {
+         if (!vqf_insert_kv(maplet, vals[i], vals[i] >> (64 - value_bits))) {
+            fprintf(stderr, "Maplet insertion failed. LF: %f\n", i/(nslots*1.0));
+            exit(EXIT_FAILURE);
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Maplet insertion time", &start, &end, nvals, "insert");
+
+      uint64_t nwrong = 0;
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nvals; i++) {
+         uint64_t value;
+         if (!vqf_get(maplet, vals[i], &value)) {
+            fprintf(stderr, "Get failed for %ld index: %ld\n", vals[i], i);
+            exit(EXIT_FAILURE);
+         }
+         nwrong += value != vals[i] >> (64 - value_bits);
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Get time", &start, &end, nvals, "successful get");
+      // A colliding item inserted earlier in the same run answers instead.
+      printf("Wrong values: %ld of %ld\n", nwrong, nvals);
+
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nvals; i++) {
+         if (!vqf_remove(maplet, vals[i])) {
+            fprintf(stderr, "Maplet remove failed for %ld index: %ld\n", vals[i], i);
+            exit(EXIT_FAILURE);
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Maplet remove time", &start, &end, nvals, "remove");
+      if (vqf_size(maplet) != 0) {
+         fprintf(stderr, "%ld items left after removing all.\n", vqf_size(maplet));
+         exit(EXIT_FAILURE);
+      }
+      vqf_free(maplet);
+   }
+
+   if (merge_mode) {
+      // a holds the first 3/8 of the items and b the 3/8 from 1/4 on, so the
+      // union holds 5/8 and the intersection 1/8 of them, and the merged
+      // filter as many tags as 3/4 of them.
+      const uint64_t nthreads = 4;
+      uint64_t nitems = 3 * nvals / 8, b_begin = nvals / 4;
+      uint64_t nunion = b_begin + nitems;
+      vqf_filter *a, *b, *merged, *rebuilt;
+      vqf_merge_report report;
+      if ((a = vqf_init(nslots, tag_bits, addressing)) == NULL ||
+            (b = vqf_init(nslots, tag_bits, addressing)) == NULL ||
+            (merged = vqf_init(nslots, tag_bits, addressing)) == NULL ||
+            (rebuilt = vqf_init(nslots, tag_bits, addressing)) == NULL) {
+         fprintf(stderr, "Can't allocate vqf filter.");
+         exit(EXIT_FAILURE);
+      }
+      for (uint64_t i = 0; i < nitems; i++) {
+         if (!vqf_insert(a, vals[i]) || !vqf_insert(b, vals[b_begin + i])) {
+            fprintf(stderr, "Insertion failed at %ld.\n", i);
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      gettimeofday(&start, &tzp);
+      for (uint64_t i = 0; i < nunion; i++) {
+         if (!vqf_insert(rebuilt, vals[i])) {
+            fprintf(stderr, "Insertion failed at %ld.\n", i);
+            exit(EXIT_FAILURE);
+         }
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Rebuild time", &start, &end, nunion, "insert");
+
+      gettimeofday(&start, &tzp);
+      if (!vqf_union(merged, a, b, 1, &report))
+         exit(EXIT_FAILURE);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Union time", &start, &end, report.nentries, "tag");
+      gettimeofday(&start, &tzp);
+      if (!vqf_union(merged, a, b, nthreads, &report))
+         exit(EXIT_FAILURE);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Parallel union time", &start, &end, report.nentries, "tag");
+      printf("Union: %ld tags, %ld placed after overflowing their block, %ld dropped\n",
+            report.nentries, report.nmoved, report.ndropped);
+      for (uint64_t i = 0; report.ndropped == 0 && i < nunion; i++) {
+         if (!vqf_is_present(merged, vals[i])) {
+            fprintf(stderr, "Union lookup failed for %ld index: %ld\n", vals[i], i);
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      gettimeofday(&start, &tzp);
+      if (!vqf_intersect(merged, a, b, nthreads, &report))
+         exit(EXIT_FAILURE);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Parallel intersection time", &start, &end, nitems, "tag");
+      for (uint64_t i = b_begin; i < nitems; i++) {
+         if (!vqf_is_present(merged, vals[i])) {
+            fprintf(stderr, "Intersection lookup failed for %ld index: %ld\n", vals[i], i);
+            exit(EXIT_FAILURE);
+         }
+      }
+      uint64_t nextra = 0;
+      for (uint64_t i = 0; i < b_begin; i++)
+         nextra += vqf_is_present(merged, vals[i]);
+      printf("Intersection: %ld tags for %ld common items, %ld of %ld others present\n",
+            report.nentries, nitems - b_begin, nextra, b_begin);
+
+      vqf_free(a);
+      vqf_free(b);
+      vqf_free(merged);
+      vqf_free(rebuilt);
+   }
+
+   if (cursor_mode) {
+      // Scan all the tags, then the same blocks as four ranges, the way
+      // threads would split them, and check that both see the same tags.
+      const uint64_t nranges = 4, nbuffer = 4096;
+      vqf_filter *scanned;
+      if ((scanned = vqf_init(nslots, tag_bits, addressing)) == NULL) {
+         fprintf(stderr, "Can't allocate vqf filter.");
+         exit(EXIT_FAILURE);
+      }
+      for (uint64_t i = 0; i < nvals; i++) {
+         if (!vqf_insert(scanned, vals[i])) {
+            fprintf(stderr, "Insertion failed at %ld.\n", i);
+            exit(EXIT_FAILURE);
+         }
+      }
+      vqf_entry *entries = (vqf_entry*)malloc(nbuffer*sizeof(entries[0]));
+      uint64_t nblocks = scanned->metadata.nblocks;
+      vqf_cursor cursor;
+
+      uint64_t ntags = 0, checksum = 0, last_bucket = 0;
+      gettimeofday(&start, &tzp);
+      vqf_cursor_init(&cursor, scanned, 0, nblocks);
+      uint64_t n;
+      while ((n = vqf_cursor_read(&cursor, entries, nbuffer)) != 0) {
+         for (uint64_t i = 0; i < n; i++) {
+            if (entries[i].bucket < last_bucket) {
+               fprintf(stderr, "Bucket %ld after %ld.\n", entries[i].bucket, last_bucket);
+               exit(EXIT_FAILURE);
+            }
+            last_bucket = entries[i].bucket;
+            checksum += entries[i].bucket * 65537 ^ entries[i].tag;
+         }
+         ntags += n;
+      }
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Cursor scan time", &start, &end, ntags, "tag");
+      if (ntags != vqf_size(scanned)) {
+         fprintf(stderr, "Scanned %ld tags of %ld.\n", ntags, vqf_size(scanned));
+         exit(EXIT_FAILURE);
+      }
+
+      uint64_t range_tags = 0, range_checksum = 0;
+      for (uint64_t r = 0; r < nranges; r++) {
+         vqf_entry entry;
+         vqf_cursor_init(&cursor, scanned, nblocks * r / nranges,
+               nblocks * (r + 1) / nranges);
+         while (vqf_cursor_next(&cursor, &entry)) {
+            range_checksum += entry.bucket * 65537 ^ entry.tag;
+            range_tags++;
+         }
+      }
+      if (range_tags != ntags || range_checksum != checksum) {
+         fprintf(stderr, "Range scans saw %ld tags, the full scan %ld.\n",
+               range_tags, ntags);
+         exit(EXIT_FAILURE);
+      }
+      printf("Scanned %ld tags from %ld blocks\n", ntags, nblocks);
+
+      free(entries);
+      vqf_free(scanned);
+   }
 
+   if (perf_mode)
+      perf_counters_close(&counters);
+   vqf_free(filter);
    return 0;
 }
@@ -0,0 +1,211 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  main_fpr.cc
+ *
+ *    Description:  False-positive rate as a function of the load factor.
+ *                  The filter is filled in small steps and at each step the
+ *                  empirical rate of a pool of negative queries is printed
+ *                  next to the rate the tag size predicts.
+ *
+ * ============================================================================
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vqf_filter.h"
+
+#define FPR_CHUNK 4096
+
+static inline uint64_t mix64(uint64_t z) {
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+// The i'th key of a stream, computed from its index like splitmix64 does, so
+// that neither the keys nor the queries are kept in memory.
+static inline uint64_t stream_key(uint64_t seed, uint64_t i) {
+   return mix64(seed + (i + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+typedef struct fpr_task {
+   vqf_filter *filter;
+   uint64_t seed;
+   uint64_t begin;
+   uint64_t end;
+   uint64_t count;
+} fpr_task;
+
+// Counts the positive answers to the keys of the task.
+static void *count_positives(void *arg) {
+   fpr_task *task = (fpr_task *)arg;
+   uint64_t hashes[FPR_CHUNK];
+   bool results[FPR_CHUNK];
+   task->count = 0;
+   for (uint64_t i = task->begin; i < task->end; i += FPR_CHUNK) {
+      uint64_t n = task->end - i < FPR_CHUNK ? task->end - i : FPR_CHUNK;
+      for (uint64_t j = 0; j < n; j++)
+         hashes[j] = stream_key(task->seed, i + j);
+      task->count += vqf_is_present_batch(task->filter, hashes, n, results);
+   }
+   return NULL;
+}
+
+// Counts the keys of the task whose tag is in their alternate block.
+static void *count_alternates(void *arg) {
+   fpr_task *task = (fpr_task *)arg;
+   task->count = 0;
+   for (uint64_t i = task->begin; i < task->end; i++) {
+      task->count += vqf_get_placement(task->filter, stream_key(task->seed,
+               i)) == VQF_PLACEMENT_ALTERNATE;
+   }
+   return NULL;
+}
+
+// Splits the keys [begin, end) of a stream among nthreads threads running
+// work, the calling thread included, and returns the sum of their counts.
+// Lookups only read the filter, so this needs no thread-safe build.
+static uint64_t run_parallel(void *(*work)(void *), vqf_filter *filter,
+      uint64_t seed, uint64_t begin, uint64_t end, uint64_t nthreads) {
+   fpr_task *tasks = (fpr_task *)calloc(nthreads, sizeof(tasks[0]));
+   pthread_t *threads = (pthread_t *)calloc(nthreads, sizeof(threads[0]));
+   if (tasks == NULL || threads == NULL) {
+      fprintf(stderr, "Can't allocate the threads.\n");
+      exit(EXIT_FAILURE);
+   }
+   for (uint64_t t = 0; t < nthreads; t++) {
+      tasks[t].filter = filter;
+      tasks[t].seed = seed;
+      tasks[t].begin = begin + (end - begin) * t / nthreads;
+      tasks[t].end = begin + (end - begin) * (t + 1) / nthreads;
+   }
+   for (uint64_t t = 1; t < nthreads; t++) {
+      if (pthread_create(&threads[t], NULL, work, &tasks[t]) != 0) {
+         fprintf(stderr, "Can't start a thread.\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   work(&tasks[0]);
+   uint64_t count = tasks[0].count;
+   for (uint64_t t = 1; t < nthreads; t++) {
+      pthread_join(threads[t], NULL);
+      count += tasks[t].count;
+   }
+   free(tasks);
+   free(threads);
+   return count;
+}
+
+// A negative query compares its tag with the tags of its primary and
+// alternate runs, 2 * items / buckets of them on average. Tags are uniform
+// but for 0, which is stored as 1, so two tags match with probability
+// (2^r + 2) / 4^r.
+static double theoretical_fpr(uint64_t tag_bits, uint64_t nitems, uint64_t
+      range) {
+   double tags = ldexp(1.0, tag_bits);
+   double match = (tags + 2) / (tags * tags);
+   return 1 - pow(1 - match, 2.0 * nitems / range);
+}
+
+int main(int argc, char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "Please specify the log of the number of slots in the CQF.\n");
+      fprintf(stderr, "Optionally add \"tag8\", \"tag12\" or \"tag16\" to pick"
+            " the tag sizes (default all), \"fastrange\" to use division-free"
+            " addressing, \"step=<percent>\" to set the load step (default 1),"
+            " \"queries=<n>\" to set the negative queries per step (default"
+            " 2^24) and \"threads=<n>\" to set the threads that run them"
+            " (default one per CPU).\n");
+      exit(1);
+   }
+   uint64_t qbits = atoi(argv[1]);
+   uint64_t nslots = (1ULL << qbits);
+   uint64_t tag_sizes[3];
+   uint64_t ntag_sizes = 0;
+   vqf_addressing addressing = VQF_ADDRESSING_MODULO;
+   double step = 1;
+   uint64_t nqueries = 1ULL << 24;
+   long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+   uint64_t nthreads = ncpus > 0 ? ncpus : 1;
+   for (int i = 2; i < argc; i++) {
+      if (strncmp(argv[i], "tag", 3) == 0 && ntag_sizes < 3) {
+         tag_sizes[ntag_sizes++] = atoi(argv[i] + 3);
+      } else if (strcmp(argv[i], "fastrange") == 0) {
+         addressing = VQF_ADDRESSING_FASTRANGE;
+      } else if (strncmp(argv[i], "step=", 5) == 0) {
+         step = atof(argv[i] + 5);
+      } else if (strncmp(argv[i], "queries=", 8) == 0) {
+         nqueries = strtoull(argv[i] + 8, NULL, 10);
+      } else if (strncmp(argv[i], "threads=", 8) == 0) {
+         nthreads = strtoull(argv[i] + 8, NULL, 10);
+      } else {
+         fprintf(stderr, "Unknown mode: %s\n", argv[i]);
+         exit(1);
+      }
+   }
+   if (step <= 0 || step > 100 || nqueries == 0 || nthreads == 0) {
+      fprintf(stderr, "The step must be in (0, 100] and the queries and"
+            " threads positive.\n");
+      exit(1);
+   }
+   if (ntag_sizes == 0) {
+      tag_sizes[ntag_sizes++] = 8;
+      tag_sizes[ntag_sizes++] = 12;
+      tag_sizes[ntag_sizes++] = 16;
+   }
+
+   // The same keys and queries for every tag size.
+   const uint64_t key_seed = 1, query_seed = 2;
+   for (uint64_t t = 0; t < ntag_sizes; t++) {
+      uint64_t tag_bits = tag_sizes[t];
+      vqf_filter *filter;
+      if ((filter = vqf_init(nslots, tag_bits, addressing)) == NULL) {
+         fprintf(stderr, "Can't allocate vqf filter.\n");
+         exit(EXIT_FAILURE);
+      }
+      uint64_t range = filter->metadata.range;
+      printf("%ld-bit tags, %ld slots, %ld buckets, %ld negative queries per"
+            " step\n", tag_bits, filter->metadata.nslots, range, nqueries);
+      printf("%8s %12s %12s %12s %12s %8s %10s %10s\n", "load", "items",
+            "fpr", "stderr", "theory", "ratio", "alternate", "bits/item");
+
+      // Tags never move between blocks, so the keys of a step are placed
+      // once and for all.
+      uint64_t nitems = 0, nalternate = 0;
+      for (uint64_t k = 1; k * step <= 100; k++) {
+         uint64_t target = k * step / 100 * filter->metadata.nslots;
+         uint64_t begin = nitems;
+         while (nitems < target && vqf_insert(filter, stream_key(key_seed,
+                     nitems)))
+            nitems++;
+         nalternate += run_parallel(count_alternates, filter, key_seed, begin,
+               nitems, nthreads);
+
+         uint64_t npositives = run_parallel(count_positives, filter,
+               query_seed, 0, nqueries, nthreads);
+         double fpr = 1.0 * npositives / nqueries;
+         double theory = theoretical_fpr(tag_bits, nitems, range);
+         printf("%8.4f %12ld %12.4e %12.4e %12.4e %8.3f %10.4f %10.2f\n",
+               vqf_load_factor(filter), nitems, fpr, sqrt(fpr * (1 - fpr) /
+                  nqueries), theory, theory > 0 ? fpr / theory : 0,
+               nitems != 0 ? 1.0 * nalternate / nitems : 0, nitems != 0 ? 8.0
+               * filter->metadata.total_size_in_bytes / nitems : 0);
+         if (nitems < target) {
+            printf("First insert failure at load %f\n",
+                  vqf_load_factor(filter));
+            break;
+         }
+      }
+      printf("\n");
+      vqf_free(filter);
+   }
+   return 0;
+}
@@ -44,9 +44,11 @@ int main(int argc, char **argv)
 {
    if (argc < 2) {
       fprintf(stderr, "Please specify the log of the number of slots in the CQF.\n");
+      fprintf(stderr, "Optionally specify the tag size: 8, 12 or 16 (default 8).\n");
       exit(1);
    }
    uint64_t qbits = atoi(argv[1]);
+   uint64_t tag_bits = argc > 2 ? atoi(argv[2]) : 8;
    uint64_t nslots = (1ULL << qbits);
    uint64_t nvals = 85*nslots/100;
    uint64_t *vals;
@@ -55,7 +57,7 @@ int main(int argc, char **argv)
    vqf_filter *filter;	
 
    /* initialize vqf filter */
-   if ((filter = vqf_init(nslots)) == NULL) {
+   if ((filter = vqf_init(nslots, tag_bits, VQF_ADDRESSING_MODULO)) == NULL) {
       fprintf(stderr, "Can't allocate vqf filter.");
       exit(EXIT_FAILURE);
    }
@@ -88,7 +90,7 @@ int main(int argc, char **argv)
 
    std::cout << "Starting workload\n";
    srand(time(NULL));
-   uint64_t ret;
+   uint64_t ret = 0;
    uint8_t *oprs = (uint8_t *)malloc(ITR*sizeof(uint8_t));
    uint64_t *opr_vals = (uint64_t *)malloc(ITR*sizeof(uint64_t));
 
@@ -119,5 +121,6 @@ int main(int argc, char **argv)
    std::cout << "ret: " << ret << '\n';
    print_time_elapsed("Workload time", &start, &end, ITR, "operations");
 
+   vqf_free(filter);
    return 0;
 }
@@ -0,0 +1,97 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  main_kernels.cc
+ *
+ *    Description:  Times the block kernels on their own, on blocks that stay
+ *                  in L1, for every instruction set the CPU supports.
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vqf_filter.h"
+#include "vqf_kernel_bench.h"
+
+static bool bench_variant(vqf_variant variant, uint64_t tag_bits, uint64_t
+      rounds)
+{
+   switch (variant) {
+      case VQF_VARIANT_AVX512:
+         return vqf_avx512::bench_kernels(tag_bits, rounds);
+      case VQF_VARIANT_AVX2:
+         return vqf_avx2::bench_kernels(tag_bits, rounds);
+      case VQF_VARIANT_AVX2_NOPDEP:
+         return vqf_avx2_nopdep::bench_kernels(tag_bits, rounds);
+      default:
+         return vqf_generic::bench_kernels(tag_bits, rounds);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   vqf_variant variants[] = {VQF_VARIANT_AVX512, VQF_VARIANT_AVX2,
+      VQF_VARIANT_AVX2_NOPDEP, VQF_VARIANT_GENERIC};
+   const uint64_t nvariants = sizeof(variants) / sizeof(variants[0]);
+   bool variant_picked[nvariants] = {false};
+   bool any_variant = false;
+   uint64_t tag_sizes[3];
+   uint64_t ntag_sizes = 0;
+   uint64_t rounds = 200;
+   for (int i = 1; i < argc; i++) {
+      bool found = false;
+      for (uint64_t v = 0; v < nvariants; v++) {
+         if (strcmp(argv[i], vqf_variant_name(variants[v])) == 0) {
+            variant_picked[v] = found = any_variant = true;
+         }
+      }
+      if (found)
+         continue;
+      if (strncmp(argv[i], "tag", 3) == 0 && ntag_sizes < 3) {
+         tag_sizes[ntag_sizes++] = atoi(argv[i] + 3);
+      } else if (strncmp(argv[i], "rounds=", 7) == 0) {
+         rounds = strtoull(argv[i] + 7, NULL, 10);
+      } else {
+         fprintf(stderr, "Unknown mode: %s\n", argv[i]);
+         fprintf(stderr, "Optionally add \"tag8\", \"tag12\" or \"tag16\" to"
+               " pick the tag sizes (default 8 and 16), \"generic\", \"avx2\","
+               " \"avx2-nopdep\" or \"avx512\" to pick the kernels (default all"
+               " the CPU supports) and \"rounds=<n>\" to set the rounds each"
+               " call is timed in (default 200).\n");
+         exit(1);
+      }
+   }
+   if (ntag_sizes == 0) {
+      tag_sizes[ntag_sizes++] = 8;
+      tag_sizes[ntag_sizes++] = 16;
+   }
+   if (rounds == 0) {
+      fprintf(stderr, "The number of rounds must be positive.\n");
+      exit(1);
+   }
+
+   // Ticks are the TSC's, not core cycles: with turbo or frequency scaling
+   // they only compare runs on the same machine.
+   for (uint64_t v = 0; v < nvariants; v++) {
+      if (any_variant && !variant_picked[v])
+         continue;
+      if (!vqf_set_variant(variants[v])) {
+         printf("Kernels: %s not supported by this CPU\n\n",
+               vqf_variant_name(variants[v]));
+         continue;
+      }
+      for (uint64_t t = 0; t < ntag_sizes; t++) {
+         printf("Kernels: %s, ", vqf_variant_name(variants[v]));
+         if (!bench_variant(variants[v], tag_sizes[t], rounds)) {
+            printf("no %ld-bit tags\n", tag_sizes[t]);
+            exit(1);
+         }
+         printf("\n");
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  main_lat.cc
+ *
+ *    Description:  Open-loop latency benchmark. Operations are issued on a
+ *                  fixed schedule and every latency is measured from the
+ *                  time the operation was due, not from the time it started,
+ *                  so a slow operation also counts against the ones queued
+ *                  behind it (no coordinated omission).
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+#include <openssl/rand.h>
+
+#include "vqf_filter.h"
+
+// Log-linear histogram in the manner of HdrHistogram. Values below
+// 2^HIST_SUB_BITS are exact; larger ones fall in 2^(HIST_SUB_BITS-1) linear
+// sub-buckets per power of two, so a value is reported within 1/64 of itself.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1ULL << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 - HIST_SUB_BITS + 1)
+
+typedef struct histogram {
+   uint64_t counts[HIST_BUCKETS][HIST_SUB_BUCKETS];
+   uint64_t total;
+   uint64_t max;
+} histogram;
+
+static inline void hist_record(histogram *h, uint64_t value) {
+   uint64_t bucket = 0;
+   if (value >= HIST_SUB_BUCKETS)
+      bucket = 64 - __builtin_clzll(value) - HIST_SUB_BITS;
+   h->counts[bucket][value >> bucket]++;
+   h->total++;
+   if (value > h->max)
+      h->max = value;
+}
+
+// The highest value equivalent to the one at percentile p, like
+// HdrHistogram reports it.
+static uint64_t hist_percentile(const histogram *h, double p) {
+   uint64_t target = (uint64_t)(p / 100 * h->total + 0.5);
+   if (target == 0)
+      target = 1;
+   uint64_t seen = 0;
+   for (uint64_t bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+      for (uint64_t sub = 0; sub < HIST_SUB_BUCKETS; sub++) {
+         seen += h->counts[bucket][sub];
+         if (seen >= target) {
+            uint64_t value = ((sub + 1) << bucket) - 1;
+            return value < h->max ? value : h->max;
+         }
+      }
+   }
+   return h->max;
+}
+
+static inline uint64_t start_tsc(void) {
+   _mm_lfence();
+   return __rdtsc();
+}
+
+static inline uint64_t stop_tsc(void) {
+   unsigned int aux;
+   uint64_t tsc = __rdtscp(&aux);
+   _mm_lfence();
+   return tsc;
+}
+
+static uint64_t monotonic_nsecs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+// TSC ticks per nanosecond, measured against the monotonic clock.
+static double tsc_per_nsec(void) {
+   uint64_t t0 = monotonic_nsecs(), c0 = __rdtsc();
+   while (monotonic_nsecs() - t0 < 100000000)
+      ;
+   uint64_t t1 = monotonic_nsecs(), c1 = __rdtsc();
+   return (double)(c1 - c0) / (t1 - t0);
+}
+
+enum { OP_INSERT, OP_POSITIVE, OP_NEGATIVE, OP_REMOVE, NOPS };
+
+static const char *op_names[NOPS] = {"insert", "positive lookup",
+   "negative lookup", "remove"};
+
+int main(int argc, char **argv)
+{
+   if (argc < 2) {
+      fprintf(stderr, "Please specify the log of the number of slots in the CQF.\n");
+      fprintf(stderr, "Optionally add \"tag12\" or \"tag16\" to pick the tag"
+            " size, \"rate=<ops/s>\" to set the target rate (default 1000000)"
+            " and \"ops=<n>\" to set the operations per load step (default"
+            " 1/16 of the slots).\n");
+      exit(1);
+   }
+   uint64_t qbits = atoi(argv[1]);
+   uint64_t nslots = (1ULL << qbits);
+   uint64_t tag_bits = 8;
+   double rate = 1000000;
+   uint64_t nops = nslots / 16;
+   for (int i = 2; i < argc; i++) {
+      if (strncmp(argv[i], "tag", 3) == 0) {
+         tag_bits = atoi(argv[i] + 3);
+      } else if (strncmp(argv[i], "rate=", 5) == 0) {
+         rate = atof(argv[i] + 5);
+      } else if (strncmp(argv[i], "ops=", 4) == 0) {
+         nops = strtoull(argv[i] + 4, NULL, 10);
+      } else {
+         fprintf(stderr, "Unknown mode: %s\n", argv[i]);
+         exit(1);
+      }
+   }
+   // Removes take live keys, which are at least 1/10 of the slots.
+   if (rate <= 0 || nops == 0 || nops >= nslots / 10) {
+      fprintf(stderr, "The rate must be positive and the number of operations"
+            " between 1 and 1/10 of the slots.\n");
+      exit(1);
+   }
+
+   // Steps of 10% of the slots up to 90%. At each step the live keys are
+   // vals[lo, hi): inserts add vals[hi], removes take the oldest key vals[lo]
+   // and lookups pick a live key or a key of other_vals, so the load stays
+   // at the step while its operations run.
+   const uint64_t nsteps = 9;
+   uint64_t nvals = 9 * nslots / 10 + nsteps * nops;
+   uint64_t *vals = (uint64_t*)malloc(nvals*sizeof(vals[0]));
+   uint64_t *other_vals = (uint64_t*)malloc(nops*sizeof(other_vals[0]));
+   uint8_t *oprs = (uint8_t*)malloc(nops*sizeof(oprs[0]));
+   uint64_t *opr_vals = (uint64_t*)malloc(nops*sizeof(opr_vals[0]));
+   histogram *hists = (histogram*)malloc(NOPS*sizeof(hists[0]));
+   if (vals == NULL || other_vals == NULL || oprs == NULL || opr_vals == NULL ||
+         hists == NULL) {
+      fprintf(stderr, "Can't allocate the workload.\n");
+      exit(EXIT_FAILURE);
+   }
+   RAND_bytes((unsigned char *)vals, sizeof(*vals) * nvals);
+   RAND_bytes((unsigned char *)other_vals, sizeof(*other_vals) * nops);
+
+   vqf_filter *filter;
+   if ((filter = vqf_init(nslots, tag_bits, VQF_ADDRESSING_MODULO)) == NULL) {
+      fprintf(stderr, "Can't allocate vqf filter.");
+      exit(EXIT_FAILURE);
+   }
+
+   double ticks_per_nsec = tsc_per_nsec();
+   double ticks_per_op = ticks_per_nsec * 1e9 / rate;
+   printf("Target rate: %.0f ops/s, %ld ops per load step, TSC at %.3f GHz\n",
+         rate, nops, ticks_per_nsec);
+   printf("%-6s %-16s %10s %10s %10s %10s %10s\n", "load", "operation", "count",
+         "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+   srand48(qbits);
+   uint64_t lo = 0, hi = 0;
+   for (uint64_t step = 1; step <= nsteps; step++) {
+      uint64_t nlive = step * nslots / 10;
+      while (hi - lo < nlive && vqf_insert(filter, vals[hi]))
+         hi++;
+      if (hi - lo < nlive) {
+         printf("Filter full at load %f\n", (hi - lo)/(nslots*1.0));
+         break;
+      }
+
+      // Keys are picked before the clock starts. Removes are never of a key
+      // inserted in this step, so every remove finds its key.
+      uint64_t next_insert = hi, next_remove = lo;
+      for (uint64_t i = 0; i < nops; i++) {
+         oprs[i] = lrand48() % NOPS;
+         if (oprs[i] == OP_INSERT) {
+            opr_vals[i] = vals[next_insert++];
+         } else if (oprs[i] == OP_POSITIVE) {
+            opr_vals[i] = vals[next_remove + lrand48() % (hi - next_remove)];
+         } else if (oprs[i] == OP_NEGATIVE) {
+            opr_vals[i] = other_vals[i];
+         } else {
+            opr_vals[i] = vals[next_remove++];
+         }
+      }
+
+      memset(hists, 0, NOPS*sizeof(hists[0]));
+      uint64_t nfailures = 0, max_lag = 0;
+      uint64_t begin = start_tsc() + (uint64_t)ticks_per_op;
+      for (uint64_t i = 0; i < nops; i++) {
+         uint64_t due = begin + (uint64_t)(i * ticks_per_op);
+         uint64_t now;
+         while ((now = start_tsc()) < due)
+            _mm_pause();
+         if (now - due > max_lag)
+            max_lag = now - due;
+         bool ret;
+         if (oprs[i] == OP_INSERT)
+            ret = vqf_insert(filter, opr_vals[i]);
+         else if (oprs[i] == OP_REMOVE)
+            ret = vqf_remove(filter, opr_vals[i]);
+         else
+            ret = vqf_is_present(filter, opr_vals[i]) == (oprs[i] == OP_POSITIVE);
+         hist_record(&hists[oprs[i]], stop_tsc() - due);
+         // False positives are not failures.
+         nfailures += !ret && oprs[i] != OP_NEGATIVE;
+      }
+      hi = next_insert;
+      lo = next_remove;
+
+      for (int op = 0; op < NOPS; op++) {
+         const histogram *h = &hists[op];
+         printf("%-6.2f %-16s %10ld %10.0f %10.0f %10.0f %10.0f\n", step / 10.0,
+               op_names[op], h->total, hist_percentile(h, 50) / ticks_per_nsec,
+               hist_percentile(h, 99) / ticks_per_nsec, hist_percentile(h,
+                  99.9) / ticks_per_nsec, h->max / ticks_per_nsec);
+      }
+      if (nfailures != 0)
+         printf("%ld failed operations\n", nfailures);
+      // A lag of more than a millisecond means the rate is more than the
+      // filter sustains, and the queueing shows in the tail.
+      if (max_lag / ticks_per_nsec > 1000000)
+         printf("Fell behind the schedule by up to %.3f ms\n",
+               max_lag / ticks_per_nsec / 1e6);
+   }
+
+   free(vals);
+   free(other_vals);
+   free(oprs);
+   free(opr_vals);
+   free(hists);
+   vqf_free(filter);
+   return 0;
+}
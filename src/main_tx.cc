@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <time.h>
 #include <sys/time.h>
@@ -41,6 +42,9 @@ typedef struct args {
    uint64_t *vals;
    uint64_t start;
    uint64_t end;
+   uint32_t rounds;
+   uint64_t failures;
+   bool *inserted;
 } args;
 
 void *insert_bm(void *arg)
@@ -69,13 +73,76 @@ void *query_bm(void *arg)
    return NULL;
 }
 
-void multi_threaded_insertion(args args[], int tcnt)
+// Writer of the fill mode: inserts past the capacity of the filter, so that
+// the threads race for the last free slots, and records which keys made it.
+void *fill_bm(void *arg)
+{
+   args *a = (args *)arg;
+   for (uint32_t i = a->start; i <= a->end; i++)
+      a->inserted[i] = vqf_insert(a->cf, a->vals[i]);
+   return NULL;
+}
+
+// Writer of the stress mode: inserts its keys and removes them again, for a
+// number of rounds. Every failed remove is a lost key.
+void *churn_bm(void *arg)
+{
+   args *a = (args *)arg;
+   for (uint32_t r = 0; r < a->rounds; r++) {
+      insert_bm(arg);
+      for (uint32_t i = a->start; i <= a->end; i++) {
+         if (!vqf_remove(a->cf, a->vals[i]))
+            a->failures++;
+      }
+   }
+   return NULL;
+}
+
+// Reader of the mixed and stress modes: looks up keys that are known to be in the filter
+// until the writers are done. Every miss is a false negative.
+typedef struct reader_args {
+   vqf_filter *cf;
+   uint64_t *vals;
+   uint64_t nvals;
+   uint64_t first;
+   volatile bool *done;
+   uint64_t lookups;
+   uint64_t misses;
+} reader_args;
+
+void *reader_bm(void *arg)
+{
+   reader_args *a = (reader_args *)arg;
+   uint64_t i = a->first;
+   while (!*a->done) {
+      for (uint32_t j = 0; j < 1024; j++) {
+         if (!vqf_is_present(a->cf, a->vals[i]))
+            a->misses++;
+         if (++i == a->nvals)
+            i = 0;
+      }
+      a->lookups += 1024;
+   }
+   return NULL;
+}
+
+// Prints the lock counters of a library built with LOCK_STATS=1.
+void print_lock_stats(vqf_filter *filter)
+{
+   vqf_lock_stats stats;
+   if (!vqf_get_lock_stats(filter, &stats))
+      return;
+   printf("Locks: %ld acquisitions, %ld spins, max wait %ld ticks\n",
+         stats.acquisitions, stats.spins, stats.max_wait);
+}
+
+void multi_threaded_run(void *(*fn)(void *), args args[], int tcnt)
 {
    pthread_t threads[tcnt];
 
    for (int i = 0; i < tcnt; i++) {
       fprintf(stdout, "Thread %d bounds %ld %ld\n", i, args[i].start, args[i].end);
-      if (pthread_create(&threads[i], NULL, &insert_bm, &args[i])) {
+      if (pthread_create(&threads[i], NULL, fn, &args[i])) {
          fprintf(stderr, "Error creating thread\n");
          exit(0);
       }
@@ -89,25 +156,40 @@ void multi_threaded_insertion(args args[], int tcnt)
    }
 }
 
+void multi_threaded_insertion(args args[], int tcnt)
+{
+   multi_threaded_run(&insert_bm, args, tcnt);
+}
+
 int main(int argc, char **argv)
 {
    if (argc < 3) {
       fprintf(stderr, "Please specify three arguments: \n \
             1. log of the number of slots in the CQF.\n \
-            2. number of threads.\n");
+            2. number of threads.\n \
+            3. tag size: 8, 12 or 16 (optional, default 8).\n \
+            4. \"mixed\" to insert half of the items first and look them\n \
+               up with half of the threads while the others insert the\n \
+               rest, \"stress\" to also remove and reinsert the rest\n \
+               for 4 rounds, or \"fill\" to insert 110%% of the slots\n \
+               and check every key that went in (optional).\n");
       exit(1);
    }
    uint64_t qbits = atoi(argv[1]);
    uint32_t tcnt = atoi(argv[2]);
+   uint64_t tag_bits = argc > 3 ? atoi(argv[3]) : 8;
+   bool mixed = argc > 4 && strcmp(argv[4], "mixed") == 0;
+   bool stress = argc > 4 && strcmp(argv[4], "stress") == 0;
+   bool fill = argc > 4 && strcmp(argv[4], "fill") == 0;
    uint64_t nhashbits = qbits + 8;
    uint64_t nslots = (1ULL << qbits);
-   uint64_t nvals = 85*nslots/100;
+   uint64_t nvals = (fill ? 110 : 85)*nslots/100;
 
    uint64_t *vals;
    vqf_filter *filter;	
 
    /* initialize vqf filter */
-   if ((filter = vqf_init(nslots)) == NULL) {
+   if ((filter = vqf_init(nslots, tag_bits, VQF_ADDRESSING_MODULO)) == NULL) {
       fprintf(stderr, "Can't allocate vqf filter.");
       exit(EXIT_FAILURE);
    }
@@ -120,31 +202,121 @@ int main(int argc, char **argv)
       //vals[i] = (1 * vals[i]) % filter->metadata.range;
    }
 
-   args *arg = (args*)malloc(tcnt * sizeof(args));
-   for (uint32_t i = 0; i < tcnt; i++) {
-      arg[i].cf = filter;
-      arg[i].vals = vals;
-      arg[i].start = (nvals/tcnt) * i;
-      arg[i].end = (nvals/tcnt) * (i + 1) - 1;
-   }
-   //fprintf(stdout, "Total number of items: %ld\n", arg[tcnt-1].end);
-
    struct timeval start, end;
    struct timezone tzp;
+   uint64_t ninserted;
+   bool *inserted = fill ? (bool*)calloc(nvals, sizeof(inserted[0])) : NULL;
+
+   if (!mixed && !stress) {
+      args *arg = (args*)malloc(tcnt * sizeof(args));
+      for (uint32_t i = 0; i < tcnt; i++) {
+         arg[i].cf = filter;
+         arg[i].vals = vals;
+         arg[i].start = (nvals/tcnt) * i;
+         arg[i].end = (nvals/tcnt) * (i + 1) - 1;
+         arg[i].inserted = inserted;
+      }
+      //fprintf(stdout, "Total number of items: %ld\n", arg[tcnt-1].end);
+
+      gettimeofday(&start, &tzp);
+      if (fill)
+         multi_threaded_run(&fill_bm, arg, tcnt);
+      else
+         multi_threaded_insertion(arg, tcnt);
+      gettimeofday(&end, &tzp);
+      print_time_elapsed("Insertion time", &start, &end, nvals, "insert");
+      print_lock_stats(filter);
+
+      //fprintf(stdout, "Inserted all items: %ld\n", arg[tcnt-1].end);
+      ninserted = arg[tcnt-1].end;
+      free(arg);
+   } else {
+      uint32_t nwriters = tcnt > 1 ? tcnt / 2 : 1;
+      uint32_t nreaders = tcnt > nwriters ? tcnt - nwriters : 1;
+      uint64_t nhalf = nvals / 2;
+      uint64_t nrest = (nvals - nhalf) / nwriters;
+
+      args first = {filter, vals, 0, nhalf - 1};
+      insert_bm(&first);
+      vqf_reset_lock_stats(filter);
 
-   gettimeofday(&start, &tzp);
-   multi_threaded_insertion(arg, tcnt);
-   gettimeofday(&end, &tzp);
-   print_time_elapsed("Insertion time", &start, &end, nvals, "insert");
+      args *arg = (args*)calloc(nwriters, sizeof(args));
+      for (uint32_t i = 0; i < nwriters; i++) {
+         arg[i].cf = filter;
+         arg[i].vals = vals;
+         arg[i].start = nhalf + nrest * i;
+         arg[i].end = nhalf + nrest * (i + 1) - 1;
+         arg[i].rounds = stress ? 4 : 1;
+      }
+
+      volatile bool done = false;
+      reader_args *rarg = (reader_args*)calloc(nreaders, sizeof(reader_args));
+      pthread_t readers[nreaders];
+      for (uint32_t i = 0; i < nreaders; i++) {
+         rarg[i].cf = filter;
+         rarg[i].vals = vals;
+         rarg[i].nvals = nhalf;
+         rarg[i].first = nhalf / nreaders * i;
+         rarg[i].done = &done;
+         if (pthread_create(&readers[i], NULL, &reader_bm, &rarg[i])) {
+            fprintf(stderr, "Error creating thread\n");
+            exit(0);
+         }
+      }
+
+      gettimeofday(&start, &tzp);
+      multi_threaded_run(stress ? &churn_bm : &insert_bm, arg, nwriters);
+      gettimeofday(&end, &tzp);
+      done = true;
+
+      uint64_t lookups = 0, misses = 0;
+      for (uint32_t i = 0; i < nreaders; i++) {
+         if (pthread_join(readers[i], NULL)) {
+            fprintf(stderr, "Error joining thread\n");
+            exit(0);
+         }
+         lookups += rarg[i].lookups;
+         misses += rarg[i].misses;
+      }
+
+      uint64_t failures = 0;
+      for (uint32_t i = 0; i < nwriters; i++)
+         failures += arg[i].failures;
+      if (stress) {
+         print_time_elapsed("Insert/remove time", &start, &end,
+               2 * 4 * nrest * nwriters, "op");
+         printf("Failed removes: %ld\n", failures);
+      } else {
+         print_time_elapsed("Insertion time", &start, &end,
+               nrest * nwriters, "insert");
+      }
+      uint64_t elapsed_usecs = tv2usec(&end) - tv2usec(&start);
+      printf("Concurrent lookups: %ld by %d readers (%f Mops/s), "
+            "false negatives: %ld\n", lookups, nreaders,
+            elapsed_usecs ? 1.0 * lookups / elapsed_usecs : 0.0, misses);
+      print_lock_stats(filter);
+      if (misses || failures) {
+         fprintf(stderr, "Concurrent operations lost keys\n");
+         exit(EXIT_FAILURE);
+      }
+      // the stress mode removes all the keys it inserted
+      ninserted = stress ? nhalf : arg[nwriters-1].end;
+      free(rarg);
+      free(arg);
+   }
 
-   //fprintf(stdout, "Inserted all items: %ld\n", arg[tcnt-1].end);
+   printf("Items: %ld (load factor %f)\n", vqf_size(filter),
+         vqf_load_factor(filter));
 
-   for (uint64_t i = 0; i < arg[tcnt-1].end; i++) {
-      if (!vqf_is_present(filter, vals[i])) {
+   // the fill mode only looks up the keys whose insert succeeded
+   for (uint64_t i = 0; i < ninserted; i++) {
+      if ((inserted == NULL || inserted[i]) && !vqf_is_present(filter, vals[i])) {
          fprintf(stderr, "Lookup failed for %ld", vals[i]);
          exit(EXIT_FAILURE);
       }
    }
 
+   free(inserted);
+   vqf_free(filter);
    return 0;
 }
@@ -0,0 +1,604 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_dispatch.c
+ *
+ *    Description:  Allocation, saving and mapping of filters, and the public
+ *                  calls through their operations table.
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "vqf_filter.h"
+#include "vqf_dispatch.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_2M (1ULL << 21)
+#define HUGE_1G (1ULL << 30)
+
+#ifdef ENABLE_THREADS
+// Item counts are sharded by thread, one shard per cache line, so that
+// inserts and removes on different threads do not share a counter. Shards
+// go negative when a thread removes items inserted by another.
+#define VQF_COUNT_SHARDS 64
+
+struct __attribute__ ((aligned (64))) vqf_count_shard {
+   int64_t nelts;
+};
+
+// 1 + the shard of the calling thread, 0 until it is assigned.
+static __thread uint32_t thread_shard;
+static uint32_t next_shard;
+#endif
+
+// Memory used by the next vqf_init.
+static vqf_pages default_pages = VQF_PAGES_DEFAULT;
+static vqf_allocator user_allocator;
+
+// Kernels used by the next vqf_init. VQF_VARIANT_AUTO picks the best one the
+// CPU supports.
+static vqf_variant forced_variant = VQF_VARIANT_AUTO;
+
+static bool cpu_supports(vqf_variant variant) {
+   __builtin_cpu_init();
+   switch (variant) {
+      case VQF_VARIANT_AVX512:
+         return __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vbmi") &&
+            __builtin_cpu_supports("bmi2");
+      case VQF_VARIANT_AVX2:
+      case VQF_VARIANT_AVX2_NOPDEP:
+         return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+      case VQF_VARIANT_GENERIC:
+         return __builtin_cpu_supports("sse4.2") &&
+            __builtin_cpu_supports("popcnt");
+      default:
+         return false;
+   }
+}
+
+// PDEP and PEXT are microcoded on AMD family 17h (Zen1 and Zen2) and take
+// hundreds of cycles.
+static bool slow_pdep(void) {
+   __builtin_cpu_init();
+   return __builtin_cpu_is("amdfam17h");
+}
+
+bool vqf_set_variant(vqf_variant variant) {
+   if (variant != VQF_VARIANT_AUTO && !cpu_supports(variant))
+      return false;
+   forced_variant = variant;
+   return true;
+}
+
+const char * vqf_variant_name(vqf_variant variant) {
+   switch (variant) {
+      case VQF_VARIANT_AUTO:
+         return "auto";
+      case VQF_VARIANT_GENERIC:
+         return "generic";
+      case VQF_VARIANT_AVX2:
+         return "avx2";
+      case VQF_VARIANT_AVX512:
+         return "avx512";
+      case VQF_VARIANT_AVX2_NOPDEP:
+         return "avx2-nopdep";
+      default:
+         return "unknown";
+   }
+}
+
+vqf_variant vqf_get_variant(const vqf_filter *filter) {
+   return filter->ops->variant;
+}
+
+void vqf_add_size(vqf_filter *filter, int64_t n) {
+#ifdef ENABLE_THREADS
+   if (thread_shard == 0)
+      thread_shard = __atomic_add_fetch(&next_shard, 1, __ATOMIC_RELAXED) %
+         VQF_COUNT_SHARDS + 1;
+   __atomic_fetch_add(&filter->count_shards[thread_shard - 1].nelts, n,
+         __ATOMIC_RELAXED);
+#else
+   filter->metadata.nelts += n;
+#endif
+}
+
+uint64_t vqf_size(const vqf_filter *filter) {
+   int64_t nelts = filter->metadata.nelts;
+#ifdef ENABLE_THREADS
+   for (uint64_t i = 0; i < VQF_COUNT_SHARDS; i++)
+      nelts += __atomic_load_n(&filter->count_shards[i].nelts,
+            __ATOMIC_RELAXED);
+#endif
+   return nelts < 0 ? 0 : nelts;
+}
+
+void vqf_set_size(vqf_filter *filter, uint64_t nelts) {
+   filter->metadata.nelts = nelts;
+#ifdef ENABLE_THREADS
+   memset(filter->count_shards, 0, VQF_COUNT_SHARDS *
+         sizeof(struct vqf_count_shard));
+#endif
+}
+
+void vqf_run_tasks(void * (*fn)(void *), void *tasks, size_t task_size,
+      uint64_t ntasks) {
+   pthread_t *threads = (pthread_t *)calloc(ntasks, sizeof(*threads));
+   bool *started = (bool *)calloc(ntasks, sizeof(*started));
+   char *task = (char *)tasks;
+
+   // The calling thread takes the first task, and any task whose thread
+   // can't be started: all of them if the threads can't be allocated.
+   for (uint64_t t = 1; threads != NULL && started != NULL && t < ntasks; t++)
+      started[t] = pthread_create(&threads[t], NULL, fn, task + t *
+            task_size) == 0;
+   for (uint64_t t = 0; t < ntasks; t++) {
+      if (started == NULL || !started[t])
+         fn(task + t * task_size);
+   }
+   for (uint64_t t = 1; started != NULL && t < ntasks; t++) {
+      if (started[t])
+         pthread_join(threads[t], NULL);
+   }
+
+   free(threads);
+   free(started);
+}
+
+double vqf_load_factor(const vqf_filter *filter) {
+   return (double)vqf_size(filter) / filter->metadata.nslots;
+}
+
+bool vqf_get_lock_stats(const vqf_filter *filter, vqf_lock_stats *stats) {
+   memset(stats, 0, sizeof(*stats));
+   if (filter->lock_counters == NULL)
+      return false;
+#ifdef VQF_LOCK_STATS
+   for (uint64_t i = 0; i < VQF_LOCK_STAT_STRIPES; i++) {
+      const struct vqf_lock_counters *c = &filter->lock_counters[i];
+      stats->acquisitions += __atomic_load_n(&c->acquisitions, __ATOMIC_RELAXED);
+      stats->spins += __atomic_load_n(&c->spins, __ATOMIC_RELAXED);
+      uint64_t max_wait = __atomic_load_n(&c->max_wait, __ATOMIC_RELAXED);
+      if (max_wait > stats->max_wait)
+         stats->max_wait = max_wait;
+   }
+#endif
+   return true;
+}
+
+void vqf_reset_lock_stats(vqf_filter *filter) {
+#ifdef VQF_LOCK_STATS
+   if (filter->lock_counters != NULL)
+      memset(filter->lock_counters, 0, VQF_LOCK_STAT_STRIPES *
+            sizeof(struct vqf_lock_counters));
+#endif
+}
+
+void vqf_set_pages(vqf_pages pages) {
+   default_pages = pages;
+}
+
+void vqf_set_allocator(const vqf_allocator *allocator) {
+   if (allocator == NULL)
+      memset(&user_allocator, 0, sizeof(user_allocator));
+   else
+      user_allocator = *allocator;
+}
+
+static void * map_pages(uint64_t size, int flags) {
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+         MAP_ANONYMOUS | flags, -1, 0);
+   return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static uint64_t round_up(uint64_t size, uint64_t page) {
+   return (size + page - 1) / page * page;
+}
+
+// Counters are kept apart from the filter so that they never end up in a
+// saved file or a mapping, nor on a cache line of the blocks.
+// nlines is the number of cache lines of the blocks, which sizes the
+// seqlocks.
+static bool alloc_counters(vqf_filter *filter, uint64_t nlines) {
+   filter->lock_counters = NULL;
+   filter->count_shards = NULL;
+   filter->seqlocks = NULL;
+   filter->seqlock_shift = 0;
+#ifdef ENABLE_THREADS
+   size_t shards_size = VQF_COUNT_SHARDS * sizeof(struct vqf_count_shard);
+   if (posix_memalign((void **)&filter->count_shards, 64, shards_size) != 0) {
+      filter->count_shards = NULL;
+      return false;
+   }
+   memset(filter->count_shards, 0, shards_size);
+
+   uint64_t nstripes = VQF_SEQLOCK_MIN_STRIPES;
+   while (nstripes < nlines && nstripes < VQF_SEQLOCK_MAX_STRIPES)
+      nstripes *= 2;
+   size_t seqlocks_size = nstripes * sizeof(uint64_t);
+   if (posix_memalign((void **)&filter->seqlocks, 64, seqlocks_size) != 0) {
+      filter->seqlocks = NULL;
+      return false;
+   }
+   memset(filter->seqlocks, 0, seqlocks_size);
+   filter->seqlock_shift = 64 - __builtin_ctzll(nstripes);
+#endif
+#ifdef VQF_LOCK_STATS
+   size_t size = VQF_LOCK_STAT_STRIPES * sizeof(struct vqf_lock_counters);
+   if (posix_memalign((void **)&filter->lock_counters, 64, size) != 0) {
+      filter->lock_counters = NULL;
+      return false;
+   }
+   memset(filter->lock_counters, 0, size);
+#endif
+   return true;
+}
+
+vqf_filter * vqf_alloc_filter(uint64_t total_size_in_bytes) {
+   uint64_t size = sizeof(vqf_filter) + total_size_in_bytes;
+   vqf_pages pages = default_pages;
+   vqf_filter *filter = NULL;
+
+   if (user_allocator.alloc != NULL) {
+      pages = VQF_PAGES_ALLOCATOR;
+      filter = (vqf_filter *)user_allocator.alloc(size, user_allocator.arg);
+      if (filter != NULL && (uintptr_t)filter % 64 != 0) {
+         fprintf(stderr, "vqf allocator must return 64-byte aligned memory.\n");
+         user_allocator.dealloc(filter, size, user_allocator.arg);
+         return NULL;
+      }
+   } else if (pages == VQF_PAGES_DEFAULT) {
+      if (posix_memalign((void **)&filter, 64, size) != 0)
+         filter = NULL;
+   } else {
+      // Hugetlb pages are only there if the admin reserved them, so fall back
+      // to transparent huge pages, rounding the request again from the
+      // filter's own size rather than from a 1 GB page.
+      uint64_t request = size;
+      if (pages == VQF_PAGES_HUGE_1G) {
+         size = round_up(request, HUGE_1G);
+         filter = (vqf_filter *)map_pages(size, MAP_HUGETLB | MAP_HUGE_1GB);
+      } else if (pages == VQF_PAGES_HUGE_2M) {
+         size = round_up(request, HUGE_2M);
+         filter = (vqf_filter *)map_pages(size, MAP_HUGETLB | MAP_HUGE_2MB);
+      }
+      if (filter == NULL) {
+         pages = VQF_PAGES_TRANSPARENT;
+         size = round_up(request, HUGE_2M);
+         filter = (vqf_filter *)map_pages(size, 0);
+         if (filter != NULL)
+            madvise(filter, size, MADV_HUGEPAGE);
+      }
+   }
+   if (filter == NULL) {
+      fprintf(stderr, "Can't allocate %lu bytes for the vqf filter.\n", size);
+      return NULL;
+   }
+
+   filter->pages = pages;
+   filter->alloc_size = size;
+   filter->allocator = user_allocator;
+   filter->map = NULL;
+   filter->map_size = 0;
+   filter->blocks = (vqf_block *)(filter + 1);
+   if (!alloc_counters(filter, total_size_in_bytes / sizeof(vqf_block))) {
+      vqf_free(filter);
+      return NULL;
+   }
+   return filter;
+}
+
+void vqf_free(vqf_filter *filter) {
+   if (filter == NULL)
+      return;
+   free(filter->lock_counters);
+   free(filter->count_shards);
+   free(filter->seqlocks);
+   switch (filter->pages) {
+      case VQF_PAGES_DEFAULT:
+         free(filter);
+         break;
+      case VQF_PAGES_ALLOCATOR:
+         filter->allocator.dealloc(filter, filter->alloc_size,
+               filter->allocator.arg);
+         break;
+      case VQF_PAGES_MAPPED:
+         munmap(filter->map, filter->map_size);
+         free(filter);
+         break;
+      default:
+         munmap(filter, filter->alloc_size);
+         break;
+   }
+}
+
+static vqf_variant pick_variant(void) {
+   if (forced_variant != VQF_VARIANT_AUTO)
+      return forced_variant;
+   if (cpu_supports(VQF_VARIANT_AVX512))
+      return VQF_VARIANT_AVX512;
+   if (cpu_supports(VQF_VARIANT_AVX2))
+      return slow_pdep() ? VQF_VARIANT_AVX2_NOPDEP : VQF_VARIANT_AVX2;
+   return VQF_VARIANT_GENERIC;
+}
+
+static const vqf_ops * variant_ops(vqf_variant variant, uint64_t tag_bits,
+      bool counting, bool maplet, bool read_only) {
+   switch (variant) {
+      case VQF_VARIANT_AVX512:
+         return vqf_avx512::get_ops(tag_bits, counting, maplet, read_only);
+      case VQF_VARIANT_AVX2:
+         return vqf_avx2::get_ops(tag_bits, counting, maplet, read_only);
+      case VQF_VARIANT_AVX2_NOPDEP:
+         return vqf_avx2_nopdep::get_ops(tag_bits, counting, maplet, read_only);
+      default:
+         return vqf_generic::get_ops(tag_bits, counting, maplet, read_only);
+   }
+}
+
+static vqf_filter * init_filter(uint64_t nslots, uint64_t tag_bits,
+      vqf_addressing addressing, bool counting, uint64_t value_bits) {
+   vqf_variant variant = pick_variant();
+
+   switch (variant) {
+      case VQF_VARIANT_AVX512:
+         return vqf_avx512::init(nslots, tag_bits, addressing, counting,
+               value_bits);
+      case VQF_VARIANT_AVX2:
+         return vqf_avx2::init(nslots, tag_bits, addressing, counting,
+               value_bits);
+      case VQF_VARIANT_AVX2_NOPDEP:
+         return vqf_avx2_nopdep::init(nslots, tag_bits, addressing, counting,
+               value_bits);
+      default:
+         if (!cpu_supports(VQF_VARIANT_GENERIC)) {
+            fprintf(stderr, "vqf needs SSE4.2 and POPCNT.\n");
+            return NULL;
+         }
+         return vqf_generic::init(nslots, tag_bits, addressing, counting,
+               value_bits);
+   }
+}
+
+vqf_filter * vqf_init(uint64_t nslots, uint64_t tag_bits, vqf_addressing
+      addressing) {
+   return init_filter(nslots, tag_bits, addressing, false, 0);
+}
+
+vqf_filter * vqf_init_counting(uint64_t nslots, uint64_t tag_bits,
+      vqf_addressing addressing) {
+   return init_filter(nslots, tag_bits, addressing, true, 0);
+}
+
+vqf_filter * vqf_init_maplet(uint64_t nslots, uint64_t tag_bits, uint64_t
+      value_bits, vqf_addressing addressing) {
+   if (value_bits == 0) {
+      fprintf(stderr, "Maplet values need at least 1 bit.\n");
+      return NULL;
+   }
+   return init_filter(nslots, tag_bits, addressing, false, value_bits);
+}
+
+bool vqf_save(const vqf_filter *filter, const char *path) {
+   char header[VQF_FILE_HEADER_SIZE];
+   vqf_file_header *file_header = (vqf_file_header *)header;
+
+   memset(header, 0, sizeof(header));
+   file_header->magic = VQF_FILE_MAGIC;
+   file_header->version = VQF_FILE_VERSION;
+   file_header->header_size = VQF_FILE_HEADER_SIZE;
+   file_header->metadata = filter->metadata;
+   file_header->metadata.nelts = vqf_size(filter);
+
+   FILE *fp = fopen(path, "wb");
+   if (fp == NULL) {
+      perror(path);
+      return false;
+   }
+   bool ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+      fwrite(filter->blocks, filter->metadata.total_size_in_bytes, 1, fp) == 1;
+   ok = fclose(fp) == 0 && ok;
+   if (!ok)
+      perror(path);
+   return ok;
+}
+
+vqf_filter * vqf_open_mmap(const char *path, bool writable) {
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+      perror(path);
+      return NULL;
+   }
+   struct stat st;
+   if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < VQF_FILE_HEADER_SIZE) {
+      fprintf(stderr, "%s: not a vqf filter.\n", path);
+      close(fd);
+      return NULL;
+   }
+   void *map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE :
+         PROT_READ, writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      perror(path);
+      return NULL;
+   }
+
+   const vqf_file_header *file_header = (const vqf_file_header *)map;
+   const vqf_metadata *metadata = &file_header->metadata;
+   const vqf_ops *ops = variant_ops(pick_variant(),
+         metadata->key_remainder_bits, metadata->counting != 0,
+         metadata->value_bits != 0, !writable);
+   uint64_t block_size = sizeof(vqf_block) + (metadata->value_bits != 0 ?
+         sizeof(vqf_values) : 0);
+   vqf_filter *filter = NULL;
+   if (file_header->magic != VQF_FILE_MAGIC ||
+         file_header->version != VQF_FILE_VERSION ||
+         file_header->header_size != VQF_FILE_HEADER_SIZE || ops == NULL ||
+         metadata->addressing > VQF_ADDRESSING_FASTRANGE ||
+         metadata->value_bits > 16 || metadata->nblocks == 0 ||
+         metadata->nblocks > UINT64_MAX / block_size ||
+         metadata->range != metadata->nblocks * ops->buckets_per_block ||
+         metadata->nslots != metadata->nblocks * ops->slots_per_block ||
+         metadata->total_size_in_bytes != metadata->nblocks * block_size ||
+         (uint64_t)st.st_size != VQF_FILE_HEADER_SIZE +
+         metadata->total_size_in_bytes) {
+      fprintf(stderr, "%s: not a vqf filter of this version.\n", path);
+   } else if (posix_memalign((void **)&filter, 64, sizeof(*filter)) != 0) {
+      filter = NULL;
+   }
+   if (filter == NULL) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+
+   memset(filter, 0, sizeof(*filter));
+   filter->metadata = *metadata;
+   filter->ops = ops;
+   filter->pages = VQF_PAGES_MAPPED;
+   filter->alloc_size = sizeof(*filter);
+   filter->map = map;
+   filter->map_size = st.st_size;
+   filter->blocks = (vqf_block *)((char *)map + VQF_FILE_HEADER_SIZE);
+   if (!alloc_counters(filter, metadata->total_size_in_bytes /
+            sizeof(vqf_block))) {
+      vqf_free(filter);
+      return NULL;
+   }
+   return filter;
+}
+
+// Counting filters count their slots from their own inserts and removes, see
+// vqf_size.
+bool vqf_insert(vqf_filter * restrict filter, uint64_t hash) {
+   bool ret = filter->ops->insert(filter, hash);
+   if (ret && !filter->metadata.counting)
+      vqf_add_size(filter, 1);
+   return ret;
+}
+
+bool vqf_remove(vqf_filter * restrict filter, uint64_t hash) {
+   bool ret = filter->ops->remove(filter, hash);
+   if (ret && !filter->metadata.counting)
+      vqf_add_size(filter, -1);
+   return ret;
+}
+
+bool vqf_is_present(vqf_filter * restrict filter, uint64_t hash) {
+   return filter->ops->is_present(filter, hash);
+}
+
+vqf_placement vqf_get_placement(vqf_filter * restrict filter, uint64_t hash) {
+   return filter->ops->placement(filter, hash);
+}
+
+uint64_t vqf_count(vqf_filter * restrict filter, uint64_t hash) {
+   return filter->ops->count(filter, hash);
+}
+
+bool vqf_insert_kv(vqf_filter * restrict filter, uint64_t hash, uint64_t
+      value) {
+   uint64_t value_bits = filter->metadata.value_bits;
+   if (value_bits != 0)
+      value &= (1ULL << value_bits) - 1;
+   bool ret = filter->ops->insert_kv(filter, hash, value);
+   if (ret)
+      vqf_add_size(filter, 1);
+   return ret;
+}
+
+bool vqf_get(vqf_filter * restrict filter, uint64_t hash, uint64_t *value) {
+   return filter->ops->get(filter, hash, value);
+}
+
+uint64_t vqf_insert_batch(vqf_filter * restrict filter, const uint64_t *
+      restrict hashes, uint64_t nhashes, bool * restrict results) {
+   uint64_t nfailures = filter->ops->insert_batch(filter, hashes, nhashes,
+         results);
+   if (!filter->metadata.counting)
+      vqf_add_size(filter, nhashes - nfailures);
+   return nfailures;
+}
+
+uint64_t vqf_remove_batch(vqf_filter * restrict filter, const uint64_t *
+      restrict hashes, uint64_t nhashes, bool * restrict results) {
+   uint64_t nfailures = filter->ops->remove_batch(filter, hashes, nhashes,
+         results);
+   if (!filter->metadata.counting)
+      vqf_add_size(filter, -(int64_t)(nhashes - nfailures));
+   return nfailures;
+}
+
+uint64_t vqf_is_present_batch(vqf_filter * restrict filter, const uint64_t *
+      restrict hashes, uint64_t nhashes, bool * restrict results) {
+   return filter->ops->is_present_batch(filter, hashes, nhashes, results);
+}
+
+void vqf_cursor_init(vqf_cursor *cursor, const vqf_filter *filter, uint64_t
+      begin, uint64_t end) {
+   cursor->filter = filter;
+   cursor->end = end < filter->metadata.nblocks ? end :
+      filter->metadata.nblocks;
+   cursor->block = begin < cursor->end ? begin : cursor->end;
+   cursor->pos = 0;
+   cursor->n = 0;
+}
+
+bool vqf_cursor_next(vqf_cursor *cursor, vqf_entry *entry) {
+   while (cursor->pos == cursor->n) {
+      if (cursor->block == cursor->end)
+         return false;
+      cursor->n = cursor->filter->ops->decode_block(cursor->filter,
+            cursor->block++, cursor->entries);
+      cursor->pos = 0;
+   }
+   *entry = cursor->entries[cursor->pos++];
+   return true;
+}
+
+uint64_t vqf_cursor_read(vqf_cursor *cursor, vqf_entry *entries, uint64_t n) {
+   const vqf_filter *filter = cursor->filter;
+   uint64_t count = 0;
+
+   while (count < n) {
+      if (cursor->pos < cursor->n) {
+         uint64_t len = cursor->n - cursor->pos;
+         if (len > n - count)
+            len = n - count;
+         memcpy(entries + count, cursor->entries + cursor->pos, len *
+               sizeof(entries[0]));
+         cursor->pos += len;
+         count += len;
+      } else if (cursor->block == cursor->end) {
+         break;
+      } else if (n - count >= VQF_CURSOR_BLOCK_ENTRIES) {
+         count += filter->ops->decode_block(filter, cursor->block++, entries +
+               count);
+      } else {
+         cursor->n = filter->ops->decode_block(filter, cursor->block++,
+               cursor->entries);
+         cursor->pos = 0;
+      }
+   }
+   return count;
+}
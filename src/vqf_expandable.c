@@ -0,0 +1,140 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_expandable.c
+ *
+ *    Description:  Expandable filter, a chain of filters that each double the
+ *                  size of the one before.
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "vqf_filter.h"
+
+#define VQF_EXPANDABLE_DEFAULT_LOAD 0.9
+
+// Summing the item count of a level is not free with threads, so every
+// thread only checks the load of a level once every check_mask + 1 of its
+// inserts. Counting inserts rather than testing hash bits keeps the checks
+// regular whatever the keys look like. Small levels are checked more often
+// so that they do not overflow in between.
+static __thread uint64_t thread_inserts;
+
+static inline uint64_t check_mask(const vqf_filter *level) {
+   uint64_t interval = level->metadata.nslots / 256;
+   if (interval > 1024)
+      interval = 1024;
+   if (interval < 2)
+      return 0;
+   return (1ULL << (63 - __builtin_clzll(interval))) - 1;
+}
+
+vqf_expandable * vqf_expandable_init(uint64_t nslots, uint64_t tag_bits,
+      vqf_addressing addressing, double max_load) {
+   vqf_expandable *filter = (vqf_expandable *)calloc(1, sizeof(*filter));
+   if (filter == NULL)
+      return NULL;
+
+   filter->levels[0] = vqf_init(nslots, tag_bits, addressing);
+   if (filter->levels[0] == NULL) {
+      free(filter);
+      return NULL;
+   }
+   filter->nlevels = 1;
+   filter->nslots = nslots;
+   filter->tag_bits = tag_bits;
+   filter->addressing = addressing;
+   filter->max_load = max_load > 0 ? max_load : VQF_EXPANDABLE_DEFAULT_LOAD;
+   return filter;
+}
+
+void vqf_expandable_free(vqf_expandable *filter) {
+   if (filter == NULL)
+      return;
+   for (uint64_t i = 0; i < filter->nlevels; i++)
+      vqf_free(filter->levels[i]);
+   free(filter);
+}
+
+// Adds a level after the nlevels ones the caller saw, unless another thread
+// did already. One thread allocates while the others wait for the new
+// level to be published.
+static bool add_level(vqf_expandable *filter, uint64_t nlevels) {
+   while (__atomic_load_n(&filter->nlevels, __ATOMIC_ACQUIRE) == nlevels) {
+      if (__atomic_exchange_n(&filter->growing, 1, __ATOMIC_ACQUIRE) != 0) {
+         _mm_pause();
+         continue;
+      }
+      bool ok = true;
+      if (filter->nlevels == nlevels) {
+         vqf_filter *level = NULL;
+         if (nlevels < VQF_EXPANDABLE_MAX_LEVELS)
+            level = vqf_init(filter->nslots << nlevels, filter->tag_bits,
+                  (vqf_addressing)filter->addressing);
+         if (level != NULL) {
+            filter->levels[nlevels] = level;
+            __atomic_store_n(&filter->nlevels, nlevels + 1, __ATOMIC_RELEASE);
+         } else {
+            ok = false;
+         }
+      }
+      __atomic_store_n(&filter->growing, 0, __ATOMIC_RELEASE);
+      return ok;
+   }
+   return true;
+}
+
+bool vqf_expandable_insert(vqf_expandable *filter, uint64_t hash) {
+   while (true) {
+      uint64_t nlevels = __atomic_load_n(&filter->nlevels, __ATOMIC_ACQUIRE);
+      vqf_filter *level = filter->levels[nlevels - 1];
+      // a failed insert means both blocks of the hash are full, so the level
+      // is treated as full too
+      bool full = (thread_inserts++ & check_mask(level)) == 0 &&
+         vqf_load_factor(level) >= filter->max_load;
+      if (!full && vqf_insert(level, hash))
+         return true;
+      if (!add_level(filter, nlevels))
+         return false;
+   }
+}
+
+bool vqf_expandable_remove(vqf_expandable *filter, uint64_t hash) {
+   uint64_t nlevels = __atomic_load_n(&filter->nlevels, __ATOMIC_ACQUIRE);
+   for (uint64_t i = nlevels; i-- > 0; ) {
+      if (vqf_remove(filter->levels[i], hash))
+         return true;
+   }
+   return false;
+}
+
+bool vqf_expandable_is_present(vqf_expandable *filter, uint64_t hash) {
+   uint64_t nlevels = __atomic_load_n(&filter->nlevels, __ATOMIC_ACQUIRE);
+   for (uint64_t i = nlevels; i-- > 0; ) {
+      if (vqf_is_present(filter->levels[i], hash))
+         return true;
+   }
+   return false;
+}
+
+uint64_t vqf_expandable_size(const vqf_expandable *filter) {
+   uint64_t nlevels = __atomic_load_n(&filter->nlevels, __ATOMIC_ACQUIRE);
+   uint64_t size = 0;
+   for (uint64_t i = 0; i < nlevels; i++)
+      size += vqf_size(filter->levels[i]);
+   return size;
+}
+
+uint64_t vqf_expandable_memory(const vqf_expandable *filter) {
+   uint64_t nlevels = __atomic_load_n(&filter->nlevels, __ATOMIC_ACQUIRE);
+   uint64_t memory = sizeof(*filter);
+   for (uint64_t i = 0; i < nlevels; i++)
+      memory += filter->levels[i]->alloc_size;
+   return memory;
+}
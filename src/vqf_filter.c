@@ -9,7 +9,6 @@
  * ============================================================================
  */
 
-#include <algorithm>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
@@ -19,139 +18,182 @@
 #include <tmmintrin.h>
 
 #include "vqf_filter.h"
-#include "vqf_precompute.h"
-
-// ALT block check is set of 75% of the number of slots
-#if TAG_BITS == 8
-#define TAG_MASK 0xff
-#define QUQU_SLOTS_PER_BLOCK 48
-#define QUQU_BUCKETS_PER_BLOCK 80
-#define QUQU_CHECK_ALT 92
-#elif TAG_BITS == 12
-#define TAG_MASK 0xfff
-#define QUQU_SLOTS_PER_BLOCK 32
-#define QUQU_BUCKETS_PER_BLOCK 96
-#define QUQU_CHECK_ALT 104
-#elif TAG_BITS == 16
-#define TAG_MASK 0xffff
-#define QUQU_SLOTS_PER_BLOCK 28 
-#define QUQU_BUCKETS_PER_BLOCK 36
-#define QUQU_CHECK_ALT 43 
-#endif
+#include "vqf_block.h"
+#include "vqf_dispatch.h"
 
-#ifdef __AVX512BW__
-extern __m512i SHUFFLE [];
-extern __m512i SHUFFLE_REMOVE [];
-extern __m512i SHUFFLE16 [];
-extern __m512i SHUFFLE_REMOVE16 [];
-#endif
+// This file is compiled once per instruction set. vqf_block.h picks the
+// namespace of the build from the target flags, and everything here has
+// internal linkage or lives in that namespace, so the builds can be linked
+// together.
+namespace VQF_VARIANT {
+
+static inline uint64_t min_u64(uint64_t a, uint64_t b) {
+   return a < b ? a : b;
+}
 
 #define LOCK_MASK (1ULL << 63)
 #define UNLOCK_MASK ~(1ULL << 63)
 
-static inline void lock(vqf_block& block)
-{
+// A maplet keeps the value line of each block right after the block, so
+// its blocks are two lines apart and a get reads adjacent lines. The ops
+// carry the stride, as a select on metadata.value_bits compiles to an sbb
+// that chains every lookup to the block loads of the previous one.
+#define VQF_BLOCK_SHIFT 6
+#define VQF_MAPLET_BLOCK_SHIFT 7
+
+template <int TAG_BITS>
+struct vqf_block_array {
+   char *base;
+   uint64_t shift;
+
+   typename vqf_block_traits<TAG_BITS>::block& operator[](uint64_t index) const {
+      return *reinterpret_cast<typename vqf_block_traits<TAG_BITS>::block *>(base
+            + (index << shift));
+   }
+};
+
+template <int TAG_BITS>
+static inline vqf_block_array<TAG_BITS> get_blocks(const vqf_filter * restrict
+      filter) {
+   vqf_block_array<TAG_BITS> blocks = {(char *)filter->blocks,
+      filter->ops->block_shift};
+   return blocks;
+}
+
+static inline vqf_values * get_values(const vqf_filter * restrict filter,
+      uint64_t index) {
+   return (vqf_values *)((char *)filter->blocks + (index <<
+            VQF_MAPLET_BLOCK_SHIFT) + sizeof(vqf_block));
+}
+
 #ifdef ENABLE_THREADS
-   uint64_t *data;
-#if TAG_BITS == 8
-   data = block.md + 1;
-#elif TAG_BITS == 16
-   data = &block.md;
+// Fibonacci hashing of the line sends neighbouring blocks to stripes on
+// different cache lines, so writers of nearby blocks don't share one.
+static inline uint64_t *block_seqlock(const vqf_filter * restrict filter,
+      const void *block) {
+   uint64_t line = (uintptr_t)block / sizeof(vqf_block);
+   return &filter->seqlocks[(line * 0x9e3779b97f4a7c15ULL) >>
+      filter->seqlock_shift];
+}
 #endif
-   while ((__sync_fetch_and_or(data, LOCK_MASK) & (1ULL << 63)) != 0) {}
+
+#ifdef ENABLE_THREADS
+// Upper bound of the pauses between two looks at a held lock.
+#define VQF_LOCK_MAX_BACKOFF 1024
+
+#ifdef VQF_LOCK_STATS
+static inline void count_lock(vqf_filter * restrict filter, const uint64_t
+      *data, uint64_t spins, uint64_t wait) {
+   struct vqf_lock_counters *c = &filter->lock_counters[(uintptr_t)data /
+      sizeof(vqf_block) % VQF_LOCK_STAT_STRIPES];
+   __atomic_fetch_add(&c->acquisitions, 1, __ATOMIC_RELAXED);
+   if (spins == 0)
+      return;
+   __atomic_fetch_add(&c->spins, spins, __ATOMIC_RELAXED);
+   uint64_t max_wait = __atomic_load_n(&c->max_wait, __ATOMIC_RELAXED);
+   while (wait > max_wait && !__atomic_compare_exchange_n(&c->max_wait,
+            &max_wait, wait, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+#endif
+
+// Test-and-test-and-set: waiters watch the lock word with plain loads, which
+// hit their own cache, and only retry the atomic once the lock looks free.
+// The pauses between looks double up to VQF_LOCK_MAX_BACKOFF so that many
+// waiters on a hot block do not flood the interconnect.
+static __attribute__ ((noinline)) void lock_contended(vqf_filter * restrict
+      filter, uint64_t *data) {
+   uint64_t spins = 0;
+   uint32_t backoff = 1;
+#ifdef VQF_LOCK_STATS
+   uint64_t start = __rdtsc();
+#endif
+   do {
+      do {
+         for (uint32_t i = 0; i < backoff; i++)
+            _mm_pause();
+         if (backoff < VQF_LOCK_MAX_BACKOFF)
+            backoff <<= 1;
+         spins++;
+      } while ((__atomic_load_n(data, __ATOMIC_RELAXED) & LOCK_MASK) != 0);
+   } while ((__sync_fetch_and_or(data, LOCK_MASK) & LOCK_MASK) != 0);
+#ifdef VQF_LOCK_STATS
+   count_lock(filter, data, spins, __rdtsc() - start);
+#else
+   (void)filter;
+   (void)spins;
 #endif
 }
+#endif
 
-static inline void unlock(vqf_block& block)
+// Holding the lock of a block makes it a writer of the block's seqlock.
+template <int TAG_BITS>
+static inline void lock(vqf_filter * restrict filter, typename
+      vqf_block_traits<TAG_BITS>::block& block)
 {
 #ifdef ENABLE_THREADS
-   uint64_t *data;
-#if TAG_BITS == 8
-   data = block.md + 1;
-#elif TAG_BITS == 16
-   data = &block.md;
+   uint64_t *data = vqf_block_traits<TAG_BITS>::lock_word(&block);
+   // an uncontended lock takes a single atomic
+   if ((__sync_fetch_and_or(data, LOCK_MASK) & LOCK_MASK) != 0)
+      lock_contended(filter, data);
+#ifdef VQF_LOCK_STATS
+   else
+      count_lock(filter, data, 0, 0);
+#endif
+   __atomic_fetch_add(block_seqlock(filter, &block), 1, __ATOMIC_SEQ_CST);
 #endif
+}
+
+template <int TAG_BITS>
+static inline void unlock(vqf_filter * restrict filter, typename
+      vqf_block_traits<TAG_BITS>::block& block)
+{
+#ifdef ENABLE_THREADS
+   uint64_t *data = vqf_block_traits<TAG_BITS>::lock_word(&block);
+   // one writer less, one write more
+   __atomic_fetch_add(block_seqlock(filter, &block), VQF_SEQLOCK_WRITERS,
+         __ATOMIC_RELEASE);
    __sync_fetch_and_and(data, UNLOCK_MASK);
 #endif
 }
 
+template <int TAG_BITS>
 static inline void lock_blocks(vqf_filter * restrict filter, uint64_t index1, uint64_t index2)  {
 #ifdef ENABLE_THREADS
-   if (index1 < index2) {
-      lock(filter->blocks[index1/QUQU_BUCKETS_PER_BLOCK]);
-      lock(filter->blocks[index2/QUQU_BUCKETS_PER_BLOCK]);
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   if (index1 / traits::BUCKETS_PER_BLOCK == index2 / traits::BUCKETS_PER_BLOCK) {
+      lock<TAG_BITS>(filter, blocks[index1/traits::BUCKETS_PER_BLOCK]);
+   } else if (index1 < index2) {
+      lock<TAG_BITS>(filter, blocks[index1/traits::BUCKETS_PER_BLOCK]);
+      lock<TAG_BITS>(filter, blocks[index2/traits::BUCKETS_PER_BLOCK]);
    } else {
-      lock(filter->blocks[index2/QUQU_BUCKETS_PER_BLOCK]);
-      lock(filter->blocks[index1/QUQU_BUCKETS_PER_BLOCK]);
+      lock<TAG_BITS>(filter, blocks[index2/traits::BUCKETS_PER_BLOCK]);
+      lock<TAG_BITS>(filter, blocks[index1/traits::BUCKETS_PER_BLOCK]);
    }
 #endif
 }
 
+template <int TAG_BITS>
 static inline void unlock_blocks(vqf_filter * restrict filter, uint64_t index1, uint64_t index2)  {
 #ifdef ENABLE_THREADS
-   if (index1 < index2) {
-      unlock(filter->blocks[index1/QUQU_BUCKETS_PER_BLOCK]);
-      unlock(filter->blocks[index2/QUQU_BUCKETS_PER_BLOCK]);
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   if (index1 / traits::BUCKETS_PER_BLOCK == index2 / traits::BUCKETS_PER_BLOCK) {
+      unlock<TAG_BITS>(filter, blocks[index1/traits::BUCKETS_PER_BLOCK]);
+   } else if (index1 < index2) {
+      unlock<TAG_BITS>(filter, blocks[index1/traits::BUCKETS_PER_BLOCK]);
+      unlock<TAG_BITS>(filter, blocks[index2/traits::BUCKETS_PER_BLOCK]);
    } else {
-      unlock(filter->blocks[index2/QUQU_BUCKETS_PER_BLOCK]);
-      unlock(filter->blocks[index1/QUQU_BUCKETS_PER_BLOCK]);
+      unlock<TAG_BITS>(filter, blocks[index2/traits::BUCKETS_PER_BLOCK]);
+      unlock<TAG_BITS>(filter, blocks[index1/traits::BUCKETS_PER_BLOCK]);
    }
 #endif
 }
 
-static inline int word_rank(uint64_t val) {
-   return __builtin_popcountll(val);
-}
-
-// Returns the position of the rank'th 1.  (rank = 0 returns the 1st 1)
-// Returns 64 if there are fewer than rank+1 1s.
-static inline uint64_t word_select(uint64_t val, int rank) {
-   val = _pdep_u64(one[rank], val);
-   return _tzcnt_u64(val);
-}
-
-// select(vec, 0) -> -1
-// select(vec, i) -> 128, if i > popcnt(vec)
-static inline int64_t select_128_old(__uint128_t vector, uint64_t rank) {
-   uint64_t lower_word = vector & 0xffffffffffffffff;
-   uint64_t lower_pdep = _pdep_u64(one[rank], lower_word);
-   //uint64_t lower_select = word_select(lower_word, rank);
-   if (lower_pdep != 0) {
-      //assert(rank < word_rank(lower_word));
-      return _tzcnt_u64(lower_pdep);
-   }
-   rank = rank - word_rank(lower_word);
-   uint64_t higher_word = vector >> 64;
-   return word_select(higher_word, rank) + 64;
-}
-
-static inline uint64_t lookup_64(uint64_t vector, uint64_t rank) {
-   uint64_t lower_return = _pdep_u64(one[rank], vector) >> rank << (sizeof(uint64_t)/2);
-   return lower_return;
-}
-
-static inline uint64_t lookup_128(uint64_t *vector, uint64_t rank) {
-   uint64_t lower_word = vector[0];
-   uint64_t lower_rank = word_rank(lower_word);
-   uint64_t lower_return = _pdep_u64(one[rank], lower_word) >> rank << sizeof(__uint128_t);
-   int64_t higher_rank = (int64_t)rank - lower_rank;
-   uint64_t higher_word = vector[1];
-   uint64_t higher_return = _pdep_u64(one[higher_rank], higher_word);
-   higher_return <<= (64 + sizeof(__uint128_t) - rank);
-   return lower_return + higher_return;
-}
-
-static inline int64_t select_64(uint64_t vector, uint64_t rank) {
-   return _tzcnt_u64(lookup_64(vector, rank));
-}
-
-static inline int64_t select_128(uint64_t *vector, uint64_t rank) {
-   return _tzcnt_u64(lookup_128(vector, rank));
-}
-
 //assumes little endian
-#if TAG_BITS == 8
-void print_bits(__uint128_t num, int numbits)
+static inline void print_bits(__uint128_t num, int numbits)
 {
    int i;
    for (i = 0 ; i < numbits; i++) {
@@ -163,473 +205,1462 @@ void print_bits(__uint128_t num, int numbits)
    puts("");
 }
 
-void print_tags(uint8_t *tags, uint32_t size) {
-   for (uint8_t i = 0; i < size; i++)
-      printf("%d ", (uint32_t)tags[i]);
-   printf("\n");
-}
+template <int TAG_BITS>
+static void print_block(vqf_filter *filter, uint64_t block_index) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   typename traits::block *block = &get_blocks<TAG_BITS>(filter)[block_index];
 
-void print_block(vqf_filter *filter, uint64_t block_index) {
    printf("block index: %ld\n", block_index);
    printf("metadata: ");
-   uint64_t *md = filter->blocks[block_index].md;
-   print_bits(*(__uint128_t *)md, QUQU_BUCKETS_PER_BLOCK +
-         QUQU_SLOTS_PER_BLOCK);
+   print_bits(traits::metadata(block), traits::BUCKETS_PER_BLOCK +
+         traits::SLOTS_PER_BLOCK);
    printf("tags: ");
-   print_tags(filter->blocks[block_index].tags, QUQU_SLOTS_PER_BLOCK);
-}
-#elif TAG_BITS == 16
-void print_bits(uint64_t num, int numbits)
-{
-   int i;
-   for (i = 0 ; i < numbits; i++) {
-      if (i != 0 && i % 8 == 0) {
-         printf(":");
-      }
-      printf("%d", ((num >> i) & 1) == 1);
-   }
-   puts("");
-}
-void print_tags(uint16_t *tags, uint32_t size) {
-   for (uint8_t i = 0; i < size; i++)
-      printf("%d ", (uint32_t)tags[i]);
+   for (uint8_t i = 0; i < traits::SLOTS_PER_BLOCK; i++)
+      printf("%d ", (uint32_t)traits::get_tag(block, i));
    printf("\n");
 }
-void print_block(vqf_filter *filter, uint64_t block_index) {
-   printf("block index: %ld\n", block_index);
-   printf("metadata: ");
-   uint64_t md = filter->blocks[block_index].md;
-   print_bits(md, QUQU_BUCKETS_PER_BLOCK + QUQU_SLOTS_PER_BLOCK);
-   printf("tags: ");
-   print_tags(filter->blocks[block_index].tags, QUQU_SLOTS_PER_BLOCK);
-}
-#endif
-
-#ifdef __AVX512BW__
-#if TAG_BITS == 8
-static inline void update_tags_512(vqf_block * restrict block, uint8_t index, uint8_t tag) {
-   block->tags[47] = tag;	// add tag at the end
-
-   __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(block));
-   vector = _mm512_permutexvar_epi8(SHUFFLE[index], vector);
-   _mm512_storeu_si512(reinterpret_cast<__m512i*>(block), vector);
-}
-
-static inline void remove_tags_512(vqf_block * restrict block, uint8_t index) {
-   __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(block));
-   vector = _mm512_permutexvar_epi8(SHUFFLE_REMOVE[index], vector);
-   _mm512_storeu_si512(reinterpret_cast<__m512i*>(block), vector);
-}
-#elif TAG_BITS == 16
-static inline void update_tags_512(vqf_block * restrict block, uint8_t index, uint16_t tag) {
-   block->tags[27] = tag;	// add tag at the end
-
-   __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(block));
-   vector = _mm512_permutexvar_epi16(SHUFFLE16[index], vector);
-   _mm512_storeu_si512(reinterpret_cast<__m512i*>(block), vector);
-}
-
-static inline void remove_tags_512(vqf_block * restrict block, uint8_t index) {
-   __m512i vector = _mm512_loadu_si512(reinterpret_cast<__m512i*>(block));
-   vector = _mm512_permutexvar_epi16(SHUFFLE_REMOVE16[index], vector);
-   _mm512_storeu_si512(reinterpret_cast<__m512i*>(block), vector);
-}
-#endif
-#else
-#if TAG_BITS == 8
-static inline void update_tags_512(vqf_block * restrict block, uint8_t index, uint8_t tag) {
-   index -= 16;
-   memmove(&block->tags[index + 1], &block->tags[index], sizeof(block->tags) / sizeof(block->tags[0]) - index - 1);
-   block->tags[index] = tag;
-}
-
-static inline void remove_tags_512(vqf_block * restrict block, uint8_t index) {
-   index -= 16;
-   memmove(&block->tags[index], &block->tags[index+1], sizeof(block->tags) / sizeof(block->tags[0]) - index);
-}
-#elif TAG_BITS == 16
-static inline void update_tags_512(vqf_block * restrict block, uint8_t index, uint16_t tag) {
-   index -= 4;
-   memmove(&block->tags[index + 1], &block->tags[index], (sizeof(block->tags) / sizeof(block->tags[0]) - index - 1) * 2);
-   block->tags[index] = tag;
-}
-
-static inline void remove_tags_512(vqf_block * restrict block, uint8_t index) {
-   index -= 4;
-   memmove(&block->tags[index], &block->tags[index+1], (sizeof(block->tags) / sizeof(block->tags[0]) - index) * 2);
-}
-#endif
-#endif
-
-#if 0
-// Shuffle using AVX2 vector instruction. It turns out memmove is faster compared to AVX2.
-inline __m256i cross_lane_shuffle(const __m256i & value, const __m256i &
-      shuffle) 
-{ 
-   return _mm256_or_si256(_mm256_shuffle_epi8(value, _mm256_add_epi8(shuffle,
-               K[0])), 
-         _mm256_shuffle_epi8(_mm256_permute4x64_epi64(value, 0x4E),
-            _mm256_add_epi8(shuffle, K[1]))); 
-} 
-
-#define SHUFFLE_SIZE 32
-void shuffle_256(uint8_t * restrict source, __m256i shuffle) {
-   __m256i vector = _mm256_loadu_si256(reinterpret_cast<__m256i*>(source)); 
-
-   vector = cross_lane_shuffle(vector, shuffle); 
-   _mm256_storeu_si256(reinterpret_cast<__m256i*>(source), vector); 
-} 
-
-static inline void update_tags_256(uint8_t * restrict block, uint8_t index,
-      uint8_t tag) {
-   index = index + sizeof(__uint128_t);	// offset index based on md field.
-   block[63] = tag;	// add tag at the end
-   shuffle_256(block + SHUFFLE_SIZE, RM[index]); // right block shuffle
-   if (index < SHUFFLE_SIZE) {		// if index lies in the left block
-      std::swap(block[31], block[32]);	// move tag to the end of left block
-      shuffle_256(block, LM[index]);	// shuffle left block
-   }
-}
-#endif
-
-#if TAG_BITS == 8
-static inline void update_md(uint64_t *md, uint8_t index) {
-   uint64_t carry = (md[0] >> 63) & carry_pdep_table[index];
-   md[1] = _pdep_u64(md[1],         high_order_pdep_table[index]) | carry;
-   md[0] = _pdep_u64(md[0],         low_order_pdep_table[index]);
-}
-
-static inline void remove_md(uint64_t *md, uint8_t index) {
-   uint64_t carry = (md[1] & carry_pdep_table[index]) << 63;
-   md[1] = _pext_u64(md[1],  high_order_pdep_table[index]) | (1ULL << 63);
-   md[0] = _pext_u64(md[0],  low_order_pdep_table[index]) | carry;
-}
-
-// number of 0s in the metadata is the number of tags.
-static inline uint64_t get_block_free_space(uint64_t *vector) {
-   uint64_t lower_word = vector[0];
-   uint64_t higher_word = vector[1];
-   return word_rank(lower_word) + word_rank(higher_word);
-}
-#elif TAG_BITS == 16
-static inline void update_md(uint64_t *md, uint8_t index) {
-   *md = _pdep_u64(*md, low_order_pdep_table[index]);
-}
-
-static inline void remove_md(uint64_t *md, uint8_t index) {
-   *md = _pext_u64(*md, low_order_pdep_table[index]) | (1ULL << 63);
-}
-
-// number of 0s in the metadata is the number of tags.
-static inline uint64_t get_block_free_space(uint64_t vector) {
-   return word_rank(vector);
-}
-#endif
 
 // Create n/log(n) blocks of log(n) slots.
 // log(n) is 51 given a cache line size.
 // n/51 blocks.
-vqf_filter * vqf_init(uint64_t nslots) {
+template <int TAG_BITS>
+static vqf_filter * init_impl(uint64_t nslots, vqf_addressing addressing,
+      bool counting, uint64_t value_bits, const vqf_ops *ops) {
+   typedef vqf_block_traits<TAG_BITS> traits;
    vqf_filter *filter;
 
-   uint64_t total_blocks = (nslots + QUQU_SLOTS_PER_BLOCK)/QUQU_SLOTS_PER_BLOCK;
+   if (value_bits > traits::MAX_VALUE_BITS) {
+      fprintf(stderr, "Values of %d-bit tags must be at most %ld bits.\n",
+            TAG_BITS, traits::MAX_VALUE_BITS);
+      return NULL;
+   }
+
+   uint64_t total_blocks = (nslots + traits::SLOTS_PER_BLOCK)/traits::SLOTS_PER_BLOCK;
    uint64_t total_size_in_bytes = sizeof(vqf_block) * total_blocks;
+   if (value_bits != 0)
+      total_size_in_bytes += sizeof(vqf_values) * total_blocks;
 
-   filter = (vqf_filter *)malloc(sizeof(*filter) + total_size_in_bytes);
+   filter = vqf_alloc_filter(total_size_in_bytes);
+   if (filter == NULL)
+      return NULL;
    printf("Size: %ld\n",total_size_in_bytes);
-   assert(filter);
 
    filter->metadata.total_size_in_bytes = total_size_in_bytes;
-   filter->metadata.nslots = total_blocks * QUQU_SLOTS_PER_BLOCK;
-#if TAG_BITS == 8
-   filter->metadata.key_remainder_bits = 8;
-#elif TAG_BITS == 16
-   filter->metadata.key_remainder_bits = 16;
-#endif
-   filter->metadata.range = total_blocks * QUQU_BUCKETS_PER_BLOCK;
+   filter->metadata.nslots = total_blocks * traits::SLOTS_PER_BLOCK;
+   filter->metadata.key_remainder_bits = TAG_BITS;
+   filter->metadata.range = total_blocks * traits::BUCKETS_PER_BLOCK;
    //filter->metadata.range = total_blocks * QUQU_BUCKETS_PER_BLOCK * (1ULL << filter->metadata.key_remainder_bits);
    filter->metadata.nblocks = total_blocks;
    filter->metadata.nelts = 0;
+   filter->metadata.addressing = addressing;
+   filter->metadata.counting = counting;
+   filter->metadata.value_bits = value_bits;
+   filter->ops = ops;
    //printf("Range: %ld\n", filter->metadata.range);
 
    // memset to 1
-#if TAG_BITS == 8
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
    for (uint64_t i = 0; i < total_blocks; i++) {
-      filter->blocks[i].md[0] = UINT64_MAX;
-      filter->blocks[i].md[1] = UINT64_MAX;
-      // reset the most significant bit of metadata for locking.
-      filter->blocks[i].md[1] = filter->blocks[i].md[1] & ~(1ULL << 63);
+      traits::init(&blocks[i]);
+      if (value_bits != 0)
+         memset(get_values(filter, i), 0, sizeof(vqf_values));
    }
-#elif TAG_BITS == 16
-   for (uint64_t i = 0; i < total_blocks; i++) {
-      filter->blocks[i].md = UINT64_MAX;
-      filter->blocks[i].md = filter->blocks[i].md & ~(1ULL << 63);
-   }
-#endif
 
    return filter;
 }
 
-uint64_t alt_index(uint64_t index, uint64_t tag, uint64_t range) {
+static inline uint64_t alt_index(uint64_t index, uint64_t tag, uint64_t range) {
   return (uint64_t)(range - index + (tag * 0x5bd1e995)) % range;
 }
 
+// Division-free counterpart of alt_index. The tag picks a point in
+// [0, range) by multiply-shift and the alternate bucket is the reflection of
+// index around it, so applying it twice gives index back.
+static inline uint64_t alt_index_fastrange(uint64_t index, uint64_t tag,
+      uint64_t range) {
+   uint64_t point = ((__uint128_t)(tag * 0x9e3779b97f4a7c15ULL) * range) >> 64;
+   return index <= point ? point - index : point + range - index;
+}
+
+static inline uint64_t primary_index(const vqf_metadata * restrict metadata,
+      uint64_t hash) {
+   if (metadata->addressing == VQF_ADDRESSING_FASTRANGE) {
+      // Bits 32..47 of the hash form the tag, so the bucket is picked from the
+      // remaining 48 bits only.
+      uint64_t bits = (hash & 0xffff000000000000ULL) | ((hash & 0xffffffffULL) << 16);
+      return ((__uint128_t)bits * metadata->range) >> 64;
+   }
+   return hash % metadata->range;
+}
+
+static inline uint64_t alternate_index(const vqf_metadata * restrict metadata,
+      uint64_t index, uint64_t tag) {
+   if (metadata->addressing == VQF_ADDRESSING_FASTRANGE)
+      return alt_index_fastrange(index, tag, metadata->range);
+   return alt_index(index, tag, metadata->range);
+}
+
+// The tag of a hash comes from bits 32 and up. Tag 0 is taken as 1, so every
+// path that derives a tag must go through here.
+template <int TAG_BITS>
+static inline uint64_t key_tag(uint64_t hash) {
+   uint64_t tag = (hash >> 32) & vqf_block_traits<TAG_BITS>::TAG_MASK;
+   return tag + (tag == 0);
+}
+
+// Insert the tag at the end of the run of bucket offset in the block.
+// Returns the slot of the tag.
+template <int TAG_BITS>
+static inline uint64_t insert_tags(typename vqf_block_traits<TAG_BITS>::block *
+      restrict block, uint64_t tag, uint64_t offset) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+
+   uint64_t slot_index = select_slot<TAG_BITS>(block, offset);
+   uint64_t select_index = slot_index + offset - traits::TAG_OFFSET;
+
+   traits::update_tags(block, slot_index, tag);
+   traits::update_md(block, select_index);
+   return slot_index;
+}
+
 // If the item goes in the i'th slot (starting from 0) in the block then
 // find the i'th 0 in the metadata, insert a 1 after that and shift the rest
 // by 1 bit.
 // Insert the new tag at the end of its run and shift the rest by 1 slot.
-bool vqf_insert(vqf_filter * restrict filter, uint64_t hash) {
+// Maplets shift the values with it.
+template <int TAG_BITS, bool MAPLET>
+static bool insert_entry(vqf_filter * restrict filter, uint64_t hash,
+      uint64_t value) {
+   typedef vqf_block_traits<TAG_BITS> traits;
    vqf_metadata * restrict metadata           = &filter->metadata;
-   vqf_block    * restrict blocks             = filter->blocks;
-   uint64_t                 key_remainder_bits = metadata->key_remainder_bits;
-   uint64_t                 range              = metadata->range;
-
-   uint64_t block_index = hash % range;
-   lock(blocks[block_index/QUQU_BUCKETS_PER_BLOCK]);
-#if TAG_BITS == 8
-   uint64_t *block_md = blocks[block_index/QUQU_BUCKETS_PER_BLOCK].md;
-   uint64_t block_free = get_block_free_space(block_md);
-#elif TAG_BITS == 16
-   uint64_t *block_md = &blocks[block_index/QUQU_BUCKETS_PER_BLOCK].md;
-   uint64_t block_free = get_block_free_space(*block_md);
-#endif
-   uint64_t tag = (hash >> 32) & TAG_MASK; tag += (tag == 0);
-   uint64_t alt_block_index = alt_index(block_index, tag, range);
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   uint64_t block_index = primary_index(metadata, hash);
+   lock<TAG_BITS>(filter, blocks[block_index/traits::BUCKETS_PER_BLOCK]);
+   uint64_t block_free = traits::free_space(&blocks[block_index/traits::BUCKETS_PER_BLOCK]);
+   uint64_t tag = key_tag<TAG_BITS>(hash);
+   uint64_t alt_block_index = alternate_index(metadata, block_index, tag);
 
    //printf("Insertion: Hash: %llu Tag: %ld Prm: %ld Alt: %ld\n", hash, tag, block_index, alt_block_index);
    //assert(alt_index(alt_block_index, tag, range) == block_index);
 
-   __builtin_prefetch(&blocks[alt_block_index/QUQU_BUCKETS_PER_BLOCK]);
-
-   if (block_free < QUQU_CHECK_ALT && block_index/QUQU_BUCKETS_PER_BLOCK != alt_block_index/QUQU_BUCKETS_PER_BLOCK) {
-      unlock(blocks[block_index/QUQU_BUCKETS_PER_BLOCK]);
-      lock_blocks(filter, block_index, alt_block_index);
-#if TAG_BITS == 8
-      uint64_t *alt_block_md = blocks[alt_block_index/QUQU_BUCKETS_PER_BLOCK].md;
-      uint64_t alt_block_free = get_block_free_space(alt_block_md);
-#elif TAG_BITS == 16
-      uint64_t *alt_block_md = &blocks[alt_block_index/QUQU_BUCKETS_PER_BLOCK].md;
-      uint64_t alt_block_free = get_block_free_space(*alt_block_md);
-#endif
+   __builtin_prefetch(&blocks[alt_block_index/traits::BUCKETS_PER_BLOCK]);
+
+   if (block_free < traits::CHECK_ALT && block_index/traits::BUCKETS_PER_BLOCK != alt_block_index/traits::BUCKETS_PER_BLOCK) {
+      unlock<TAG_BITS>(filter, blocks[block_index/traits::BUCKETS_PER_BLOCK]);
+      lock_blocks<TAG_BITS>(filter, block_index, alt_block_index);
+      // other threads may have filled the primary block while it was unlocked
+      block_free = traits::free_space(&blocks[block_index/traits::BUCKETS_PER_BLOCK]);
+      uint64_t alt_block_free = traits::free_space(&blocks[alt_block_index/traits::BUCKETS_PER_BLOCK]);
       // pick the least loaded block
       if (alt_block_free > block_free) {
-         unlock(blocks[block_index/QUQU_BUCKETS_PER_BLOCK]);
+         unlock<TAG_BITS>(filter, blocks[block_index/traits::BUCKETS_PER_BLOCK]);
          block_index = alt_block_index;
-         block_md = alt_block_md;
-      } else if (block_free == QUQU_BUCKETS_PER_BLOCK) {
-         unlock_blocks(filter, block_index, alt_block_index);
-         fprintf(stderr, "vqf filter is full.");
-         return false;
-         //exit(EXIT_FAILURE);
+         block_free = alt_block_free;
       } else {
-         unlock(blocks[alt_block_index/QUQU_BUCKETS_PER_BLOCK]);
+         unlock<TAG_BITS>(filter, blocks[alt_block_index/traits::BUCKETS_PER_BLOCK]);
       }
 
    }
 
-   uint64_t index = block_index / QUQU_BUCKETS_PER_BLOCK;
-   uint64_t offset = block_index % QUQU_BUCKETS_PER_BLOCK;
+   // Both blocks are full, or the alternate block is the primary one.
+   if (block_free == traits::BUCKETS_PER_BLOCK) {
+      unlock<TAG_BITS>(filter, blocks[block_index/traits::BUCKETS_PER_BLOCK]);
+      fprintf(stderr, "vqf filter is full.");
+      return false;
+   }
 
-#if TAG_BITS == 8
-   uint64_t slot_index = select_128(block_md, offset);
-   uint64_t select_index = slot_index + offset - sizeof(__uint128_t);
-#elif TAG_BITS == 16
-   uint64_t slot_index = select_64(*block_md, offset);
-   uint64_t select_index = slot_index + offset - (sizeof(uint64_t)/2);
-#endif
-   /*printf("index: %ld tag: %ld offset: %ld\n", index, tag, offset);*/
-   /*print_block(filter, index);*/
+   uint64_t index = block_index / traits::BUCKETS_PER_BLOCK;
+   uint64_t offset = block_index % traits::BUCKETS_PER_BLOCK;
 
-   update_tags_512(&blocks[index], slot_index,tag);
-   update_md(block_md, select_index);
-   /*print_block(filter, index);*/
-   unlock(blocks[block_index/QUQU_BUCKETS_PER_BLOCK]);
+   /*printf("index: %ld tag: %ld offset: %ld\n", index, tag, offset);*/
+   /*print_block<TAG_BITS>(filter, index);*/
+   uint64_t slot = insert_tags<TAG_BITS>(&blocks[index], tag, offset);
+   if (MAPLET)
+      traits::update_values(get_values(filter, index), slot, value);
+   /*print_block<TAG_BITS>(filter, index);*/
+   unlock<TAG_BITS>(filter, blocks[block_index/traits::BUCKETS_PER_BLOCK]);
    return true;
 }
 
-static inline bool remove_tags(vqf_filter * restrict filter, uint64_t tag,
-      uint64_t block_index) {
-   uint64_t index = block_index / QUQU_BUCKETS_PER_BLOCK;
-   uint64_t offset = block_index % QUQU_BUCKETS_PER_BLOCK;
-
-#ifdef __AVX512BW__
-#if TAG_BITS == 8
-   __m512i bcast = _mm512_set1_epi8(tag);
-   __m512i block =
-      _mm512_loadu_si512(reinterpret_cast<__m512i*>(&filter->blocks[index]));
-   volatile __mmask64 result = _mm512_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);
-#elif TAG_BITS == 16
-   __m512i bcast = _mm512_set1_epi16(tag);
-   __m512i block =
-      _mm512_loadu_si512(reinterpret_cast<__m512i*>(&filter->blocks[index]));
-   volatile __mmask64 result = _mm512_cmp_epi16_mask(bcast, block, _MM_CMPINT_EQ);
-#endif
-#else
-#if TAG_BITS == 8
-   __m256i bcast = _mm256_set1_epi8(tag);
-   __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i*>(&filter->blocks[index]));
-   __m256i result1t = _mm256_cmpeq_epi8(bcast, block);
-   __mmask32 result1 = _mm256_movemask_epi8(result1t);
-   /*__mmask32 result1 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   block = _mm256_loadu_si256(reinterpret_cast<__m256i*>((uint8_t*)&filter->blocks[index]+32));
-   __m256i result2t = _mm256_cmpeq_epi8(bcast, block);
-   __mmask32 result2 = _mm256_movemask_epi8(result2t);
-   /*__mmask32 result2 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   uint64_t result = (uint64_t)result2 << 32 | (uint64_t)result1;
-#elif TAG_BITS == 16
-   uint64_t alt_mask = 0x55555555;
-   __m256i bcast = _mm256_set1_epi16(tag);
-   __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i*>(&filter->blocks[index]));
-   __m256i result1t = _mm256_cmpeq_epi16(bcast, block);
-   __mmask32 result1 = _mm256_movemask_epi8(result1t);
-   result1 = _pext_u32(result1, alt_mask);
-   /*__mmask32 result1 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   block = _mm256_loadu_si256(reinterpret_cast<__m256i*>((uint8_t*)&filter->blocks[index]+32));
-   __m256i result2t = _mm256_cmpeq_epi16(bcast, block);
-   __mmask32 result2 = _mm256_movemask_epi8(result2t);
-   result2 = _pext_u32(result2, alt_mask);
-   /*__mmask32 result2 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   uint64_t result = (uint64_t)result2 << 16 | (uint64_t)result1;
-#endif
-#endif
+template <int TAG_BITS>
+static bool insert_impl(vqf_filter * restrict filter, uint64_t hash) {
+   return insert_entry<TAG_BITS, false>(filter, hash, 0);
+}
+
+template <int TAG_BITS>
+static inline bool match_run(const typename vqf_block_traits<TAG_BITS>::block
+      *block, uint64_t tag, uint64_t offset) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+
+   uint64_t result = traits::match_tags(block, tag);
 
    if (result == 0) {
       // no matching tags, can bail
       return false;
    }
 
-#if TAG_BITS == 8
-   uint64_t start = offset != 0 ? lookup_128(filter->blocks[index].md, offset -
-         1) : one[0] << 2 * sizeof(uint64_t);
-   uint64_t end = lookup_128(filter->blocks[index].md, offset);
-#elif TAG_BITS == 16
-   uint64_t start = offset != 0 ? lookup_64(filter->blocks[index].md, offset -
-         1) : one[0] << (sizeof(uint64_t)/2);
-   uint64_t end = lookup_64(filter->blocks[index].md, offset);
+   uint64_t mask = run_mask<TAG_BITS>(block, offset);
+   return (mask & result) != 0;
+}
+
+// With threads the block is read optimistically and the read is retried if
+// a writer held the block meanwhile (see VQF_SEQLOCK_WRITERS).
+template <typename Block, typename Read>
+static inline auto read_block(const vqf_filter * restrict filter, const Block
+      *block, Read read) -> decltype(read()) {
+#ifdef ENABLE_THREADS
+   const uint64_t *seqlock = block_seqlock(filter, block);
+   while (true) {
+      uint64_t version = __atomic_load_n(seqlock, __ATOMIC_ACQUIRE);
+      if ((version & VQF_SEQLOCK_WRITERS) != 0) {
+         _mm_pause();
+         continue;
+      }
+      auto result = read();
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(seqlock, __ATOMIC_RELAXED) == version)
+         return result;
+   }
+#else
+   return read();
 #endif
-   uint64_t mask = end - start;
+}
+
+template <int TAG_BITS>
+static inline bool check_tags(vqf_filter * restrict filter, uint64_t tag,
+      uint64_t block_index) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   uint64_t index = block_index / traits::BUCKETS_PER_BLOCK;
+   uint64_t offset = block_index % traits::BUCKETS_PER_BLOCK;
+   const typename traits::block *block = &get_blocks<TAG_BITS>(filter)[index];
+
+   return read_block(filter, block, [&] {
+         return match_run<TAG_BITS>(block, tag, offset);
+   });
+}
+
+// Returns the slot of the removed tag, or 0 if the run has none.
+template <int TAG_BITS>
+static inline uint64_t remove_tags(typename vqf_block_traits<TAG_BITS>::block *
+      restrict block_ptr, uint64_t tag, uint64_t offset) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+
+   uint64_t result = traits::match_tags(block_ptr, tag);
+
+   if (result == 0) {
+      // no matching tags, can bail
+      return 0;
+   }
+
+   uint64_t mask = run_mask<TAG_BITS>(block_ptr, offset);
 
    uint64_t check_indexes = mask & result;
    if (check_indexes != 0) { // remove the first available tag
-      vqf_block    * restrict blocks             = filter->blocks;
       uint64_t remove_index = __builtin_ctzll(check_indexes);
-      remove_tags_512(&blocks[index], remove_index);
-#if TAG_BITS == 8
-      remove_index = remove_index + offset - sizeof(__uint128_t);
-      uint64_t *block_md = blocks[block_index / QUQU_BUCKETS_PER_BLOCK].md;
-      remove_md(block_md, remove_index);
-#elif TAG_BITS == 16
-      remove_index = remove_index + offset - sizeof(uint64_t);
-      uint64_t *block_md = &blocks[block_index / QUQU_BUCKETS_PER_BLOCK].md;
-      remove_md(block_md, remove_index);
-#endif
-      return true;
+      traits::remove_tags(block_ptr, remove_index);
+      traits::remove_md(block_ptr, remove_index + offset - traits::TAG_OFFSET);
+      return remove_index;
    } else
-      return false;
+      return 0;
 }
 
-bool vqf_remove(vqf_filter * restrict filter, uint64_t hash) {
+template <int TAG_BITS, bool MAPLET = false>
+static bool remove_impl(vqf_filter * restrict filter, uint64_t hash) {
+   typedef vqf_block_traits<TAG_BITS> traits;
    vqf_metadata * restrict metadata           = &filter->metadata;
-   uint64_t                 key_remainder_bits = metadata->key_remainder_bits;
-   uint64_t                 range              = metadata->range;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
 
-   uint64_t block_index = hash % range;
-   uint64_t tag = (hash >> 32) & TAG_MASK; tag += (tag == 0);
-   uint64_t alt_block_index = alt_index(block_index, tag, range);
+   uint64_t block_index = primary_index(metadata, hash);
+   uint64_t tag = key_tag<TAG_BITS>(hash);
+   uint64_t alt_block_index = alternate_index(metadata, block_index, tag);
    //uint64_t alt_block_index = ((block_index ^ (tag * 0x5bd1e995)) % range);
    //printf("Removal: Hash: %llu Tag: %ld Prm: %ld Alt: %ld\n", hash, tag, block_index, alt_block_index);
 
-   __builtin_prefetch(&filter->blocks[alt_block_index / QUQU_BUCKETS_PER_BLOCK]);
-
-   return remove_tags(filter, tag, block_index) || remove_tags(filter, tag, alt_block_index);
-}
+   __builtin_prefetch(&blocks[alt_block_index / traits::BUCKETS_PER_BLOCK]);
 
-static inline bool check_tags(vqf_filter * restrict filter, uint64_t tag,
-      uint64_t block_index) {
-   uint64_t index = block_index / QUQU_BUCKETS_PER_BLOCK;
-   uint64_t offset = block_index % QUQU_BUCKETS_PER_BLOCK;
-
-#ifdef __AVX512BW__
-#if TAG_BITS == 8
-   __m512i bcast = _mm512_set1_epi8(tag);
-   __m512i block =
-      _mm512_loadu_si512(reinterpret_cast<__m512i*>(&filter->blocks[index]));
-   volatile __mmask64 result = _mm512_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);
-#elif TAG_BITS == 16
-   __m512i bcast = _mm512_set1_epi16(tag);
-   __m512i block =
-      _mm512_loadu_si512(reinterpret_cast<__m512i*>(&filter->blocks[index]));
-   volatile __mmask64 result = _mm512_cmp_epi16_mask(bcast, block, _MM_CMPINT_EQ);
-#endif
-#else
-#if TAG_BITS == 8
-   __m256i bcast = _mm256_set1_epi8(tag);
-   __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i*>(&filter->blocks[index]));
-   __m256i result1t = _mm256_cmpeq_epi8(bcast, block);
-   __mmask32 result1 = _mm256_movemask_epi8(result1t);
-   /*__mmask32 result1 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   block = _mm256_loadu_si256(reinterpret_cast<__m256i*>((uint8_t*)&filter->blocks[index]+32));
-   __m256i result2t = _mm256_cmpeq_epi8(bcast, block);
-   __mmask32 result2 = _mm256_movemask_epi8(result2t);
-   /*__mmask32 result2 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   uint64_t result = (uint64_t)result2 << 32 | (uint64_t)result1;
-#elif TAG_BITS == 16
-   uint64_t alt_mask = 0x55555555;
-   __m256i bcast = _mm256_set1_epi16(tag);
-   __m256i block = _mm256_loadu_si256(reinterpret_cast<__m256i*>(&filter->blocks[index]));
-   __m256i result1t = _mm256_cmpeq_epi16(bcast, block);
-   __mmask32 result1 = _mm256_movemask_epi8(result1t);
-   result1 = _pext_u32(result1, alt_mask);
-   /*__mmask32 result1 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   block = _mm256_loadu_si256(reinterpret_cast<__m256i*>((uint8_t*)&filter->blocks[index]+32));
-   __m256i result2t = _mm256_cmpeq_epi16(bcast, block);
-   __mmask32 result2 = _mm256_movemask_epi8(result2t);
-   result2 = _pext_u32(result2, alt_mask);
-   /*__mmask32 result2 = _mm256_cmp_epi8_mask(bcast, block, _MM_CMPINT_EQ);*/
-   uint64_t result = (uint64_t)result2 << 16 | (uint64_t)result1;
-#endif
+#ifdef ENABLE_THREADS
+   // Most removes of absent keys are settled by the tag compare alone, so
+   // probe both blocks like a lookup before taking any lock. Tags never move
+   // between blocks, so a miss of both probes is a miss of the key.
+   if (!check_tags<TAG_BITS>(filter, tag, block_index) &&
+         !check_tags<TAG_BITS>(filter, tag, alt_block_index))
+      return false;
 #endif
 
-   if (result == 0) {
-      // no matching tags, can bail
-      return false;
+   lock_blocks<TAG_BITS>(filter, block_index, alt_block_index);
+   uint64_t index = block_index / traits::BUCKETS_PER_BLOCK;
+   uint64_t slot = remove_tags<TAG_BITS>(&blocks[index], tag, block_index %
+         traits::BUCKETS_PER_BLOCK);
+   if (slot == 0) {
+      index = alt_block_index / traits::BUCKETS_PER_BLOCK;
+      slot = remove_tags<TAG_BITS>(&blocks[index], tag, alt_block_index %
+            traits::BUCKETS_PER_BLOCK);
    }
-
-#if TAG_BITS == 8
-   uint64_t start = offset != 0 ? lookup_128(filter->blocks[index].md, offset -
-         1) : one[0] << 2 * sizeof(uint64_t);
-   uint64_t end = lookup_128(filter->blocks[index].md, offset);
-#elif TAG_BITS == 16
-   uint64_t start = offset != 0 ? lookup_64(filter->blocks[index].md, offset -
-         1) : one[0] << (sizeof(uint64_t)/2);
-   uint64_t end = lookup_64(filter->blocks[index].md, offset);
-#endif
-   uint64_t mask = end - start;
-   return (mask & result) != 0;
+   if (MAPLET && slot != 0)
+      traits::remove_values(get_values(filter, index), slot);
+   unlock_blocks<TAG_BITS>(filter, block_index, alt_block_index);
+   return slot != 0;
 }
 
 // If the item goes in the i'th slot (starting from 0) in the block then
 // select(i) - i is the slot index for the end of the run.
-bool vqf_is_present(vqf_filter * restrict filter, uint64_t hash) {
+template <int TAG_BITS>
+static bool is_present_impl(vqf_filter * restrict filter, uint64_t hash) {
+   typedef vqf_block_traits<TAG_BITS> traits;
    vqf_metadata * restrict metadata           = &filter->metadata;
-   //vqf_block    * restrict blocks             = filter->blocks;
-   uint64_t                 key_remainder_bits = metadata->key_remainder_bits;
-   uint64_t                 range              = metadata->range;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
 
-   uint64_t block_index = hash % range;
-   uint64_t tag = (hash >> 32) & TAG_MASK; tag += (tag == 0);
+   uint64_t block_index = primary_index(metadata, hash);
+   uint64_t tag = key_tag<TAG_BITS>(hash);
    //uint64_t alt_block_index = ((block_index ^ (tag * 0x5bd1e995)) % range);
-   uint64_t alt_block_index = alt_index(block_index, tag, range);
+   uint64_t alt_block_index = alternate_index(metadata, block_index, tag);
    //printf("Query: Hash: %llu Tag: %ld Prm: %ld Alt: %ld\n", hash, tag, block_index, alt_block_index);
 
-   __builtin_prefetch(&filter->blocks[alt_block_index / QUQU_BUCKETS_PER_BLOCK]);
+   __builtin_prefetch(&blocks[alt_block_index / traits::BUCKETS_PER_BLOCK]);
 
-   return check_tags(filter, tag, block_index) || check_tags(filter, tag, alt_block_index);
+   return check_tags<TAG_BITS>(filter, tag, block_index) ||
+      check_tags<TAG_BITS>(filter, tag, alt_block_index);
 
    /*if (!ret) {*/
    /*printf("tag: %ld offset: %ld\n", tag, block_index % QUQU_SLOTS_PER_BLOCK);*/
-   /*print_block(filter, block_index / QUQU_SLOTS_PER_BLOCK);*/
-   /*print_block(filter, alt_block_index / QUQU_SLOTS_PER_BLOCK);*/
+   /*print_block<TAG_BITS>(filter, block_index / QUQU_SLOTS_PER_BLOCK);*/
+   /*print_block<TAG_BITS>(filter, alt_block_index / QUQU_SLOTS_PER_BLOCK);*/
    /*}*/
 }
 
+template <int TAG_BITS>
+static vqf_placement placement_impl(vqf_filter * restrict filter, uint64_t
+      hash) {
+   vqf_metadata * restrict metadata           = &filter->metadata;
+
+   uint64_t block_index = primary_index(metadata, hash);
+   uint64_t tag = key_tag<TAG_BITS>(hash);
+   uint64_t alt_block_index = alternate_index(metadata, block_index, tag);
+
+   if (check_tags<TAG_BITS>(filter, tag, block_index))
+      return VQF_PLACEMENT_PRIMARY;
+   if (check_tags<TAG_BITS>(filter, tag, alt_block_index))
+      return VQF_PLACEMENT_ALTERNATE;
+   return VQF_PLACEMENT_NONE;
+}
+
+// Batched lookups run as one pipeline over the whole batch. The block
+// indexes of a key are computed and its primary and alternate blocks are
+// prefetched VQF_PREFETCH_DISTANCE keys ahead of the key whose tags are being
+// checked, so that the DRAM misses of several keys overlap. The indexes of
+// the keys in flight wait in a ring of VQF_PREFETCH_DISTANCE entries.
+#define VQF_PREFETCH_DISTANCE 16
+
+template <int TAG_BITS>
+static inline void prefetch_lookup(const vqf_block_array<TAG_BITS>& blocks,
+      const vqf_metadata
+      * restrict metadata, uint64_t hash, uint64_t *block_index, uint64_t
+      *alt_block_index, uint64_t *tag) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   *tag = key_tag<TAG_BITS>(hash);
+   *block_index = primary_index(metadata, hash);
+   *alt_block_index = alternate_index(metadata, *block_index, *tag);
+   __builtin_prefetch(&blocks[*block_index / traits::BUCKETS_PER_BLOCK]);
+   __builtin_prefetch(&blocks[*alt_block_index / traits::BUCKETS_PER_BLOCK]);
+}
+
+template <int TAG_BITS>
+static uint64_t is_present_batch_impl(vqf_filter * restrict filter, const
+      uint64_t * restrict hashes, uint64_t nhashes, bool * restrict results) {
+   vqf_metadata * restrict metadata           = &filter->metadata;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   uint64_t block_indexes[VQF_PREFETCH_DISTANCE];
+   uint64_t alt_block_indexes[VQF_PREFETCH_DISTANCE];
+   uint64_t tags[VQF_PREFETCH_DISTANCE];
+   uint64_t npositives = 0;
+
+   uint64_t nahead = min_u64(VQF_PREFETCH_DISTANCE, nhashes);
+   for (uint64_t i = 0; i < nahead; i++)
+      prefetch_lookup<TAG_BITS>(blocks, metadata, hashes[i], &block_indexes[i],
+            &alt_block_indexes[i], &tags[i]);
+
+   for (uint64_t i = 0; i < nhashes; i++) {
+      uint64_t slot = i % VQF_PREFETCH_DISTANCE;
+      bool ret = check_tags<TAG_BITS>(filter, tags[slot], block_indexes[slot]) ||
+         check_tags<TAG_BITS>(filter, tags[slot], alt_block_indexes[slot]);
+      results[i] = ret;
+      npositives += ret;
+      // the checked key's entry is free for the key that enters the pipeline
+      if (i + VQF_PREFETCH_DISTANCE < nhashes)
+         prefetch_lookup<TAG_BITS>(blocks, metadata, hashes[i +
+               VQF_PREFETCH_DISTANCE], &block_indexes[slot],
+               &alt_block_indexes[slot], &tags[slot]);
+   }
+
+   return npositives;
+}
+
+// Batched updates are applied in windows of VQF_BATCH_WINDOW keys. The keys
+// of a window are sorted by block, so every touched block is locked and
+// loaded once per window and the blocks are visited in address order.
+#define VQF_BATCH_WINDOW (1ULL << 16)
+#define VQF_RADIX_BITS 11
+
+typedef struct vqf_batch_item {
+   uint64_t block_index;
+   uint64_t hash;
+   uint64_t pos;
+} vqf_batch_item;
+
+// LSD radix sort of the batch items by block number. Returns whichever of
+// items and tmp holds the sorted sequence.
+template <int TAG_BITS>
+static vqf_batch_item * sort_by_block(vqf_batch_item * restrict items,
+      vqf_batch_item * restrict tmp, uint64_t nitems, uint64_t nblocks) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   uint64_t counts[1ULL << VQF_RADIX_BITS];
+
+   for (uint64_t shift = 0; shift < 64 && ((nblocks - 1) >> shift) != 0;
+         shift += VQF_RADIX_BITS) {
+      memset(counts, 0, sizeof(counts));
+      for (uint64_t i = 0; i < nitems; i++)
+         counts[(items[i].block_index / traits::BUCKETS_PER_BLOCK >> shift) & ((1ULL << VQF_RADIX_BITS) - 1)]++;
+      uint64_t sum = 0;
+      for (uint64_t d = 0; d < (1ULL << VQF_RADIX_BITS); d++) {
+         uint64_t count = counts[d];
+         counts[d] = sum;
+         sum += count;
+      }
+      for (uint64_t i = 0; i < nitems; i++)
+         tmp[counts[(items[i].block_index / traits::BUCKETS_PER_BLOCK >> shift) & ((1ULL << VQF_RADIX_BITS) - 1)]++] =
+            items[i];
+      vqf_batch_item *sorted = tmp;
+      tmp = items;
+      items = sorted;
+   }
+
+   return items;
+}
+
+// Computes the primary block of every hash and sorts the hashes by it.
+// scratch must have room for 2 * nhashes items.
+template <int TAG_BITS>
+static vqf_batch_item * group_by_block(vqf_filter * restrict filter, const
+      uint64_t * restrict hashes, uint64_t nhashes, vqf_batch_item * restrict
+      scratch) {
+   for (uint64_t i = 0; i < nhashes; i++) {
+      scratch[i].block_index = primary_index(&filter->metadata, hashes[i]);
+      scratch[i].hash = hashes[i];
+      scratch[i].pos = i;
+   }
+
+   return sort_by_block<TAG_BITS>(scratch, scratch + nhashes, nhashes,
+         filter->metadata.nblocks);
+}
+
+// Locks the alternate block while the block of the current batch group,
+// held in the working copy cur, is locked. Blocks are always locked in
+// increasing order, so the group block may have to be written back,
+// released and reacquired.
+template <int TAG_BITS>
+static inline void lock_alt_block(vqf_filter * restrict filter, typename
+      vqf_block_traits<TAG_BITS>::block * restrict cur, uint64_t index,
+      uint64_t alt_block) {
+#ifdef ENABLE_THREADS
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   if (alt_block > index) {
+      lock<TAG_BITS>(filter, blocks[alt_block]);
+   } else {
+      blocks[index] = *cur;
+      unlock<TAG_BITS>(filter, blocks[index]);
+      lock<TAG_BITS>(filter, blocks[alt_block]);
+      lock<TAG_BITS>(filter, blocks[index]);
+      *cur = blocks[index];
+   }
+#endif
+}
+
+// Each block is locked once and updated in a working copy that is written
+// back when all the keys of the block are applied. The two-choice decision
+// sees the effect of all the keys applied before it.
+template <int TAG_BITS>
+static uint64_t insert_sorted(vqf_filter * restrict filter, const
+      vqf_batch_item * restrict items, uint64_t nitems, bool * restrict
+      results) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_metadata * restrict metadata           = &filter->metadata;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   uint64_t nfailures = 0;
+   for (uint64_t i = 0; i < nitems; ) {
+      uint64_t index = items[i].block_index / traits::BUCKETS_PER_BLOCK;
+      uint64_t group_end = i;
+      while (group_end < nitems && items[group_end].block_index /
+            traits::BUCKETS_PER_BLOCK == index)
+         group_end++;
+      if (group_end + VQF_PREFETCH_DISTANCE < nitems)
+         __builtin_prefetch(&blocks[items[group_end +
+               VQF_PREFETCH_DISTANCE].block_index / traits::BUCKETS_PER_BLOCK]);
+
+      lock<TAG_BITS>(filter, blocks[index]);
+      typename traits::block cur = blocks[index];
+
+      for (; i < group_end; i++) {
+         uint64_t hash = items[i].hash;
+         uint64_t block_index = items[i].block_index;
+         uint64_t tag = key_tag<TAG_BITS>(hash);
+         uint64_t alt_block_index = alternate_index(metadata, block_index, tag);
+         uint64_t alt_block = alt_block_index / traits::BUCKETS_PER_BLOCK;
+
+         uint64_t block_free = traits::free_space(&cur);
+         bool inserted = false;
+         if (block_free < traits::CHECK_ALT && alt_block != index) {
+            lock_alt_block<TAG_BITS>(filter, &cur, index, alt_block);
+            block_free = traits::free_space(&cur);
+            uint64_t alt_block_free = traits::free_space(&blocks[alt_block]);
+            // pick the least loaded block
+            if (alt_block_free > block_free) {
+               insert_tags<TAG_BITS>(&blocks[alt_block], tag, alt_block_index %
+                     traits::BUCKETS_PER_BLOCK);
+               inserted = true;
+            }
+            unlock<TAG_BITS>(filter, blocks[alt_block]);
+         }
+         if (!inserted && block_free != traits::BUCKETS_PER_BLOCK) {
+            insert_tags<TAG_BITS>(&cur, tag, block_index % traits::BUCKETS_PER_BLOCK);
+            inserted = true;
+         }
+
+         results[items[i].pos] = inserted;
+         nfailures += !inserted;
+      }
+
+      blocks[index] = cur;
+      unlock<TAG_BITS>(filter, blocks[index]);
+   }
+
+   return nfailures;
+}
+
+template <int TAG_BITS>
+static uint64_t remove_sorted(vqf_filter * restrict filter, const
+      vqf_batch_item * restrict items, uint64_t nitems, bool * restrict
+      results) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_metadata * restrict metadata           = &filter->metadata;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+
+   uint64_t nfailures = 0;
+   for (uint64_t i = 0; i < nitems; ) {
+      uint64_t index = items[i].block_index / traits::BUCKETS_PER_BLOCK;
+      uint64_t group_end = i;
+      while (group_end < nitems && items[group_end].block_index /
+            traits::BUCKETS_PER_BLOCK == index)
+         group_end++;
+      if (group_end + VQF_PREFETCH_DISTANCE < nitems)
+         __builtin_prefetch(&blocks[items[group_end +
+               VQF_PREFETCH_DISTANCE].block_index / traits::BUCKETS_PER_BLOCK]);
+
+      lock<TAG_BITS>(filter, blocks[index]);
+      typename traits::block cur = blocks[index];
+
+      for (; i < group_end; i++) {
+         uint64_t hash = items[i].hash;
+         uint64_t block_index = items[i].block_index;
+         uint64_t tag = key_tag<TAG_BITS>(hash);
+         uint64_t alt_block_index = alternate_index(metadata, block_index, tag);
+         uint64_t alt_block = alt_block_index / traits::BUCKETS_PER_BLOCK;
+
+         bool removed = remove_tags<TAG_BITS>(&cur, tag, block_index %
+               traits::BUCKETS_PER_BLOCK);
+         if (!removed) {
+            if (alt_block != index) {
+               lock_alt_block<TAG_BITS>(filter, &cur, index, alt_block);
+               removed = remove_tags<TAG_BITS>(&blocks[alt_block], tag,
+                     alt_block_index % traits::BUCKETS_PER_BLOCK);
+               unlock<TAG_BITS>(filter, blocks[alt_block]);
+            } else {
+               removed = remove_tags<TAG_BITS>(&cur, tag, alt_block_index %
+                     traits::BUCKETS_PER_BLOCK);
+            }
+         }
+
+         results[items[i].pos] = removed;
+         nfailures += !removed;
+      }
+
+      blocks[index] = cur;
+      unlock<TAG_BITS>(filter, blocks[index]);
+   }
+
+   return nfailures;
+}
+
+template <int TAG_BITS>
+static uint64_t insert_batch_impl(vqf_filter * restrict filter, const
+      uint64_t * restrict hashes, uint64_t nhashes, bool * restrict results) {
+   uint64_t window = min_u64(nhashes, VQF_BATCH_WINDOW);
+   vqf_batch_item *scratch = (vqf_batch_item *)malloc(2 * window *
+         sizeof(vqf_batch_item));
+   uint64_t nfailures = 0;
+
+   if (scratch == NULL) {
+      for (uint64_t i = 0; i < nhashes; i++) {
+         results[i] = insert_impl<TAG_BITS>(filter, hashes[i]);
+         nfailures += !results[i];
+      }
+      return nfailures;
+   }
+
+   for (uint64_t base = 0; base < nhashes; base += window) {
+      uint64_t nitems = min_u64(window, nhashes - base);
+      vqf_batch_item *items = group_by_block<TAG_BITS>(filter, hashes + base,
+            nitems, scratch);
+      nfailures += insert_sorted<TAG_BITS>(filter, items, nitems, results +
+            base);
+   }
+
+   free(scratch);
+   return nfailures;
+}
+
+template <int TAG_BITS>
+static uint64_t remove_batch_impl(vqf_filter * restrict filter, const
+      uint64_t * restrict hashes, uint64_t nhashes, bool * restrict results) {
+   uint64_t window = min_u64(nhashes, VQF_BATCH_WINDOW);
+   vqf_batch_item *scratch = (vqf_batch_item *)malloc(2 * window *
+         sizeof(vqf_batch_item));
+   uint64_t nfailures = 0;
+
+   if (scratch == NULL) {
+      for (uint64_t i = 0; i < nhashes; i++) {
+         results[i] = remove_impl<TAG_BITS>(filter, hashes[i]);
+         nfailures += !results[i];
+      }
+      return nfailures;
+   }
+
+   for (uint64_t base = 0; base < nhashes; base += window) {
+      uint64_t nitems = min_u64(window, nhashes - base);
+      vqf_batch_item *items = group_by_block<TAG_BITS>(filter, hashes + base,
+            nitems, scratch);
+      nfailures += remove_sorted<TAG_BITS>(filter, items, nitems, results +
+            base);
+   }
+
+   free(scratch);
+   return nfailures;
+}
+
+// Union and intersection of filters with the same geometry. A tag at bucket
+// r of a filter is at bucket r or at its alternate bucket in the other, so
+// blocks are merged pairwise: block i of the result gets the runs of block i
+// of a followed by those of b, bucket by bucket. Entries are enumerated from
+// the 0s of the metadata, where the k'th 0 at position p is slot k of
+// bucket p - k, and the tags are gathered from both blocks at once by
+// merge_tags.
+static inline uint64_t ctz_128(__uint128_t x) {
+   uint64_t low = x;
+   return low != 0 ? __builtin_ctzll(low) : 64 + __builtin_ctzll(x >> 64);
+}
+
+// The 0s of the metadata of block, one per tag. The top bit is the lock,
+// which takes one slot.
+template <int TAG_BITS>
+static inline __uint128_t used_slots(const typename
+      vqf_block_traits<TAG_BITS>::block *block) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   const uint64_t md_bits = traits::BUCKETS_PER_BLOCK + traits::SLOTS_PER_BLOCK - 1;
+   return ~traits::metadata(block) & (((__uint128_t)1 << md_bits) - 1);
+}
+
+static inline void push_spill(vqf_spills *spills, uint64_t entry) {
+   if (spills->n == spills->size) {
+      uint64_t size = spills->size != 0 ? 2 * spills->size : 1024;
+      uint64_t *entries = (uint64_t *)realloc(spills->entries, size *
+            sizeof(entries[0]));
+      if (entries == NULL) {
+         spills->nlost++;
+         return;
+      }
+      spills->entries = entries;
+      spills->size = size;
+   }
+   spills->entries[spills->n++] = entry;
+}
+
+// Merges blocks [begin, end) of a and b into dst and returns the number of
+// tags written. A union takes all the tags of a and those of b that fit, and
+// adds the others to spills. An intersection takes the tags of a that b has
+// in either of their buckets.
+template <int TAG_BITS>
+static uint64_t merge_blocks_impl(vqf_filter *dst, const vqf_filter *a, const
+      vqf_filter *b, uint64_t begin, uint64_t end, bool intersect, vqf_spills
+      *spills) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   typedef typename traits::block block;
+   // The top bit of the metadata is the lock, which takes one slot.
+   const uint64_t md_bits = traits::BUCKETS_PER_BLOCK + traits::SLOTS_PER_BLOCK - 1;
+   const uint64_t capacity = traits::SLOTS_PER_BLOCK - 1;
+   const __uint128_t md_mask = ((__uint128_t)1 << md_bits) - 1;
+   const block *a_blocks = reinterpret_cast<const block *>(a->blocks);
+   const block *b_blocks = reinterpret_cast<const block *>(b->blocks);
+   vqf_block_array<TAG_BITS> dst_blocks = get_blocks<TAG_BITS>(dst);
+   uint64_t nentries = 0;
+
+   for (uint64_t i = begin; i < end; i++) {
+      const block *ba = &a_blocks[i], *bb = &b_blocks[i];
+      __uint128_t a_slots = used_slots<TAG_BITS>(ba);
+      __uint128_t b_slots = intersect ? 0 : used_slots<TAG_BITS>(bb);
+      uint64_t b_room = capacity - __builtin_popcountll(a_slots) -
+         __builtin_popcountll(a_slots >> 64);
+      uint64_t ka = 0, kb = 0, n = 0;
+      __uint128_t md = md_mask;
+      uint8_t src[64];
+
+      while ((a_slots | b_slots) != 0) {
+         uint64_t ra = a_slots != 0 ? ctz_128(a_slots) - ka : UINT64_MAX;
+         uint64_t rb = b_slots != 0 ? ctz_128(b_slots) - kb : UINT64_MAX;
+         if (ra <= rb) {
+            uint64_t slot = traits::TAG_OFFSET + ka++;
+            a_slots &= a_slots - 1;
+            if (intersect) {
+               uint64_t bucket = i * traits::BUCKETS_PER_BLOCK + ra;
+               uint64_t tag = traits::get_tag(ba, slot - traits::TAG_OFFSET);
+               uint64_t alt_bucket = alternate_index(&b->metadata, bucket, tag);
+               if (!match_run<TAG_BITS>(bb, tag, ra) &&
+                     !match_run<TAG_BITS>(&b_blocks[alt_bucket /
+                        traits::BUCKETS_PER_BLOCK], tag, alt_bucket %
+                        traits::BUCKETS_PER_BLOCK))
+                  continue;
+            }
+            md &= ~((__uint128_t)1 << (n + ra));
+            src[n++] = slot;
+         } else {
+            uint64_t slot = traits::TAG_OFFSET + kb++;
+            b_slots &= b_slots - 1;
+            if (b_room == 0) {
+               push_spill(spills, (i * traits::BUCKETS_PER_BLOCK + rb) << 16 |
+                     traits::get_tag(bb, slot - traits::TAG_OFFSET));
+               continue;
+            }
+            b_room--;
+            md &= ~((__uint128_t)1 << (n + rb));
+            src[n++] = slot | 0x80;
+         }
+      }
+
+      // dst may be a or b, so the block is built aside.
+      block out;
+      memset(&out, 0, sizeof(out));
+      traits::merge_tags(&out, ba, bb, src, n);
+      traits::set_metadata(&out, md);
+      memcpy(&dst_blocks[i], &out, sizeof(out));
+      nentries += n;
+   }
+   return nentries;
+}
+
+// Frees a slot of a full block by moving one of its tags to the alternate
+// block of that tag. Returns false if none of them has room there.
+template <int TAG_BITS>
+static bool make_room(vqf_filter *dst, uint64_t index) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(dst);
+   typename traits::block *block = &blocks[index];
+   __uint128_t slots = used_slots<TAG_BITS>(block);
+
+   for (uint64_t k = 0; slots != 0; k++, slots &= slots - 1) {
+      uint64_t offset = ctz_128(slots) - k;
+      uint64_t slot = traits::TAG_OFFSET + k;
+      uint64_t tag = traits::get_tag(block, k);
+      uint64_t alt_bucket = alternate_index(&dst->metadata, index *
+            traits::BUCKETS_PER_BLOCK + offset, tag);
+      uint64_t alt_index = alt_bucket / traits::BUCKETS_PER_BLOCK;
+      if (alt_index == index || traits::free_space(&blocks[alt_index]) <=
+            traits::BUCKETS_PER_BLOCK)
+         continue;
+      traits::remove_tags(block, slot);
+      traits::remove_md(block, slot + offset - traits::TAG_OFFSET);
+      insert_tags<TAG_BITS>(&blocks[alt_index], tag, alt_bucket %
+            traits::BUCKETS_PER_BLOCK);
+      return true;
+   }
+   return false;
+}
+
+// Inserts the spilled tags in their alternate buckets, or makes room for
+// them in either block by moving another tag to its alternate block. Returns
+// the number of tags that fit nowhere.
+template <int TAG_BITS>
+static uint64_t place_spills_impl(vqf_filter *dst, const vqf_spills *spills) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(dst);
+   uint64_t ndropped = spills->nlost;
+
+   for (uint64_t i = 0; i < spills->n; i++) {
+      uint64_t bucket = spills->entries[i] >> 16;
+      uint64_t tag = spills->entries[i] & 0xffff;
+      uint64_t alt_bucket = alternate_index(&dst->metadata, bucket, tag);
+      uint64_t index = alt_bucket / traits::BUCKETS_PER_BLOCK;
+      uint64_t home = bucket / traits::BUCKETS_PER_BLOCK;
+      if (index != home && (traits::free_space(&blocks[index]) >
+               traits::BUCKETS_PER_BLOCK || make_room<TAG_BITS>(dst, index))) {
+         insert_tags<TAG_BITS>(&blocks[index], tag, alt_bucket %
+               traits::BUCKETS_PER_BLOCK);
+      } else if (make_room<TAG_BITS>(dst, home)) {
+         insert_tags<TAG_BITS>(&blocks[home], tag, bucket %
+               traits::BUCKETS_PER_BLOCK);
+      } else {
+         ndropped++;
+      }
+   }
+   return ndropped;
+}
+
+// Cursors decode a block at a time from the 0s of its metadata, like
+// merges, and read the tags and values in slot order.
+template <int TAG_BITS>
+static uint64_t decode_block_impl(const vqf_filter *filter, uint64_t index,
+      vqf_entry *entries) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   const typename traits::block *block = &get_blocks<TAG_BITS>(filter)[index];
+   const vqf_values *values = filter->metadata.value_bits != 0 ?
+      get_values(filter, index) : NULL;
+   const uint64_t first_bucket = index * traits::BUCKETS_PER_BLOCK;
+
+   return read_block(filter, block, [&] {
+         __uint128_t slots = used_slots<TAG_BITS>(block);
+         uint64_t n = 0;
+         // A word at a time keeps the loops on 64-bit ctz and blsr.
+         for (uint64_t w = 0; w < 2; w++) {
+            for (uint64_t bits = slots >> (64 * w); bits != 0; n++, bits &=
+                  bits - 1) {
+               entries[n].bucket = first_bucket + 64 * w + __builtin_ctzll(bits) - n;
+               entries[n].tag = traits::get_tag(block, n);
+               entries[n].value = 0;
+            }
+         }
+         for (uint64_t i = 0; values != NULL && i < n; i++)
+            entries[i].value = traits::get_value(values, traits::TAG_OFFSET + i);
+         return n;
+   });
+}
+
+// The tags of a block are the 1s of used_slots and a run is a string of 1s,
+// so the longest run is the number of times the string can be shortened by
+// and-ing it with itself shifted by one. Only blocks with more tags than the
+// longest run so far can hold a longer one.
+template <int TAG_BITS>
+static void block_stats_impl(const vqf_filter *filter, uint64_t begin,
+      uint64_t end, vqf_stats *stats) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+   uint64_t nelts = 0, nfull_blocks = 0, longest_run = stats->longest_run;
+
+   for (uint64_t i = begin; i < end; i++) {
+      // The hardware prefetcher alone leaves a third of the bandwidth unused.
+      if (i + VQF_PREFETCH_DISTANCE < end)
+         __builtin_prefetch(&blocks[i + VQF_PREFETCH_DISTANCE]);
+      __uint128_t slots = read_block(filter, &blocks[i], [&] {
+            return used_slots<TAG_BITS>(&blocks[i]);
+      });
+      uint64_t n = __builtin_popcountll((uint64_t)slots) +
+         __builtin_popcountll((uint64_t)(slots >> 64));
+      stats->fill[n]++;
+      nelts += n;
+      nfull_blocks += n == traits::SLOTS_PER_BLOCK - 1;
+      if (n > longest_run) {
+         uint64_t run = 0;
+         for (; slots != 0; run++)
+            slots &= slots >> 1;
+         if (run > longest_run)
+            longest_run = run;
+      }
+   }
+   stats->block_slots = traits::SLOTS_PER_BLOCK - 1;
+   stats->nelts += nelts;
+   stats->nfull_blocks += nfull_blocks;
+   stats->longest_run = longest_run;
+}
+
+// Counting filters keep a key inserted more than twice as a single entry:
+// its tag followed by (0, digit) pairs that hold count - 1 in base
+// 2^TAG_BITS, least significant digit first. Tags are never 0, so a 0 slot
+// always starts a digit pair. Counts of 1 and 2 are one and two bare tags,
+// which take no more slots than a counter. Digits may match the tag of
+// another key, so lookups decode the run instead of trusting match_tags.
+
+// Slots of the entries of one tag found in a run. Slots count the metadata
+// like the tag operations, so 0 means none.
+struct vqf_run_entries {
+   uint64_t count;
+   uint64_t nbare;
+   uint64_t first_bare;
+   uint64_t last_bare;
+   uint64_t counter;
+   uint64_t value;
+   uint64_t ndigits;
+};
+
+template <int TAG_BITS>
+static inline vqf_run_entries scan_run(const typename
+      vqf_block_traits<TAG_BITS>::block *block, uint64_t offset, uint64_t tag) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_run_entries e;
+   memset(&e, 0, sizeof(e));
+
+   uint64_t start = offset != 0 ? select_slot<TAG_BITS>(block, offset - 1) :
+      traits::TAG_OFFSET;
+   uint64_t end = min_u64(select_slot<TAG_BITS>(block, offset),
+         traits::TAG_OFFSET + traits::SLOTS_PER_BLOCK);
+   for (uint64_t slot = start; slot < end; ) {
+      uint64_t entry_tag = traits::get_tag(block, slot - traits::TAG_OFFSET);
+      uint64_t value = 0, ndigits = 0;
+      for (slot++; slot + 1 < end && ndigits < 64 / TAG_BITS &&
+            traits::get_tag(block, slot - traits::TAG_OFFSET) == 0; slot += 2) {
+         value |= traits::get_tag(block, slot + 1 - traits::TAG_OFFSET) <<
+            (TAG_BITS * ndigits);
+         ndigits++;
+      }
+      if (entry_tag != tag)
+         continue;
+      if (ndigits != 0) {
+         e.counter = slot - 2 * ndigits - 1;
+         e.value = value;
+         e.ndigits = ndigits;
+         e.count += value + 1;
+      } else {
+         if (e.nbare++ == 0)
+            e.first_bare = slot - 1;
+         e.last_bare = slot - 1;
+         e.count++;
+      }
+   }
+   return e;
+}
+
+template <int TAG_BITS>
+static inline uint64_t count_run(const typename
+      vqf_block_traits<TAG_BITS>::block *block, uint64_t offset, uint64_t tag) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   if ((traits::match_tags(block, tag) & run_mask<TAG_BITS>(block, offset)) == 0)
+      return 0;
+   return scan_run<TAG_BITS>(block, offset, tag).count;
+}
+
+// The runs a key can be in: its tag, and the block and bucket offset of its
+// primary and alternate buckets.
+template <int TAG_BITS>
+struct vqf_key_runs {
+   uint64_t tag;
+   uint64_t block_index;
+   uint64_t alt_block_index;
+   typename vqf_block_traits<TAG_BITS>::block *block;
+   typename vqf_block_traits<TAG_BITS>::block *alt_block;
+   uint64_t offset;
+   uint64_t alt_offset;
+};
+
+template <int TAG_BITS>
+static inline vqf_key_runs<TAG_BITS> key_runs(vqf_filter * restrict filter,
+      uint64_t hash) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_block_array<TAG_BITS> blocks = get_blocks<TAG_BITS>(filter);
+   vqf_key_runs<TAG_BITS> k;
+
+   k.block_index = primary_index(&filter->metadata, hash);
+   k.tag = key_tag<TAG_BITS>(hash);
+   k.alt_block_index = alternate_index(&filter->metadata, k.block_index, k.tag);
+   k.block = &blocks[k.block_index / traits::BUCKETS_PER_BLOCK];
+   k.alt_block = &blocks[k.alt_block_index / traits::BUCKETS_PER_BLOCK];
+   k.offset = k.block_index % traits::BUCKETS_PER_BLOCK;
+   k.alt_offset = k.alt_block_index % traits::BUCKETS_PER_BLOCK;
+   return k;
+}
+
+template <int TAG_BITS>
+static inline void insert_slot(typename vqf_block_traits<TAG_BITS>::block *
+      block, uint64_t slot, uint64_t offset, uint64_t value) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   traits::update_tags(block, slot, value);
+   traits::update_md(block, slot + offset - traits::TAG_OFFSET);
+}
+
+template <int TAG_BITS>
+static inline void remove_slot(typename vqf_block_traits<TAG_BITS>::block *
+      block, uint64_t slot, uint64_t offset) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   traits::remove_tags(block, slot);
+   traits::remove_md(block, slot + offset - traits::TAG_OFFSET);
+}
+
+// Rewrites the counter at slot, which has room for ndigits digits.
+template <int TAG_BITS>
+static inline void write_counter(typename vqf_block_traits<TAG_BITS>::block *
+      block, uint64_t slot, uint64_t value, uint64_t ndigits) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   for (uint64_t i = 0; i < ndigits; i++) {
+      traits::set_tag(block, slot + 2 * i + 2 - traits::TAG_OFFSET,
+            value & traits::TAG_MASK);
+      value >>= TAG_BITS;
+   }
+}
+
+static inline uint64_t counter_digits(uint64_t value, uint64_t tag_bits) {
+   uint64_t ndigits = 1;
+   while (ndigits < 64 / tag_bits && (value >> (tag_bits * ndigits)) != 0)
+      ndigits++;
+   return ndigits;
+}
+
+// Adds one to the entries e of tag in the run. Returns false if the block
+// has no room for the extra slots.
+template <int TAG_BITS>
+static bool increment_run(typename vqf_block_traits<TAG_BITS>::block *block,
+      uint64_t offset, uint64_t tag, const vqf_run_entries& e) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   uint64_t free_slots = traits::free_space(block) - traits::BUCKETS_PER_BLOCK;
+
+   if (e.counter != 0) {
+      uint64_t value = e.value + 1;
+      uint64_t ndigits = counter_digits(value, TAG_BITS);
+      if (value >> (TAG_BITS * ndigits) != 0)
+         return true;	// saturated
+      if (ndigits > e.ndigits) {
+         if (free_slots < 2)
+            return false;
+         uint64_t slot = e.counter + 2 * e.ndigits + 1;
+         insert_slot<TAG_BITS>(block, slot, offset, 0);
+         insert_slot<TAG_BITS>(block, slot + 1, offset, 0);
+      }
+      write_counter<TAG_BITS>(block, e.counter, value, ndigits);
+   } else if (e.nbare >= 2) {
+      // two bare tags and the new one become a counter of 3
+      if (free_slots < 1)
+         return false;
+      remove_slot<TAG_BITS>(block, e.last_bare, offset);
+      insert_slot<TAG_BITS>(block, e.first_bare + 1, offset, 0);
+      insert_slot<TAG_BITS>(block, e.first_bare + 2, offset, 2);
+   } else {
+      if (free_slots < 1)
+         return false;
+      insert_tags<TAG_BITS>(block, tag, offset);
+   }
+   return true;
+}
+
+// Takes one from the entries e of tag in the run, which has some.
+template <int TAG_BITS>
+static void decrement_run(typename vqf_block_traits<TAG_BITS>::block *block,
+      uint64_t offset, uint64_t tag, const vqf_run_entries& e) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+
+   if (e.counter == 0) {
+      remove_slot<TAG_BITS>(block, e.last_bare, offset);
+   } else if (e.value == 2) {
+      // a count of 2 goes back to two bare tags
+      remove_slot<TAG_BITS>(block, e.counter + 1, offset);
+      traits::set_tag(block, e.counter + 1 - traits::TAG_OFFSET, tag);
+   } else {
+      uint64_t value = e.value - 1;
+      uint64_t ndigits = counter_digits(value, TAG_BITS);
+      for (uint64_t i = ndigits; i < e.ndigits; i++) {
+         remove_slot<TAG_BITS>(block, e.counter + 2 * ndigits + 1, offset);
+         remove_slot<TAG_BITS>(block, e.counter + 2 * ndigits + 1, offset);
+      }
+      write_counter<TAG_BITS>(block, e.counter, value, ndigits);
+   }
+}
+
+// Free slots of the two blocks of a key, which may be the same block.
+template <int TAG_BITS>
+static inline uint64_t key_free_space(const vqf_key_runs<TAG_BITS>& k) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   return traits::free_space(k.block) + (k.alt_block != k.block ?
+         traits::free_space(k.alt_block) : 0);
+}
+
+// An insert adds to the entry of the key in either block, or adds a bare tag
+// to the least loaded block like insert_impl. The size of a counting filter
+// is the number of slots it uses, so the inserts and removes add the slots
+// they take or free to it.
+template <int TAG_BITS>
+static bool count_insert_impl(vqf_filter * restrict filter, uint64_t hash) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_key_runs<TAG_BITS> k = key_runs<TAG_BITS>(filter, hash);
+
+   lock_blocks<TAG_BITS>(filter, k.block_index, k.alt_block_index);
+   uint64_t free_before = key_free_space<TAG_BITS>(k);
+   vqf_run_entries e = scan_run<TAG_BITS>(k.block, k.offset, k.tag);
+   bool inserted = false;
+   if (e.count != 0) {
+      inserted = increment_run<TAG_BITS>(k.block, k.offset, k.tag, e);
+   } else if (k.alt_block_index != k.block_index) {
+      e = scan_run<TAG_BITS>(k.alt_block, k.alt_offset, k.tag);
+      if (e.count != 0)
+         inserted = increment_run<TAG_BITS>(k.alt_block, k.alt_offset, k.tag, e);
+   }
+   if (!inserted) {
+      // pick the least loaded block
+      typename traits::block *block = k.block;
+      uint64_t offset = k.offset;
+      uint64_t block_free = traits::free_space(k.block);
+      uint64_t alt_block_free = traits::free_space(k.alt_block);
+      if (alt_block_free > block_free) {
+         block = k.alt_block;
+         offset = k.alt_offset;
+         block_free = alt_block_free;
+      }
+      if (block_free > traits::BUCKETS_PER_BLOCK) {
+         insert_tags<TAG_BITS>(block, k.tag, offset);
+         inserted = true;
+      }
+   }
+   uint64_t nslots = free_before - key_free_space<TAG_BITS>(k);
+   unlock_blocks<TAG_BITS>(filter, k.block_index, k.alt_block_index);
+   if (nslots != 0)
+      vqf_add_size(filter, nslots);
+   return inserted;
+}
+
+template <int TAG_BITS>
+static bool count_remove_impl(vqf_filter * restrict filter, uint64_t hash) {
+   vqf_key_runs<TAG_BITS> k = key_runs<TAG_BITS>(filter, hash);
+
+   lock_blocks<TAG_BITS>(filter, k.block_index, k.alt_block_index);
+   uint64_t free_before = key_free_space<TAG_BITS>(k);
+   bool removed = false;
+   vqf_run_entries e = scan_run<TAG_BITS>(k.block, k.offset, k.tag);
+   if (e.count != 0) {
+      decrement_run<TAG_BITS>(k.block, k.offset, k.tag, e);
+      removed = true;
+   } else if (k.alt_block_index != k.block_index) {
+      e = scan_run<TAG_BITS>(k.alt_block, k.alt_offset, k.tag);
+      if (e.count != 0) {
+         decrement_run<TAG_BITS>(k.alt_block, k.alt_offset, k.tag, e);
+         removed = true;
+      }
+   }
+   uint64_t nslots = key_free_space<TAG_BITS>(k) - free_before;
+   unlock_blocks<TAG_BITS>(filter, k.block_index, k.alt_block_index);
+   if (nslots != 0)
+      vqf_add_size(filter, -(int64_t)nslots);
+   return removed;
+}
+
+template <int TAG_BITS>
+static uint64_t count_impl(vqf_filter * restrict filter, uint64_t hash) {
+   vqf_key_runs<TAG_BITS> k = key_runs<TAG_BITS>(filter, hash);
+
+   __builtin_prefetch(k.alt_block);
+
+   uint64_t count = read_block(filter, k.block, [&] {
+         return count_run<TAG_BITS>(k.block, k.offset, k.tag);
+   });
+   if (k.alt_block_index != k.block_index) {
+      count += read_block(filter, k.alt_block, [&] {
+            return count_run<TAG_BITS>(k.alt_block, k.alt_offset, k.tag);
+      });
+   }
+   return count;
+}
+
+template <int TAG_BITS>
+static bool count_is_present_impl(vqf_filter * restrict filter, uint64_t hash) {
+   return count_impl<TAG_BITS>(filter, hash) != 0;
+}
+
+// In a plain filter every insert of a key adds a tag, so its count is the
+// number of matching tags in its two runs.
+template <int TAG_BITS>
+static uint64_t match_count_impl(vqf_filter * restrict filter, uint64_t hash) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_key_runs<TAG_BITS> k = key_runs<TAG_BITS>(filter, hash);
+
+   uint64_t count = read_block(filter, k.block, [&] {
+         return (uint64_t)__builtin_popcountll(traits::match_tags(k.block, k.tag) &
+               run_mask<TAG_BITS>(k.block, k.offset));
+   });
+   if (k.alt_block_index != k.block_index) {
+      count += read_block(filter, k.alt_block, [&] {
+            return (uint64_t)__builtin_popcountll(traits::match_tags(k.alt_block,
+                     k.tag) & run_mask<TAG_BITS>(k.alt_block, k.alt_offset));
+      });
+   }
+   return count;
+}
+
+// Counting filters update one key at a time.
+template <bool (*update)(vqf_filter * restrict, uint64_t)>
+static uint64_t scalar_update_batch(vqf_filter * restrict filter, const
+      uint64_t * restrict hashes, uint64_t nhashes, bool * restrict results) {
+   uint64_t nfailures = 0;
+   for (uint64_t i = 0; i < nhashes; i++) {
+      results[i] = update(filter, hashes[i]);
+      nfailures += !results[i];
+   }
+   return nfailures;
+}
+
+template <int TAG_BITS>
+static uint64_t count_is_present_batch_impl(vqf_filter * restrict filter,
+      const uint64_t * restrict hashes, uint64_t nhashes, bool * restrict
+      results) {
+   uint64_t npositives = 0;
+   for (uint64_t i = 0; i < nhashes; i++) {
+      results[i] = count_is_present_impl<TAG_BITS>(filter, hashes[i]);
+      npositives += results[i];
+   }
+   return npositives;
+}
+
+// Maplets keep a value per slot in the lane of the slot, which the inserts and
+// removes above shift along with the tags. A lookup returns the value of the
+// first matching tag of the two runs, the one a remove would take.
+template <int TAG_BITS>
+static bool insert_kv_impl(vqf_filter * restrict filter, uint64_t hash,
+      uint64_t value) {
+   return insert_entry<TAG_BITS, true>(filter, hash, value);
+}
+
+template <int TAG_BITS>
+static bool maplet_insert_impl(vqf_filter * restrict filter, uint64_t hash) {
+   return insert_entry<TAG_BITS, true>(filter, hash, 0);
+}
+
+template <int TAG_BITS>
+static inline bool lookup_value(vqf_filter * restrict filter, uint64_t tag,
+      uint64_t block_index, uint64_t *value) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   uint64_t index = block_index / traits::BUCKETS_PER_BLOCK;
+   uint64_t offset = block_index % traits::BUCKETS_PER_BLOCK;
+   const typename traits::block *block = &get_blocks<TAG_BITS>(filter)[index];
+   const vqf_values *values = get_values(filter, index);
+
+   return read_block(filter, block, [&] {
+         uint64_t matches = traits::match_tags(block, tag) &
+            run_mask<TAG_BITS>(block, offset);
+         if (matches == 0)
+            return false;
+         *value = traits::get_value(values, __builtin_ctzll(matches));
+         return true;
+   });
+}
+
+template <int TAG_BITS>
+static bool get_impl(vqf_filter * restrict filter, uint64_t hash, uint64_t
+      *value) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   vqf_key_runs<TAG_BITS> k = key_runs<TAG_BITS>(filter, hash);
+
+   __builtin_prefetch(get_values(filter, k.block_index / traits::BUCKETS_PER_BLOCK));
+   __builtin_prefetch(k.alt_block);
+   __builtin_prefetch(get_values(filter, k.alt_block_index /
+            traits::BUCKETS_PER_BLOCK));
+
+   return lookup_value<TAG_BITS>(filter, k.tag, k.block_index, value) ||
+      lookup_value<TAG_BITS>(filter, k.tag, k.alt_block_index, value);
+}
+
+// Other filters store no values.
+template <bool (*is_present)(vqf_filter * restrict, uint64_t)>
+static bool get_no_value(vqf_filter * restrict filter, uint64_t hash, uint64_t
+      *value) {
+   *value = 0;
+   return is_present(filter, hash);
+}
+
+static bool insert_kv_unsupported(vqf_filter * restrict filter, uint64_t hash,
+      uint64_t value) {
+   return false;
+}
+
+#define VQF_OPS(tag_bits) { \
+   VQF_VARIANT_ID, \
+   vqf_block_traits<tag_bits>::BUCKETS_PER_BLOCK, \
+   vqf_block_traits<tag_bits>::SLOTS_PER_BLOCK, \
+   VQF_BLOCK_SHIFT, \
+   insert_impl<tag_bits>, \
+   remove_impl<tag_bits>, \
+   is_present_impl<tag_bits>, \
+   insert_batch_impl<tag_bits>, \
+   remove_batch_impl<tag_bits>, \
+   is_present_batch_impl<tag_bits>, \
+   match_count_impl<tag_bits>, \
+   insert_kv_unsupported, \
+   get_no_value<is_present_impl<tag_bits> >, \
+   merge_blocks_impl<tag_bits>, \
+   place_spills_impl<tag_bits>, \
+   decode_block_impl<tag_bits>, \
+   placement_impl<tag_bits>, \
+   block_stats_impl<tag_bits> \
+}
+
+#define VQF_COUNTING_OPS(tag_bits) { \
+   VQF_VARIANT_ID, \
+   vqf_block_traits<tag_bits>::BUCKETS_PER_BLOCK, \
+   vqf_block_traits<tag_bits>::SLOTS_PER_BLOCK, \
+   VQF_BLOCK_SHIFT, \
+   count_insert_impl<tag_bits>, \
+   count_remove_impl<tag_bits>, \
+   count_is_present_impl<tag_bits>, \
+   scalar_update_batch<count_insert_impl<tag_bits> >, \
+   scalar_update_batch<count_remove_impl<tag_bits> >, \
+   count_is_present_batch_impl<tag_bits>, \
+   count_impl<tag_bits>, \
+   insert_kv_unsupported, \
+   get_no_value<count_is_present_impl<tag_bits> >, \
+   NULL, \
+   NULL, \
+   decode_block_impl<tag_bits>, \
+   placement_impl<tag_bits>, \
+   block_stats_impl<tag_bits> \
+}
+
+// Maplet batches move the values one key at a time.
+#define VQF_MAPLET_OPS(tag_bits) { \
+   VQF_VARIANT_ID, \
+   vqf_block_traits<tag_bits>::BUCKETS_PER_BLOCK, \
+   vqf_block_traits<tag_bits>::SLOTS_PER_BLOCK, \
+   VQF_MAPLET_BLOCK_SHIFT, \
+   maplet_insert_impl<tag_bits>, \
+   remove_impl<tag_bits, true>, \
+   is_present_impl<tag_bits>, \
+   scalar_update_batch<maplet_insert_impl<tag_bits> >, \
+   scalar_update_batch<remove_impl<tag_bits, true> >, \
+   is_present_batch_impl<tag_bits>, \
+   match_count_impl<tag_bits>, \
+   insert_kv_impl<tag_bits>, \
+   get_impl<tag_bits>, \
+   NULL, \
+   NULL, \
+   decode_block_impl<tag_bits>, \
+   placement_impl<tag_bits>, \
+   block_stats_impl<tag_bits> \
+}
+
+// Filters mapped read-only from a file reject updates.
+static bool update_read_only(vqf_filter * restrict filter, uint64_t hash) {
+   return false;
+}
+
+static uint64_t update_batch_read_only(vqf_filter * restrict filter, const
+      uint64_t * restrict hashes, uint64_t nhashes, bool * restrict results) {
+   memset(results, 0, nhashes * sizeof(results[0]));
+   return nhashes;
+}
+
+#define VQF_READ_ONLY_OPS(tag_bits) { \
+   VQF_VARIANT_ID, \
+   vqf_block_traits<tag_bits>::BUCKETS_PER_BLOCK, \
+   vqf_block_traits<tag_bits>::SLOTS_PER_BLOCK, \
+   VQF_BLOCK_SHIFT, \
+   update_read_only, \
+   update_read_only, \
+   is_present_impl<tag_bits>, \
+   update_batch_read_only, \
+   update_batch_read_only, \
+   is_present_batch_impl<tag_bits>, \
+   match_count_impl<tag_bits>, \
+   insert_kv_unsupported, \
+   get_no_value<is_present_impl<tag_bits> >, \
+   NULL, \
+   NULL, \
+   decode_block_impl<tag_bits>, \
+   placement_impl<tag_bits>, \
+   block_stats_impl<tag_bits> \
+}
+
+#define VQF_COUNTING_READ_ONLY_OPS(tag_bits) { \
+   VQF_VARIANT_ID, \
+   vqf_block_traits<tag_bits>::BUCKETS_PER_BLOCK, \
+   vqf_block_traits<tag_bits>::SLOTS_PER_BLOCK, \
+   VQF_BLOCK_SHIFT, \
+   update_read_only, \
+   update_read_only, \
+   count_is_present_impl<tag_bits>, \
+   update_batch_read_only, \
+   update_batch_read_only, \
+   count_is_present_batch_impl<tag_bits>, \
+   count_impl<tag_bits>, \
+   insert_kv_unsupported, \
+   get_no_value<count_is_present_impl<tag_bits> >, \
+   NULL, \
+   NULL, \
+   decode_block_impl<tag_bits>, \
+   placement_impl<tag_bits>, \
+   block_stats_impl<tag_bits> \
+}
+
+#define VQF_MAPLET_READ_ONLY_OPS(tag_bits) { \
+   VQF_VARIANT_ID, \
+   vqf_block_traits<tag_bits>::BUCKETS_PER_BLOCK, \
+   vqf_block_traits<tag_bits>::SLOTS_PER_BLOCK, \
+   VQF_MAPLET_BLOCK_SHIFT, \
+   update_read_only, \
+   update_read_only, \
+   is_present_impl<tag_bits>, \
+   update_batch_read_only, \
+   update_batch_read_only, \
+   is_present_batch_impl<tag_bits>, \
+   match_count_impl<tag_bits>, \
+   insert_kv_unsupported, \
+   get_impl<tag_bits>, \
+   NULL, \
+   NULL, \
+   decode_block_impl<tag_bits>, \
+   placement_impl<tag_bits>, \
+   block_stats_impl<tag_bits> \
+}
+
+// The operations of each tag size, indexed by ops_index.
+#define VQF_ALL_OPS(tag_bits) { \
+   VQF_OPS(tag_bits), \
+   VQF_READ_ONLY_OPS(tag_bits), \
+   VQF_COUNTING_OPS(tag_bits), \
+   VQF_COUNTING_READ_ONLY_OPS(tag_bits), \
+   VQF_MAPLET_OPS(tag_bits), \
+   VQF_MAPLET_READ_ONLY_OPS(tag_bits) \
+}
+
+static const vqf_ops vqf_ops_8[] = VQF_ALL_OPS(8);
+static const vqf_ops vqf_ops_12[] = VQF_ALL_OPS(12);
+static const vqf_ops vqf_ops_16[] = VQF_ALL_OPS(16);
+
+static inline uint64_t ops_index(bool counting, bool maplet, bool read_only) {
+   return 2 * (counting ? 1 : maplet ? 2 : 0) + read_only;
+}
+
+const vqf_ops * get_ops(uint64_t tag_bits, bool counting, bool maplet, bool
+      read_only) {
+   uint64_t index = ops_index(counting, maplet, read_only);
+
+   switch (tag_bits) {
+      case 8:
+         return &vqf_ops_8[index];
+      case 12:
+         return &vqf_ops_12[index];
+      case 16:
+         return &vqf_ops_16[index];
+      default:
+         return NULL;
+   }
+}
+
+vqf_filter * init(uint64_t nslots, uint64_t tag_bits, vqf_addressing
+      addressing, bool counting, uint64_t value_bits) {
+   const vqf_ops *ops = get_ops(tag_bits, counting, value_bits != 0, false);
+
+   switch (tag_bits) {
+      case 8:
+         return init_impl<8>(nslots, addressing, counting, value_bits, ops);
+      case 12:
+         return init_impl<12>(nslots, addressing, counting, value_bits, ops);
+      case 16:
+         return init_impl<16>(nslots, addressing, counting, value_bits, ops);
+      default:
+         fprintf(stderr, "Tag size must be 8, 12 or 16 bits.\n");
+         return NULL;
+   }
+}
+
+}	// namespace VQF_VARIANT
@@ -0,0 +1,224 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_kernel_bench.c
+ *
+ *    Description:  Microbenchmarks of the block kernels. Like vqf_filter.c,
+ *                  this file is built once per instruction set, so the
+ *                  AVX512 permutes are timed next to the memmove fallbacks.
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#include "vqf_block.h"
+#include "vqf_kernel_bench.h"
+
+namespace VQF_VARIANT {
+
+// A round times one call on each of BENCH_BLOCKS copies of a block, 4KB in
+// all, so that the blocks stay in L1 and every call starts from the same
+// block.
+#define BENCH_BLOCKS 64
+#define BENCH_FILLS 5
+
+enum {
+   KERNEL_LOOKUP,
+   KERNEL_SELECT,
+   KERNEL_UPDATE_MD,
+   KERNEL_UPDATE_TAGS,
+   KERNEL_REMOVE_MD,
+   KERNEL_REMOVE_TAGS,
+   KERNEL_CHECK_TAGS,
+   NKERNELS
+};
+
+static const char *kernel_names[NKERNELS] = {"lookup", "select_slot",
+   "update_md", "update_tags", "remove_md", "remove_tags", "check_tags"};
+
+static inline uint64_t start_tsc(void) {
+   _mm_lfence();
+   return __rdtsc();
+}
+
+static inline uint64_t stop_tsc(void) {
+   unsigned int aux;
+   uint64_t tsc = __rdtscp(&aux);
+   _mm_lfence();
+   return tsc;
+}
+
+static uint64_t bench_rand(uint64_t *state) {
+   uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+// Returns the fewest ticks per call of all the rounds. The barrier keeps the
+// compiler from dropping a call or merging calls on different copies.
+template <typename Block, typename Call>
+static double time_call(const Block *block, uint64_t rounds, Call call) {
+   static Block copies[BENCH_BLOCKS] __attribute__ ((aligned (64)));
+   uint64_t best = UINT64_MAX;
+   for (uint64_t r = 0; r < rounds; r++) {
+      for (uint64_t i = 0; i < BENCH_BLOCKS; i++)
+         copies[i] = *block;
+      uint64_t start = start_tsc();
+      for (uint64_t i = 0; i < BENCH_BLOCKS; i++) {
+         call(&copies[i]);
+         asm volatile("" : : "r"(&copies[i]) : "memory");
+      }
+      uint64_t ticks = stop_tsc() - start;
+      if (ticks < best)
+         best = ticks;
+   }
+   return (double)best / BENCH_BLOCKS;
+}
+
+// Fills the block with nitems random tags in random buckets, the way
+// insert_tags does.
+template <int TAG_BITS>
+static void fill_block(typename vqf_block_traits<TAG_BITS>::block *block,
+      uint64_t nitems, uint64_t seed) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   traits::init(block);
+   memset(block->tags, 0, sizeof(block->tags));
+   for (uint64_t i = 0; i < nitems; i++) {
+      uint64_t offset = bench_rand(&seed) % traits::BUCKETS_PER_BLOCK;
+      uint64_t tag = bench_rand(&seed) % traits::TAG_MASK + 1;
+      uint64_t slot = select_slot<TAG_BITS>(block, offset);
+      traits::update_tags(block, slot, tag);
+      traits::update_md(block, slot + offset - traits::TAG_OFFSET);
+   }
+}
+
+// The metadata bit of the tag in slot i: its i'th 0.
+template <int TAG_BITS>
+static uint64_t slot_md_index(const typename vqf_block_traits<TAG_BITS>::block
+      *block, uint64_t slot) {
+   __uint128_t md = vqf_block_traits<TAG_BITS>::metadata(block);
+   for (uint64_t index = 0, zeros = 0; ; index++) {
+      if (((md >> index) & 1) == 0 && zeros++ == slot)
+         return index;
+   }
+}
+
+template <int TAG_BITS>
+static void bench(uint64_t rounds) {
+   typedef vqf_block_traits<TAG_BITS> traits;
+   typedef typename traits::block block;
+   const uint64_t capacity = traits::SLOTS_PER_BLOCK - 1;
+   const uint64_t fills[BENCH_FILLS] = {0, capacity / 4, capacity / 2,
+      3 * capacity / 4, capacity};
+   double mean[NKERNELS][BENCH_FILLS], max[NKERNELS][BENCH_FILLS];
+
+   block empty;
+   traits::init(&empty);
+   double overhead = time_call(&empty, rounds, [](block *) {});
+
+   for (uint64_t f = 0; f < BENCH_FILLS; f++) {
+      block tmpl;
+      fill_block<TAG_BITS>(&tmpl, fills[f], f + 1);
+      uint64_t seed = f + 1;
+      double ticks_sum[NKERNELS] = {0};
+      double ticks_max[NKERNELS] = {0};
+      uint64_t ncalls[NKERNELS] = {0};
+      auto record = [&](int kernel, double ticks) {
+         ticks = ticks > overhead ? ticks - overhead : 0;
+         ticks_sum[kernel] += ticks;
+         ncalls[kernel]++;
+         if (ticks > ticks_max[kernel])
+            ticks_max[kernel] = ticks;
+      };
+
+      // Kernels of a bucket: lookups, and inserts while there is room.
+      for (uint64_t offset = 0; offset < traits::BUCKETS_PER_BLOCK; offset++) {
+         uint64_t slot = select_slot<TAG_BITS>(&tmpl, offset);
+         uint8_t index = slot + offset - traits::TAG_OFFSET;
+         uint64_t tag = bench_rand(&seed) % traits::TAG_MASK + 1;
+         // A tag of the block, so that the run is masked like on a hit.
+         uint64_t check_tag = fills[f] != 0 ? traits::get_tag(&tmpl, 0) : tag;
+
+         record(KERNEL_LOOKUP, time_call(&tmpl, rounds, [=](block *b) {
+            uint64_t result = traits::lookup(b, offset);
+            asm volatile("" : : "r"(result));
+         }));
+         record(KERNEL_SELECT, time_call(&tmpl, rounds, [=](block *b) {
+            uint64_t result = select_slot<TAG_BITS>(b, offset);
+            asm volatile("" : : "r"(result));
+         }));
+         record(KERNEL_CHECK_TAGS, time_call(&tmpl, rounds, [=](block *b) {
+            uint64_t result = traits::match_tags(b, check_tag);
+            bool found = result != 0 && (run_mask<TAG_BITS>(b, offset) &
+                  result) != 0;
+            asm volatile("" : : "r"(found));
+         }));
+         if (fills[f] < capacity) {
+            record(KERNEL_UPDATE_MD, time_call(&tmpl, rounds, [=](block *b) {
+               traits::update_md(b, index);
+            }));
+            record(KERNEL_UPDATE_TAGS, time_call(&tmpl, rounds, [=](block *b) {
+               traits::update_tags(b, slot, tag);
+            }));
+         }
+      }
+
+      // Kernels of a slot: removes of every tag.
+      for (uint64_t slot = 0; slot < fills[f]; slot++) {
+         uint8_t index = slot_md_index<TAG_BITS>(&tmpl, slot);
+         uint8_t tag_index = slot + traits::TAG_OFFSET;
+         record(KERNEL_REMOVE_MD, time_call(&tmpl, rounds, [=](block *b) {
+            traits::remove_md(b, index);
+         }));
+         record(KERNEL_REMOVE_TAGS, time_call(&tmpl, rounds, [=](block *b) {
+            traits::remove_tags(b, tag_index);
+         }));
+      }
+
+      for (int k = 0; k < NKERNELS; k++) {
+         mean[k][f] = ncalls[k] != 0 ? ticks_sum[k] / ncalls[k] : -1;
+         max[k][f] = ticks_max[k];
+      }
+   }
+
+   printf("%d-bit tags, %ld buckets and %ld slots per block: TSC ticks per"
+         " call, mean/max over the offsets, by items in the block\n",
+         TAG_BITS, traits::BUCKETS_PER_BLOCK, capacity);
+   printf("%-12s", "items");
+   for (uint64_t f = 0; f < BENCH_FILLS; f++)
+      printf(" %13ld", fills[f]);
+   printf("\n");
+   for (int k = 0; k < NKERNELS; k++) {
+      printf("%-12s", kernel_names[k]);
+      for (uint64_t f = 0; f < BENCH_FILLS; f++) {
+         if (mean[k][f] < 0)
+            printf(" %13s", "-");
+         else
+            printf("   %5.1f/%-5.1f", mean[k][f], max[k][f]);
+      }
+      printf("\n");
+   }
+}
+
+bool bench_kernels(uint64_t tag_bits, uint64_t rounds) {
+   switch (tag_bits) {
+      case 8:
+         bench<8>(rounds);
+         return true;
+      case 12:
+         bench<12>(rounds);
+         return true;
+      case 16:
+         bench<16>(rounds);
+         return true;
+      default:
+         return false;
+   }
+}
+
+}	// namespace VQF_VARIANT
@@ -0,0 +1,107 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_merge.c
+ *
+ *    Description:  Union and intersection of two filters, block by block on
+ *                  several threads.
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vqf_filter.h"
+#include "vqf_dispatch.h"
+
+// Every thread merges a contiguous range of blocks and keeps its own spills.
+// Spills go to other blocks, so they are placed once all ranges are done.
+typedef struct merge_task {
+   vqf_filter *dst;
+   const vqf_filter *a;
+   const vqf_filter *b;
+   uint64_t begin;
+   uint64_t end;
+   bool intersect;
+   struct vqf_spills spills;
+   uint64_t nentries;
+} merge_task;
+
+static void * merge_range(void *arg) {
+   merge_task *task = (merge_task *)arg;
+   task->nentries = task->dst->ops->merge_blocks(task->dst, task->a, task->b,
+         task->begin, task->end, task->intersect, &task->spills);
+   return NULL;
+}
+
+static bool same_geometry(const vqf_filter *x, const vqf_filter *y) {
+   return x->metadata.nblocks == y->metadata.nblocks &&
+      x->metadata.range == y->metadata.range &&
+      x->metadata.key_remainder_bits == y->metadata.key_remainder_bits &&
+      x->metadata.addressing == y->metadata.addressing;
+}
+
+static bool plain(const vqf_filter *filter) {
+   return !filter->metadata.counting && filter->metadata.value_bits == 0;
+}
+
+static bool merge(vqf_filter *dst, const vqf_filter *a, const vqf_filter *b,
+      uint64_t nthreads, bool intersect, vqf_merge_report *report) {
+   memset(report, 0, sizeof(*report));
+   if (dst->ops->merge_blocks == NULL || !plain(dst) || !plain(a) ||
+         !plain(b) || !same_geometry(dst, a) || !same_geometry(dst, b)) {
+      fprintf(stderr, "vqf filters can't be merged.\n");
+      return false;
+   }
+   // An intersection reads other blocks of b than the one it writes.
+   if (intersect && dst == b) {
+      b = a;
+      a = dst;
+   }
+
+   uint64_t nblocks = dst->metadata.nblocks;
+   if (nthreads > nblocks)
+      nthreads = nblocks;
+   if (nthreads == 0)
+      nthreads = 1;
+   merge_task *tasks = (merge_task *)calloc(nthreads, sizeof(*tasks));
+   if (tasks == NULL)
+      return false;
+
+   for (uint64_t t = 0; t < nthreads; t++) {
+      tasks[t].dst = dst;
+      tasks[t].a = a;
+      tasks[t].b = b;
+      tasks[t].begin = nblocks * t / nthreads;
+      tasks[t].end = nblocks * (t + 1) / nthreads;
+      tasks[t].intersect = intersect;
+   }
+   vqf_run_tasks(merge_range, tasks, sizeof(*tasks), nthreads);
+
+   for (uint64_t t = 0; t < nthreads; t++) {
+      struct vqf_spills *spills = &tasks[t].spills;
+      uint64_t ndropped = dst->ops->place_spills(dst, spills);
+      report->nentries += tasks[t].nentries;
+      report->nmoved += spills->n + spills->nlost - ndropped;
+      report->ndropped += ndropped;
+      free(spills->entries);
+   }
+   report->nentries += report->nmoved;
+   vqf_set_size(dst, report->nentries);
+
+   free(tasks);
+   return true;
+}
+
+bool vqf_union(vqf_filter *dst, const vqf_filter *a, const vqf_filter *b,
+      uint64_t nthreads, vqf_merge_report *report) {
+   return merge(dst, a, b, nthreads, false, report);
+}
+
+bool vqf_intersect(vqf_filter *dst, const vqf_filter *a, const vqf_filter *b,
+      uint64_t nthreads, vqf_merge_report *report) {
+   return merge(dst, a, b, nthreads, true, report);
+}
@@ -0,0 +1,70 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  vqf_stats.c
+ *
+ *    Description:  Occupancy of a filter, scanned on several threads.
+ *
+ * ============================================================================
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vqf_filter.h"
+#include "vqf_dispatch.h"
+
+// Every thread scans a contiguous range of blocks into its own stats, which
+// are summed at the end.
+typedef struct stats_task {
+   const vqf_filter *filter;
+   uint64_t begin;
+   uint64_t end;
+   vqf_stats stats;
+} stats_task;
+
+static void * stats_range(void *arg) {
+   stats_task *task = (stats_task *)arg;
+   task->filter->ops->block_stats(task->filter, task->begin, task->end,
+         &task->stats);
+   return NULL;
+}
+
+void vqf_get_stats(const vqf_filter *filter, uint64_t nthreads, vqf_stats
+      *stats) {
+   uint64_t nblocks = filter->metadata.nblocks;
+   memset(stats, 0, sizeof(*stats));
+   stats->nblocks = nblocks;
+
+   if (nthreads > nblocks)
+      nthreads = nblocks;
+   if (nthreads == 0)
+      nthreads = 1;
+   stats_task *tasks = (stats_task *)calloc(nthreads, sizeof(*tasks));
+   if (tasks == NULL) {
+      // Scan on the calling thread alone.
+      filter->ops->block_stats(filter, 0, nblocks, stats);
+      return;
+   }
+
+   for (uint64_t t = 0; t < nthreads; t++) {
+      tasks[t].filter = filter;
+      tasks[t].begin = nblocks * t / nthreads;
+      tasks[t].end = nblocks * (t + 1) / nthreads;
+   }
+   vqf_run_tasks(stats_range, tasks, sizeof(*tasks), nthreads);
+
+   for (uint64_t t = 0; t < nthreads; t++) {
+      const vqf_stats *s = &tasks[t].stats;
+      stats->block_slots = s->block_slots;
+      stats->nelts += s->nelts;
+      stats->nfull_blocks += s->nfull_blocks;
+      if (s->longest_run > stats->longest_run)
+         stats->longest_run = s->longest_run;
+      for (uint64_t i = 0; i < VQF_STATS_FILL_SIZE; i++)
+         stats->fill[i] += s->fill[i];
+   }
+
+   free(tasks);
+}